@@ -0,0 +1,139 @@
+/*
+ ** Random table updates through the small-message aggregator
+ **
+ ** usage: aggregate.x [updates buffer_bytes max_age_us]
+ **
+ ** Every rank sends 8-byte updates to random slots of a table spread over
+ ** all ranks. The owner of a slot increments it in a handler. The table
+ ** sum is checked against the number of updates sent after the drain.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+#include "aggregate.h"
+
+#define NUMBER_OF_UPDATES        1000000
+#define BUFFER_BYTES             8192
+#define MAX_AGE_USEC             100
+#define TABLE_SLOTS              (1 << 16)
+#define SLOTS_PER_PEER           2
+#define UPDATE_HANDLER           0
+#define ROOT                     0
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+static void update(void *ctx, int source, const void *data, uint32_t length) {
+    uint64_t *table = (uint64_t *) ctx;
+    uint64_t index;
+
+    (void) source;
+    assert(length == sizeof(uint64_t));
+    memcpy(&index, data, sizeof(uint64_t));
+    table[index % TABLE_SLOTS]++;
+}
+
+int main(int argc, char **argv)
+{
+    long updates = NUMBER_OF_UPDATES;
+    uint64_t buffer_bytes = BUFFER_BYTES;
+    uint64_t max_age_us = MAX_AGE_USEC;
+    long i;
+    int rc;
+
+    if(argc == 4) {
+	updates = atol(argv[1]);
+	buffer_bytes = atol(argv[2]);
+	max_age_us = atol(argv[3]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+
+    int number_of_cq_entries = 4 * node.world_size * SLOTS_PER_PEER;
+    int number_of_dest_cq_entries = 4 * node.world_size * SLOTS_PER_PEER;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    Aggregator agg;
+    agg.init(&node, buffer_bytes, SLOTS_PER_PEER, max_age_us * 1000);
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, agg.sendBytes());
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, agg.recvBytes());
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, agg.sendBytes(), receive_buffer, agg.recvBytes());
+    agg.commit(0, 0);
+
+    uint64_t *table = (uint64_t *) calloc(TABLE_SLOTS, sizeof(uint64_t));
+    assert(table != NULL);
+    agg.registerHandler(UPDATE_HANDLER, update, table);
+
+    if(node.world_rank == ROOT) {
+	printf("\nranks = %d, updates per rank = %ld, buffer = %lu bytes, max age = %lu us\n",
+		node.world_size, updates, buffer_bytes, max_age_us);
+	printf("\nupdates/s per rank\n");
+    }
+
+    srand(node.world_rank + 1);
+
+    struct timeval t1, t2;
+
+    node.uGNI_barrier();
+    gettimeofday(&t1, NULL);
+    for(i = 0; i < updates; i++) {
+	uint64_t index = ((uint64_t) rand() << 16) ^ rand();
+	if(agg.send(index % node.world_size, UPDATE_HANDLER, &index, sizeof(index)) != 0) {
+	    fprintf(stderr, "Rank %d update %ld failed\n", node.world_rank, i);
+	    break;
+	}
+	if((i & 63) == 0)
+	    agg.poll();
+    }
+    if(agg.drain() != 0)
+	fprintf(stderr, "Rank %d drain failed\n", node.world_rank);
+    gettimeofday(&t2, NULL);
+
+    /*The table must count every update sent by any rank*/
+    uint64_t local_sum = 0, total_sum = 0;
+    for(i = 0; i < TABLE_SLOTS; i++)
+	local_sum += table[i];
+    MPI_Reduce(&local_sum, &total_sum, 1, MPI_UINT64_T, MPI_SUM, ROOT, MPI_COMM_WORLD);
+
+    double rate = updates / elapsed_usec(&t1, &t2) * 1e6;
+    double min_rate = 0;
+    MPI_Reduce(&rate, &min_rate, 1, MPI_DOUBLE, MPI_MIN, ROOT, MPI_COMM_WORLD);
+
+    if(node.world_rank == ROOT) {
+	printf("%12.0f\n", min_rate);
+	if(total_sum != (uint64_t) updates * node.world_size)
+	    printf("Error: table holds %lu updates, expected %lu\n", total_sum, (uint64_t) updates * node.world_size);
+    }
+    agg.printStats();
+
+    agg.destroy();
+    node.uGNI_finalize();
+
+    free(table);
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
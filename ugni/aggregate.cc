@@ -0,0 +1,488 @@
+// Small-message aggregation for the node class, see aggregate.h.
+
+#include "aggregate.h"
+
+#define AGG_FLUSH_FULL     0
+#define AGG_FLUSH_AGED     1
+#define AGG_FLUSH_EXPLICIT 2
+
+/* Bytes a record of length payload bytes takes in a batch. */
+static inline uint64_t record_bytes(uint32_t length) {
+    return (sizeof(agg_record_t) + length + 3) & ~(uint64_t) 3;
+}
+
+/*
+ * Prepare aggregation towards every rank with coalescing buffers of
+ * buf_bytes, slots batches in flight per peer, and buffers flushed once
+ * their oldest record is max_age_ns old (0 flushes on size and explicit
+ * flushes only). No handlers are registered yet.
+ */
+void Aggregator::init(Node *nd, uint64_t bytes, int num_slots, uint64_t age_ns) {
+    int n = nd->world_size;
+    int i;
+
+    assert(bytes % 8 == 0 && bytes >= sizeof(agg_batch_t) + 2 * sizeof(agg_record_t));
+    assert(num_slots > 0);
+
+    node = nd;
+    buf_bytes = bytes;
+    slots = num_slots;
+    max_age_ns = age_ns;
+    send_base = 0;
+    recv_base = 0;
+    num_open = 0;
+    depth = 0;
+    stream = node->uGNI_streamAlloc();
+
+    dests = (agg_dest_t *) calloc(n, sizeof(agg_dest_t));
+    sources = (agg_source_t *) calloc(n, sizeof(agg_source_t));
+    flush_reqs = (uGNI_req_t *) malloc((size_t) n * slots * sizeof(uGNI_req_t));
+    open_dests = (int *) malloc(n * sizeof(int));
+    assert(dests != NULL && sources != NULL && flush_reqs != NULL && open_dests != NULL);
+
+    for (i = 0; i < n; i++) {
+	dests[i].open = -1;
+	dests[i].total_req = UGNI_REQ_NULL;
+	sources[i].credit_req = UGNI_REQ_NULL;
+    }
+    for (i = 0; i < n * slots; i++)
+	flush_reqs[i] = UGNI_REQ_NULL;
+    for (i = 0; i < UGNI_AGG_MAX_DEPTH; i++) {
+	scratch[i] = (uint8_t *) malloc(buf_bytes);
+	assert(scratch[i] != NULL);
+    }
+    for (i = 0; i < UGNI_AGG_MAX_HANDLERS; i++) {
+	handlers[i] = NULL;
+	handler_ctx[i] = NULL;
+    }
+
+    records_sent = 0;
+    records_delivered = 0;
+    batches_delivered = 0;
+    bytes_sent = 0;
+    flushes[0] = flushes[1] = flushes[2] = 0;
+    credit_waits = 0;
+}
+
+/*
+ * Bytes of the send buffer and of the receive buffer the aggregator uses:
+ * slots buffers per peer plus a credit and a total word per peer on
+ * either side.
+ */
+uint64_t Aggregator::sendBytes() {
+    return (uint64_t) node->world_size * (slots * buf_bytes + 2 * sizeof(uint64_t));
+}
+
+uint64_t Aggregator::recvBytes() {
+    return sendBytes();
+}
+
+/*
+ * Place the staging buffers at send_offset of the send buffer and the
+ * landing slots at recv_offset of the receive buffer. Credit words are
+ * only written by peers that received our batches, so no barrier is
+ * needed before the first send().
+ */
+void Aggregator::commit(uint64_t send_offset, uint64_t recv_offset) {
+    int n = node->world_size;
+
+    assert(send_offset + sendBytes() <= node->send_buffer_length);
+    assert(recv_offset + recvBytes() <= node->recv_buffer_length);
+    assert(send_offset % 8 == 0 && recv_offset % 8 == 0);
+
+    send_base = send_offset;
+    recv_base = recv_offset;
+    memset((void *) creditWord(0), 0, 2 * n * sizeof(uint64_t));
+}
+
+/* Records naming id are passed to handler along with ctx. */
+void Aggregator::registerHandler(int id, uGNI_agg_handler_t handler, void *ctx) {
+    assert(id >= 0 && id < UGNI_AGG_MAX_HANDLERS);
+    handlers[id] = handler;
+    handler_ctx[id] = ctx;
+}
+
+/* Staging buffer in the send buffer holding batch number batch to dest. */
+uint8_t *Aggregator::staging(int dest, uint64_t batch) {
+    return (uint8_t *) node->send_buffer_addr + send_base + ((uint64_t) dest * slots + batch % slots) * buf_bytes;
+}
+
+/* Batches dest has consumed from us, as last put by dest. */
+volatile uint64_t *Aggregator::creditWord(int dest) {
+    uint64_t off = recv_base + (uint64_t) node->world_size * slots * buf_bytes;
+
+    return (volatile uint64_t *) ((uint8_t *) node->my_memory_handle.addr + off) + dest;
+}
+
+/* Batches source has sent us in all, as put by source at its last drain. */
+volatile uint64_t *Aggregator::totalWord(int source) {
+    return creditWord(0) + node->world_size + source;
+}
+
+/* Source words of the credit puts, followed by those of the total puts. */
+uint64_t *Aggregator::sourceWords() {
+    uint64_t off = send_base + (uint64_t) node->world_size * slots * buf_bytes;
+
+    return (uint64_t *) ((uint8_t *) node->send_buffer_addr + off);
+}
+
+/*
+ * Append a record of length bytes for handler to the buffer of dest,
+ * flushing the buffer first if the record does not fit. Opening a new
+ * buffer waits, delivering incoming batches meanwhile, until its staging
+ * copy has gone out and dest has a free landing slot for it. Records to
+ * this rank itself are handed to the handler straight away.
+ *
+ *   Returns: 0 on success, 1 if a flush failed to post, 3 on timeout.
+ */
+int Aggregator::send(int dest, int handler, const void *data, uint32_t length) {
+    agg_dest_t *d = &dests[dest];
+    uint64_t need = record_bytes(length);
+    int rc;
+
+    assert(handler >= 0 && handler < UGNI_AGG_MAX_HANDLERS && handlers[handler] != NULL);
+    assert(length <= UINT16_MAX && sizeof(agg_batch_t) + need <= buf_bytes);
+
+    if (dest == node->world_rank) {
+	handlers[handler](handler_ctx[handler], dest, data, length);
+	records_sent++;
+	records_delivered++;
+	return 0;
+    }
+
+    if (d->used + need > buf_bytes) {
+	rc = post(dest, AGG_FLUSH_FULL);
+	if (rc != 0)
+	    return rc;
+    }
+
+    if (d->used == 0) {
+	uGNI_req_t *prev = &flush_reqs[(uint64_t) dest * slots + d->sent % slots];
+	int wait_count = 0;
+	bool waited = false;
+
+	while (!node->uGNI_test(prev) || d->sent - *creditWord(dest) >= (uint64_t) slots) {
+	    waited = true;
+	    if (poll() > 0) {
+		wait_count = 0;
+		continue;
+	    }
+	    if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+		fprintf(stderr, "[%s] Rank: %4i Aggregator       ERROR no landing slot at rank %d for batch %lu\n",
+			node->uts_info.nodename, node->world_rank, dest, d->sent);
+		return 3;
+	    }
+	}
+	if (waited)
+	    credit_waits++;
+
+	// A handler run while waiting may have opened the buffer itself.
+	if (d->used != 0)
+	    return send(dest, handler, data, length);
+
+	d->used = sizeof(agg_batch_t);
+	d->records = 0;
+	d->first_ns = uGNI_now_ns();
+	d->open = num_open;
+	open_dests[num_open++] = dest;
+    }
+
+    uint8_t *rec = staging(dest, d->sent) + d->used;
+    agg_record_t *r = (agg_record_t *) rec;
+    r->handler = handler;
+    r->length = length;
+    memcpy(rec + sizeof(agg_record_t), data, length);
+    d->used += need;
+    d->records++;
+    records_sent++;
+
+    return 0;
+}
+
+/*
+ * Put the open buffer of dest to its landing slot there. Its slot and
+ * staging copy were secured when the buffer was opened, so this never
+ * waits.
+ *
+ *   Returns: 0 on success, 1 if the post failed.
+ */
+int Aggregator::post(int dest, int reason) {
+    agg_dest_t *d = &dests[dest];
+    uint64_t slot = d->sent % slots;
+    uint8_t *buf = staging(dest, d->sent);
+    agg_batch_t *h = (agg_batch_t *) buf;
+
+    if (d->used == 0)
+	return 0;
+
+    h->bytes = d->used;
+    h->records = d->records;
+
+    uGNI_req_t req = node->uGNI_postT<PutSignalPost>(dest, (uint64_t) buf, node->send_mem_handle,
+	    recv_base + ((uint64_t) node->world_rank * slots + slot) * buf_bytes, d->used, stream);
+    if (req == UGNI_REQ_NULL)
+	return 1;
+
+    flush_reqs[(uint64_t) dest * slots + slot] = req;
+    bytes_sent += d->used;
+    flushes[reason]++;
+    d->sent++;
+    d->used = 0;
+    d->records = 0;
+
+    // Close the buffer: the last open one takes its place.
+    int last = open_dests[--num_open];
+    open_dests[d->open] = last;
+    dests[last].open = d->open;
+    d->open = -1;
+
+    return 0;
+}
+
+/*
+ * Copy every batch that has landed out of its slot and hand its records
+ * to their handlers. Handlers may send(), and a send() waiting for a
+ * landing slot delivers in turn, up to UGNI_AGG_MAX_DEPTH levels, so two
+ * ranks sending to each other from handlers keep freeing slots.
+ *
+ *   Returns: the number of batches delivered.
+ */
+int Aggregator::deliver() {
+    int n = node->world_size;
+    uint64_t *arrived = node->uGNI_stream(stream)->arrived;
+    int delivered = 0;
+    int s;
+
+    if (depth >= UGNI_AGG_MAX_DEPTH)
+	return 0;
+
+    for (s = 0; s < n; s++) {
+	agg_source_t *src = &sources[s];
+
+	if (s == node->world_rank)
+	    continue;
+	// Every event on the stream is a batch.
+	while (arrived[s] > src->consumed) {
+	    uint64_t off = recv_base + ((uint64_t) s * slots + src->consumed % slots) * buf_bytes;
+	    const uint8_t *slot = (const uint8_t *) node->my_memory_handle.addr + off;
+	    uint8_t *batch = scratch[depth];
+	    uint64_t bytes = ((const agg_batch_t *) slot)->bytes;
+	    uint64_t pos = sizeof(agg_batch_t);
+
+	    // The slot is free again once copied; its credit goes back on the next poll.
+	    memcpy(batch, slot, bytes);
+	    src->consumed++;
+	    batches_delivered++;
+	    delivered++;
+
+	    depth++;
+	    while (pos < bytes) {
+		const agg_record_t *r = (const agg_record_t *) (batch + pos);
+
+		handlers[r->handler](handler_ctx[r->handler], s, batch + pos + sizeof(agg_record_t), r->length);
+		records_delivered++;
+		pos += record_bytes(r->length);
+	    }
+	    depth--;
+	}
+    }
+
+    return delivered;
+}
+
+/*
+ * Put the consumed count of every source with newly freed slots into its
+ * credit word here. A count still in flight is superseded by the next
+ * one, so each source has at most one credit put outstanding.
+ */
+void Aggregator::returnCredits() {
+    int n = node->world_size;
+    uint64_t *words = sourceWords();
+    int s;
+
+    for (s = 0; s < n; s++) {
+	agg_source_t *src = &sources[s];
+
+	if (src->consumed == src->credited || !node->uGNI_test(&src->credit_req))
+	    continue;
+
+	words[s] = src->consumed;
+	src->credit_req = node->uGNI_postT<PutPost>(s, (uint64_t) &words[s], node->send_mem_handle,
+		recv_base + (uint64_t) n * slots * buf_bytes + node->world_rank * sizeof(uint64_t), sizeof(uint64_t));
+	if (src->credit_req != UGNI_REQ_NULL)
+	    src->credited = src->consumed;
+    }
+}
+
+/*
+ * Make progress without blocking: deliver landed batches, return their
+ * slots to the senders and flush buffers that have grown too old.
+ * Applications call it from their work loops.
+ *
+ *   Returns: the number of batches delivered.
+ */
+int Aggregator::poll() {
+    int delivered;
+    int i;
+
+    node->uGNI_progress();
+    delivered = deliver();
+    returnCredits();
+
+    if (max_age_ns > 0 && num_open > 0) {
+	uint64_t now = uGNI_now_ns();
+
+	// Walk backwards, as a closed buffer is replaced by the last one.
+	for (i = num_open - 1; i >= 0; i--) {
+	    int dest = open_dests[i];
+	    if (now - dests[dest].first_ns >= max_age_ns)
+		post(dest, AGG_FLUSH_AGED);
+	}
+    }
+
+    return delivered;
+}
+
+/*
+ * Put the open buffer of dest now, without waiting for it to go out.
+ *
+ *   Returns: 0 on success, 1 if the post failed.
+ */
+int Aggregator::flush(int dest) {
+    return post(dest, AGG_FLUSH_EXPLICIT);
+}
+
+/*
+ * Put every open buffer and wait until all batches have gone out, that is
+ * have landed in their slots, delivering incoming ones meanwhile.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Aggregator::flushAll() {
+    int n = node->world_size;
+    int wait_count = 0;
+    int rc = 0;
+    int i, pending;
+
+    while (num_open > 0) {
+	if (post(open_dests[num_open - 1], AGG_FLUSH_EXPLICIT) != 0) {
+	    rc = 1;
+	    break;
+	}
+    }
+
+    do {
+	int work = poll();
+
+	pending = 0;
+	for (i = 0; i < n * slots; i++) {
+	    if (!node->uGNI_test(&flush_reqs[i]))
+		pending++;
+	}
+	if (pending == 0 || work > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+	if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i Aggregator       ERROR %d batches never completed\n",
+		    node->uts_info.nodename, node->world_rank, pending);
+	    return 3;
+	}
+    } while (pending > 0);
+
+    return rc;
+}
+
+/*
+ * Collective end of a phase: flush everything, tell every peer how many
+ * batches it was sent, and deliver until all of them have been consumed.
+ * Handlers must not send() while the phase drains, since their records
+ * could miss the count.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Aggregator::drain() {
+    int n = node->world_size;
+    uint64_t *words = sourceWords() + n;
+    int wait_count = 0;
+    int rc = flushAll();
+    int s, pending;
+
+    // Counts are cumulative, so a peer already in its next drain only raises them.
+    for (s = 0; s < n; s++) {
+	if (s == node->world_rank)
+	    continue;
+	node->uGNI_wait(&dests[s].total_req);
+	words[s] = dests[s].sent;
+	dests[s].total_req = node->uGNI_postT<PutPost>(s, (uint64_t) &words[s], node->send_mem_handle,
+		recv_base + (uint64_t) n * slots * buf_bytes + (n + node->world_rank) * sizeof(uint64_t),
+		sizeof(uint64_t));
+	if (dests[s].total_req == UGNI_REQ_NULL)
+	    return 1;
+    }
+    for (s = 0; s < n; s++) {
+	if (s != node->world_rank && node->uGNI_wait(&dests[s].total_req) != 0)
+	    return 1;
+    }
+
+    // Past the barrier every peer's total has landed here.
+    if (node->uGNI_barrier() != 0)
+	return 3;
+
+    do {
+	int work = poll();
+
+	pending = 0;
+	for (s = 0; s < n; s++) {
+	    if (s != node->world_rank && sources[s].consumed < *totalWord(s))
+		pending++;
+	}
+	if (pending == 0 || work > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+	if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i Aggregator       ERROR batches from %d ranks never arrived\n",
+		    node->uts_info.nodename, node->world_rank, pending);
+	    return 3;
+	}
+    } while (pending > 0);
+    assert(num_open == 0);
+
+    return rc;
+}
+
+void Aggregator::printStats() {
+    double per_batch = (flushes[0] + flushes[1] + flushes[2] > 0) ?
+	(double) records_sent / (flushes[0] + flushes[1] + flushes[2]) : 0.0;
+
+    printf("rank %d aggregator: %lu records sent, %lu delivered, %lu bytes in %lu full %lu aged %lu explicit flushes "
+	    "(%.1f records/batch), %lu batches delivered, %lu credit waits\n",
+	    node->world_rank, records_sent, records_delivered, bytes_sent, flushes[0], flushes[1], flushes[2],
+	    per_batch, batches_delivered, credit_waits);
+}
+
+/* Wait for outstanding puts and release all state. */
+void Aggregator::destroy() {
+    int n = node->world_size;
+    int i;
+
+    if (num_open > 0)
+	fprintf(stderr, "[%s] Rank: %4i Aggregator       WARNING %d buffers destroyed unflushed\n",
+		node->uts_info.nodename, node->world_rank, num_open);
+
+    for (i = 0; i < n * slots; i++)
+	node->uGNI_wait(&flush_reqs[i]);
+    for (i = 0; i < n; i++) {
+	node->uGNI_wait(&sources[i].credit_req);
+	node->uGNI_wait(&dests[i].total_req);
+    }
+
+    for (i = 0; i < UGNI_AGG_MAX_DEPTH; i++)
+	free(scratch[i]);
+    free(open_dests);
+    free(flush_reqs);
+    free(sources);
+    free(dests);
+    node->uGNI_streamFree(stream);
+}
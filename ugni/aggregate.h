@@ -0,0 +1,109 @@
+// Small-message aggregation for the node class. Records meant for a peer
+// are appended to a coalescing buffer of that peer in the registered send
+// buffer, and a whole buffer goes out as one put with a remote event when
+// it is full, when its oldest record reaches max_age_ns, or on an
+// explicit flush. A million tiny updates then cost a few thousand posts.
+//
+// Every sender owns slots batches deep of landing space in each peer's
+// receive buffer. The receiver copies a batch out of its slot, returns
+// the slot by putting its running count of consumed batches into the
+// sender's credit word, and hands every record to the handler it names.
+// A sender waits for credit only when all its slots at a peer are in use.
+//
+// Landed batches are counted in an arrival stream the aggregator holds
+// until destroy(), so other remote-event traffic between the ranks may
+// flow while records are in flight. All ranks must use the same sizes and
+// offsets, and create their aggregators, plans and halo exchanges in the
+// same order, so the streams agree.
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include "node.h"
+
+#define UGNI_AGG_MAX_HANDLERS 256
+#define UGNI_AGG_MAX_DEPTH    4	/* nested deliveries from within handlers */
+
+/* Receives one record: its sender, payload and payload length. */
+typedef void (*uGNI_agg_handler_t)(void *ctx, int source, const void *data, uint32_t length);
+
+/* A batch starts with this header; records follow, each 4 byte aligned. */
+typedef struct {
+    uint32_t        bytes;	/* header included */
+    uint32_t        records;
+} agg_batch_t;
+
+typedef struct {
+    uint16_t        handler;
+    uint16_t        length;
+} agg_record_t;
+
+typedef struct {
+    uint64_t        used;	/* bytes in the open buffer, header included */
+    uint64_t        first_ns;	/* when its first record was appended */
+    uint64_t        sent;	/* batches flushed */
+    uint32_t        records;
+    int             open;	/* position in open_dests, or -1 */
+    uGNI_req_t      total_req;	/* put of sent at the last drain */
+} agg_dest_t;
+
+typedef struct {
+    uint64_t        consumed;	/* batches copied out of their slots */
+    uint64_t        credited;	/* consumed count last put to the sender */
+    uGNI_req_t      credit_req;
+} agg_source_t;
+
+class Aggregator {
+    public:
+	Node *node;
+	uint64_t buf_bytes;		/* one coalescing buffer, one landing slot */
+	int slots;
+	uint64_t max_age_ns;
+	int stream;			/* arrival stream of the batches */
+
+	uint64_t send_base;		/* staging: [dest][slot] buffers, then credit and total source words */
+	uint64_t recv_base;		/* landing: [source][slot] buffers, then credit and total words */
+	agg_dest_t *dests;
+	agg_source_t *sources;
+	uGNI_req_t *flush_reqs;		/* [dest][slot] */
+	int *open_dests;
+	int num_open;
+	int depth;
+	uint8_t *scratch[UGNI_AGG_MAX_DEPTH];
+
+	uGNI_agg_handler_t handlers[UGNI_AGG_MAX_HANDLERS];
+	void *handler_ctx[UGNI_AGG_MAX_HANDLERS];
+
+	// Statistics.
+	uint64_t records_sent;
+	uint64_t records_delivered;
+	uint64_t batches_delivered;
+	uint64_t bytes_sent;
+	uint64_t flushes[3];		/* full, aged, explicit */
+	uint64_t credit_waits;
+
+    public:
+	void init(Node *node, uint64_t buf_bytes, int slots, uint64_t max_age_ns);
+	uint64_t sendBytes();
+	uint64_t recvBytes();
+	void commit(uint64_t send_offset, uint64_t recv_offset);
+	void registerHandler(int id, uGNI_agg_handler_t handler, void *ctx);
+	int send(int dest, int handler, const void *data, uint32_t length);
+	int flush(int dest);
+	int flushAll();
+	int poll();
+	int drain();
+	void printStats();
+	void destroy();
+
+    private:
+	uint8_t *staging(int dest, uint64_t batch);
+	volatile uint64_t *creditWord(int dest);
+	volatile uint64_t *totalWord(int source);
+	uint64_t *sourceWords();
+	int post(int dest, int reason);
+	int deliver();
+	void returnCredits();
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ ** Allreduce over uGNI puts, ring and recursive doubling, and the tree
+ ** reduce, checked against and compared with MPI_Allreduce
+ **
+ ** usage: allreduce.x [max_count iters]
+ **
+ ** Every type and op is run for counts from 1 to max_count. The inputs
+ ** are small integers, so float and double sums are exact and the results
+ ** must match MPI's bit for bit.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+
+#define MAX_COUNT                (256*1024)
+#define NUMBER_OF_ITERS          10
+#define ROOT                     0
+
+/* The runs of every iteration, in order: the MPI reference first. */
+enum { RUN_MPI = 0, RUN_RING, RUN_RD, RUN_REDUCE, RUNS };
+
+static const char *type_names[] = { "float", "double", "int64" };
+static const char *op_names[] = { "sum", "min", "max" };
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+static MPI_Datatype mpi_type(uGNI_dtype_t type) {
+    return (type == UGNI_FLOAT) ? MPI_FLOAT : (type == UGNI_DOUBLE) ? MPI_DOUBLE : MPI_INT64_T;
+}
+
+static MPI_Op mpi_op(uGNI_op_t op) {
+    return (op == UGNI_SUM) ? MPI_SUM : (op == UGNI_MIN) ? MPI_MIN : MPI_MAX;
+}
+
+/* Different small integers on every rank and iteration. */
+static void fill_input(void *buf, uGNI_dtype_t type, uint64_t count, int rank, int iter) {
+    for(uint64_t j = 0; j < count; j++) {
+	int64_t v = (int64_t) ((rank * 7 + j * 3 + iter) % 17) - 8;
+	switch (type) {
+	    case UGNI_FLOAT: ((float *) buf)[j] = (float) v; break;
+	    case UGNI_DOUBLE: ((double *) buf)[j] = (double) v; break;
+	    case UGNI_INT64: ((int64_t *) buf)[j] = v; break;
+	}
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t max_count = MAX_COUNT;
+    int iters = NUMBER_OF_ITERS;
+    uint64_t count;
+    int i, t, o, m, rc;
+
+    if(argc == 3) {
+	max_count = atol(argv[1]);
+	iters = atoi(argv[2]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+
+    // Every chunk raises one source and one destination event per partner.
+    int number_of_cq_entries = 256;
+    int number_of_dest_cq_entries = 1024;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    // The vector, then scratch enough for either algorithm and the reduce.
+    uint64_t max_bytes = max_count * sizeof(double);
+    uint64_t scratch_bytes = node.uGNI_reduceScratch(max_count, UGNI_DOUBLE);
+    node.uGNI_setAllreduce(UGNI_ALLREDUCE_CHUNK_BYTES, 0);
+    if(node.uGNI_allreduceScratch(max_count, UGNI_DOUBLE) > scratch_bytes)
+	scratch_bytes = node.uGNI_allreduceScratch(max_count, UGNI_DOUBLE);
+    node.uGNI_setAllreduce(UGNI_ALLREDUCE_CHUNK_BYTES, UINT64_MAX);
+    if(node.uGNI_allreduceScratch(max_count, UGNI_DOUBLE) > scratch_bytes)
+	scratch_bytes = node.uGNI_allreduceScratch(max_count, UGNI_DOUBLE);
+    uint64_t recv_bytes = max_bytes + scratch_bytes;
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, max_bytes);
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, recv_bytes);
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, max_bytes, receive_buffer, recv_bytes);
+
+    char *buf = receive_buffer;
+    char *scratch = receive_buffer + max_bytes;
+    char *mpi_in = (char *) malloc(max_bytes);
+    char *reference = (char *) malloc(max_bytes);
+    assert(mpi_in != NULL && reference != NULL);
+
+    if(node.world_rank == ROOT) {
+	printf("\nranks = %d, iters = %d\n", node.world_size, iters);
+	printf("\nCount \t type \t op \t MPI lat \t ring lat \t RD lat \t reduce lat\n");
+    }
+
+    struct timeval t1, t2;
+
+    for(count = 1; count <= max_count; count *= 4) {
+	for(t = UGNI_FLOAT; t <= UGNI_INT64; t++) {
+	    for(o = UGNI_SUM; o <= UGNI_MAX; o++) {
+		uGNI_dtype_t type = (uGNI_dtype_t) t;
+		uGNI_op_t op = (uGNI_op_t) o;
+		uint64_t bytes = count * dtype_size(type);
+		double usec[RUNS] = { 0 };
+		int errors[RUNS] = { 0 };
+
+		node.uGNI_barrier();
+		for(i = 0; i < iters; i++) {
+		    fill_input(mpi_in, type, count, node.world_rank, i);
+		    gettimeofday(&t1, NULL);
+		    MPI_Allreduce(mpi_in, reference, count, mpi_type(type), mpi_op(op), MPI_COMM_WORLD);
+		    gettimeofday(&t2, NULL);
+		    usec[RUN_MPI] += elapsed_usec(&t1, &t2);
+
+		    for(m = RUN_RING; m < RUNS; m++) {
+			// rd_bytes 0 keeps every vector of at least one element per rank on the ring.
+			node.uGNI_setAllreduce(UGNI_ALLREDUCE_CHUNK_BYTES, (m == RUN_RD) ? UINT64_MAX : 0);
+			fill_input(buf, type, count, node.world_rank, i);
+			gettimeofday(&t1, NULL);
+			if(m == RUN_REDUCE)
+			    rc = node.uGNI_reduce(ROOT, buf, scratch, count, type, op);
+			else
+			    rc = node.uGNI_allreduce(buf, scratch, count, type, op);
+			gettimeofday(&t2, NULL);
+			usec[m] += elapsed_usec(&t1, &t2);
+			if(rc != 0)
+			    fprintf(stderr, "Rank %d %s failed: %d\n", node.world_rank,
+				    (m == RUN_REDUCE) ? "uGNI_reduce" : "uGNI_allreduce", rc);
+			if(m != RUN_REDUCE || node.world_rank == ROOT)
+			    errors[m] |= (memcmp(buf, reference, bytes) != 0);
+		    }
+		}
+
+		double max_usec[RUNS];
+		int total_errors[RUNS];
+		MPI_Reduce(usec, max_usec, RUNS, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+		MPI_Reduce(errors, total_errors, RUNS, MPI_INT, MPI_SUM, ROOT, MPI_COMM_WORLD);
+
+		if(node.world_rank == ROOT) {
+		    printf("%lu \t %s \t %s \t %8.2f \t %8.2f \t %8.2f \t %8.2f\n", count, type_names[t], op_names[o],
+			    max_usec[RUN_MPI]/iters, max_usec[RUN_RING]/iters, max_usec[RUN_RD]/iters,
+			    max_usec[RUN_REDUCE]/iters);
+		    if(total_errors[RUN_RING] + total_errors[RUN_RD] + total_errors[RUN_REDUCE] > 0)
+			printf("Error: %d ring, %d RD and %d reduce ranks differ from MPI_Allreduce\n",
+				total_errors[RUN_RING], total_errors[RUN_RD], total_errors[RUN_REDUCE]);
+		}
+	    }
+	}
+    }
+
+    node.uGNI_setAllreduce(UGNI_ALLREDUCE_CHUNK_BYTES, UGNI_ALLREDUCE_RD_BYTES);
+    node.uGNI_barrier();
+    node.uGNI_finalize();
+
+    free(reference);
+    free(mpi_in);
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
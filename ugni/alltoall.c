@@ -0,0 +1,185 @@
+/*
+ ** Personalized exchange over uGNI puts, uniform and with uneven block
+ ** sizes, checked against and compared with MPI_Alltoallv
+ **
+ ** usage: alltoall.x [max_kbytes iters]
+ **
+ ** Peers are visited in the order uGNI_topoOrder builds, under several
+ ** window and per-peer limits. Uneven blocks vary by sender, receiver and
+ ** iteration, and one in five of them is empty.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+
+#define MAX_KBYTES               64
+#define NUMBER_OF_ITERS          10
+#define ROOT                     0
+#define SIZE_STEPS               5	/* uneven blocks are 0 .. 4 units */
+
+/* Window and per-peer limits tried, 0 standing for all peers. */
+static const int limits[][2] = { { 1, 1 }, { UGNI_A2A_WINDOW, UGNI_A2A_PER_PEER }, { 0, 4 } };
+#define NUMBER_OF_LIMITS (int) (sizeof(limits) / sizeof(limits[0]))
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+/* Bytes rank from sends to rank to, a multiple of 4. */
+static uint64_t block_bytes(int from, int to, int iter, uint64_t unit, bool uneven) {
+    if(!uneven)
+	return 2 * unit;
+    return unit * ((from + 2 * to + iter) % SIZE_STEPS);
+}
+
+static void fill_block(char *buf, uint64_t bytes, int from, int to, int iter) {
+    for(uint64_t j = 0; j < bytes; j++)
+	buf[j] = (char) (from * 31 + to * 17 + j + iter);
+}
+
+int main(int argc, char **argv)
+{
+    int max_bytes = MAX_KBYTES*1024;
+    int iters = NUMBER_OF_ITERS;
+    uint64_t unit;
+    int i, l, p, q, u, rc;
+
+    if(argc == 3) {
+	max_bytes = atoi(argv[1])*1024;
+	iters = atoi(argv[2]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+    int n = node.world_size;
+    int r = node.world_rank;
+
+    // The window bounds the puts in flight; blocks land from every peer.
+    int number_of_cq_entries = 256;
+    int number_of_dest_cq_entries = 4 * n + 256;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    // No block is larger than max_bytes.
+    uint64_t max_block = max_bytes;
+    uint64_t buffer_bytes = n * max_block;
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, buffer_bytes);
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, buffer_bytes);
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, buffer_bytes, receive_buffer, buffer_bytes);
+
+    char *mpi_recv = (char *) malloc(buffer_bytes);
+    uint64_t *counts = (uint64_t *) malloc(4 * n * sizeof(uint64_t));
+    int *mpi_counts = (int *) malloc(4 * n * sizeof(int));
+    assert(mpi_recv != NULL && counts != NULL && mpi_counts != NULL);
+    uint64_t *sendcounts = counts, *sdispls = counts + n, *recvcounts = counts + 2 * n, *remote_displs = counts + 3 * n;
+    int *mpi_scounts = mpi_counts, *mpi_sdispls = mpi_counts + n, *mpi_rcounts = mpi_counts + 2 * n, *mpi_rdispls = mpi_counts + 3 * n;
+
+    node.uGNI_topoOrder();
+    if(r == ROOT) {
+	printf("\nranks = %d, iters = %d\nrank %d visits:", n, iters, r);
+	for(p = 0; p < n; p++)
+	    printf(" %d", node.a2a_order[p]);
+	printf("\n\nUnit  \t uneven \t window \t per peer \t uGNI lat \t MPI lat\n");
+    }
+
+    struct timeval t1, t2;
+
+    for(unit = 4; unit * (SIZE_STEPS - 1) <= (uint64_t) max_bytes; unit *= 4) {
+	for(u = 0; u < 2; u++) {
+	    bool uneven = (u == 1);
+
+	    for(l = 0; l < NUMBER_OF_LIMITS; l++) {
+		int window = (limits[l][0] == 0) ? n : limits[l][0];
+		double usec = 0, mpi_usec = 0;
+		int errors = 0;
+
+		node.uGNI_setAlltoall(UGNI_A2A_CHUNK_BYTES, window, limits[l][1]);
+		node.uGNI_barrier();
+		for(i = 0; i < iters; i++) {
+		    uint64_t soff = 0, roff = 0;
+
+		    // Packed blocks both ways; a peer's displacement for us is the
+		    // sum of what the ranks before us send it.
+		    for(p = 0; p < n; p++) {
+			sendcounts[p] = block_bytes(r, p, i, unit, uneven);
+			sdispls[p] = soff;
+			recvcounts[p] = block_bytes(p, r, i, unit, uneven);
+			remote_displs[p] = 0;
+			for(q = 0; q < r; q++)
+			    remote_displs[p] += block_bytes(q, p, i, unit, uneven);
+			fill_block(send_buffer + soff, sendcounts[p], r, p, i);
+			mpi_scounts[p] = sendcounts[p];
+			mpi_sdispls[p] = soff;
+			mpi_rcounts[p] = recvcounts[p];
+			mpi_rdispls[p] = roff;
+			soff += sendcounts[p];
+			roff += recvcounts[p];
+		    }
+
+		    memset(receive_buffer, 0, roff);
+		    gettimeofday(&t1, NULL);
+		    if(uneven)
+			rc = node.uGNI_alltoallv(send_buffer, sendcounts, sdispls, receive_buffer, recvcounts, remote_displs);
+		    else
+			rc = node.uGNI_alltoall(send_buffer, receive_buffer, 2 * unit);
+		    gettimeofday(&t2, NULL);
+		    usec += elapsed_usec(&t1, &t2);
+		    if(rc != 0)
+			fprintf(stderr, "Rank %d uGNI_alltoall%s failed: %d\n", r, uneven ? "v" : "", rc);
+
+		    gettimeofday(&t1, NULL);
+		    MPI_Alltoallv(send_buffer, mpi_scounts, mpi_sdispls, MPI_BYTE,
+			    mpi_recv, mpi_rcounts, mpi_rdispls, MPI_BYTE, MPI_COMM_WORLD);
+		    gettimeofday(&t2, NULL);
+		    mpi_usec += elapsed_usec(&t1, &t2);
+
+		    errors |= (memcmp(receive_buffer, mpi_recv, roff) != 0);
+		}
+
+		double latency = usec/iters, mpi_latency = mpi_usec/iters;
+		double max_latency = 0, max_mpi_latency = 0;
+		int total_errors = 0;
+		MPI_Reduce(&latency, &max_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+		MPI_Reduce(&mpi_latency, &max_mpi_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+		MPI_Reduce(&errors, &total_errors, 1, MPI_INT, MPI_SUM, ROOT, MPI_COMM_WORLD);
+
+		if(r == ROOT) {
+		    printf("%lu \t %s \t\t %d \t\t %d \t\t %8.2f \t %8.2f\n", unit, uneven ? "yes" : "no",
+			    window, limits[l][1], max_latency, max_mpi_latency);
+		    if(total_errors > 0)
+			printf("Error: %d ranks received data that differs from MPI_Alltoallv\n", total_errors);
+		}
+	    }
+	}
+    }
+
+    node.uGNI_setAlltoall(UGNI_A2A_CHUNK_BYTES, UGNI_A2A_WINDOW, UGNI_A2A_PER_PEER);
+    node.uGNI_barrier();
+    node.uGNI_finalize();
+
+    free(mpi_counts);
+    free(counts);
+    free(mpi_recv);
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Barriers for the node class, over the sync region instead of PMI or MPI.
+// Both signal with 8 byte FMA writes into the peers' sync regions, which
+// raise no remote events, and wait by polling their own words. Every word
+// only ever grows, carrying the number of the barrier it belongs to, so a
+// late write from an earlier barrier can never release a later one, and a
+// source word may be overwritten while an older put still reads from it.
+// The writes are delivered in order, so that a newer value written to a
+// word can not be overtaken by an older one.
+//
+// Collectives use the same words to hand buffers back, see uGNI_collSignal.
+
+#include "node.h"
+
+/*
+ * Write sync word src of this rank into sync word dst of peer, or add
+ * first_operand to it atomically when amo is set. The add does not fetch,
+ * so src is left alone and may be reused meanwhile. Unless track is set, the
+ * request is released when the post completes.
+ *
+ *   Returns: the request when track is set and the post succeeded,
+ *            UGNI_REQ_NULL otherwise.
+ */
+uGNI_req_t Node::uGNI_syncWrite(int peer, uint32_t dst, uint32_t src, bool amo, bool track) {
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, peer);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    gni_post_descriptor_t *desc = &e->local_desc;
+
+    memset(desc, 0, sizeof(gni_post_descriptor_t));
+    desc->type = amo ? GNI_POST_AMO : GNI_POST_FMA_PUT;
+    desc->cq_mode = GNI_CQMODE_GLOBAL_EVENT;
+    desc->dlvr_mode = GNI_DLVMODE_IN_ORDER;
+    desc->local_addr = (uint64_t) &sync_region[src];
+    desc->local_mem_hndl = sync_mem_handle;
+    desc->remote_addr = remote_sync_array[peer].addr + dst * sizeof(uint64_t);
+    desc->remote_mem_hndl = remote_sync_array[peer].mdh;
+    desc->length = sizeof(uint64_t);
+    desc->src_cq_hndl = cq_handle;
+    if (amo) {
+	desc->amo_cmd = GNI_FMA_ATOMIC_ADD;
+	desc->first_operand = 1;
+    }
+    desc->post_id = req;
+    e->desc = desc;
+    e->internal = !track;
+
+    gni_return_t status = uGNI_submit(peer, desc);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostFma barrier ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	postRdmaStatus(status);
+	requests.release(req);
+	return UGNI_REQ_NULL;
+    }
+    return track ? req : UGNI_REQ_NULL;
+}
+
+/*
+ * Poll a sync word until it reaches target, reaping completions meanwhile.
+ *
+ *   Returns: 0 on success, 3 once the retry budget is exhausted.
+ */
+int Node::uGNI_syncWait(uint32_t word, uint64_t target) {
+    volatile uint64_t *w = &sync_region[word];
+    int wait_count = 0;
+
+    while (*w < target) {
+	if (uGNI_progress() == 0 && uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i uGNI_barrier      ERROR word %u stuck at %lu of %lu\n",
+		    uts_info.nodename, world_rank, word, (uint64_t) *w, target);
+	    return 3;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Collective handshake: before a collective puts into a peer's buffers it
+ * waits until the peer has started that collective, and with it finished
+ * every earlier one that used the same buffers. A rank starting collective
+ * number epoch writes the number into its ready word at each peer that
+ * will put into it. The source word only grows, so a write that reads it
+ * late still tells the truth.
+ *
+ *   Returns: as uGNI_syncWrite.
+ */
+uGNI_req_t Node::uGNI_collSignal(int peer, uint64_t epoch, bool track) {
+    if (sync_region[SYNC_COLL_SRC] < epoch)
+	sync_region[SYNC_COLL_SRC] = epoch;
+    return uGNI_syncWrite(peer, SYNC_COLL_READY(world_rank), SYNC_COLL_SRC, false, track);
+}
+
+/* Has peer started collective number epoch? */
+bool Node::uGNI_collReady(int peer, uint64_t epoch) {
+    return ((volatile uint64_t *) sync_region)[SYNC_COLL_READY(peer)] >= epoch;
+}
+
+/*
+ * Dissemination barrier: in round k every rank signals rank + 2^k and
+ * waits for rank - 2^k, ceil(log2(world_size)) rounds in all.
+ *
+ *   Returns: 0 on success, 3 on timeout.
+ */
+int Node::uGNI_barrier() {
+    uint64_t epoch = ++barrier_epoch;
+    int k, dist;
+
+    for (k = 0, dist = 1; dist < world_size; k++, dist <<= 1) {
+	sync_region[SYNC_BARRIER_SRC(k)] = epoch;
+	uGNI_syncWrite((world_rank + dist) % world_size, SYNC_BARRIER_FLAG(k), SYNC_BARRIER_SRC(k), false);
+	if (uGNI_syncWait(SYNC_BARRIER_FLAG(k), epoch) != 0)
+	    return 3;
+    }
+    return 0;
+}
+
+/*
+ * Counter barrier: every rank adds one to a counter at rank 0 with an
+ * atomic add; rank 0 waits for the count of this barrier and writes the
+ * release flag of every other rank.
+ *
+ *   Returns: 0 on success, 3 on timeout.
+ */
+int Node::uGNI_barrierAmo() {
+    uint64_t epoch = ++barrier_amo_epoch;
+    int p;
+
+    uGNI_syncWrite(0, SYNC_AMO_COUNTER, SYNC_AMO_SRC, true);
+
+    if (world_rank != 0)
+	return uGNI_syncWait(SYNC_AMO_RELEASE, epoch);
+
+    if (uGNI_syncWait(SYNC_AMO_COUNTER, epoch * world_size) != 0)
+	return 3;
+    sync_region[SYNC_AMO_SRC] = epoch;
+    for (p = 1; p < world_size; p++)
+	uGNI_syncWrite(p, SYNC_AMO_RELEASE, SYNC_AMO_SRC, false);
+    return 0;
+}
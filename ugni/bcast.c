@@ -0,0 +1,179 @@
+/*
+ ** Pipelined broadcast over uGNI puts, flat and through node leaders,
+ ** compared with MPI_Bcast
+ **
+ ** usage: bcast.x [max_kbytes chunk_kbytes fanout iters]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+
+#define MAX_BYTES                (4*1024*1024)
+#define NUMBER_OF_ITERS          20
+#define ROOT                     0
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+/*
+ * Every iteration broadcasts different data, so a broadcast that
+ * overwrites one still being forwarded shows up in the check.
+ */
+static void fill_payload(char *buf, int nbytes, int iter) {
+    for(int j = 0; j < nbytes; j++)
+	buf[j] = (char) (j * 7 + 3 + iter);
+}
+
+static int check_payload(const char *buf, int nbytes, int iter) {
+    for(int j = 0; j < nbytes; j++) {
+	if(buf[j] != (char) (j * 7 + 3 + iter))
+	    return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int max_bytes = MAX_BYTES;
+    int chunk_bytes = UGNI_BCAST_CHUNK_BYTES;
+    int fanout = UGNI_BCAST_FANOUT;
+    int iters = NUMBER_OF_ITERS;
+    int nbytes, i, rc;
+
+    if(argc == 5) {
+	max_bytes = atoi(argv[1])*1024;
+	chunk_bytes = atoi(argv[2])*1024;
+	fanout = atoi(argv[3]);
+	iters = atoi(argv[4]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+
+    // Every chunk raises one source event per child and one destination event;
+    // consecutive broadcasts may overlap along the tree.
+    int number_of_cq_entries = 64;
+    int number_of_dest_cq_entries = 2*(max_bytes/chunk_bytes + 1);
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, max_bytes);
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, max_bytes);
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, max_bytes, receive_buffer, max_bytes);
+    node.uGNI_setBroadcast(chunk_bytes, fanout);
+    node.uGNI_hierInit(max_bytes);
+
+    if(node.world_rank == ROOT) {
+	printf("\nranks = %d, chunk = %d, fanout = %d, iters = %d\n", node.world_size, chunk_bytes, fanout, iters);
+	printf("\nSize  \t\t uGNI bw \t uGNI lat \t hier lat \t MPI bw \t MPI lat\n");
+    }
+
+    struct timeval t1, t2;
+
+    for(nbytes = 4; nbytes <= max_bytes; nbytes *= 2) {
+	int errors = 0;
+	int bad;
+
+	/*Broadcast through the registered receive buffer*/
+	node.uGNI_barrier();
+	double usec = 0;
+	bad = 0;
+	for(i = 0; i < iters; i++) {
+	    if(node.world_rank == ROOT)
+		fill_payload(receive_buffer, nbytes, i);
+	    gettimeofday(&t1, NULL);
+	    if(node.uGNI_broadcast(ROOT, receive_buffer, nbytes) != 0)
+		fprintf(stderr, "Rank %d uGNI_broadcast failed\n", node.world_rank);
+	    gettimeofday(&t2, NULL);
+	    usec += elapsed_usec(&t1, &t2);
+	    bad |= check_payload(receive_buffer, nbytes, i);
+	}
+	errors += bad;
+	memset(receive_buffer, 0, nbytes);
+
+	double latency = usec/iters;
+	double max_latency = 0;
+	MPI_Reduce(&latency, &max_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+
+	/*Through the node leaders*/
+	node.uGNI_barrier();
+	usec = 0;
+	bad = 0;
+	for(i = 0; i < iters; i++) {
+	    if(node.world_rank == ROOT)
+		fill_payload(receive_buffer, nbytes, i);
+	    gettimeofday(&t1, NULL);
+	    if(node.uGNI_hierBroadcast(ROOT, receive_buffer, nbytes) != 0)
+		fprintf(stderr, "Rank %d uGNI_hierBroadcast failed\n", node.world_rank);
+	    gettimeofday(&t2, NULL);
+	    usec += elapsed_usec(&t1, &t2);
+	    bad |= check_payload(receive_buffer, nbytes, i);
+	}
+	errors += bad;
+	memset(receive_buffer, 0, nbytes);
+
+	double hier_latency = usec/iters;
+	double max_hier_latency = 0;
+	MPI_Reduce(&hier_latency, &max_hier_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+
+	/*The same through MPI*/
+	node.uGNI_barrier();
+	usec = 0;
+	bad = 0;
+	for(i = 0; i < iters; i++) {
+	    if(node.world_rank == ROOT)
+		fill_payload(send_buffer, nbytes, i);
+	    gettimeofday(&t1, NULL);
+	    MPI_Bcast(send_buffer, nbytes, MPI_BYTE, ROOT, MPI_COMM_WORLD);
+	    gettimeofday(&t2, NULL);
+	    usec += elapsed_usec(&t1, &t2);
+	    bad |= check_payload(send_buffer, nbytes, i);
+	}
+	errors += bad;
+	memset(send_buffer, 0, nbytes);
+
+	double mpi_latency = usec/iters;
+	double max_mpi_latency = 0;
+	MPI_Reduce(&mpi_latency, &max_mpi_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+
+	int total_errors = 0;
+	MPI_Reduce(&errors, &total_errors, 1, MPI_INT, MPI_SUM, ROOT, MPI_COMM_WORLD);
+
+	if(node.world_rank == ROOT) {
+	    double bandwidth = nbytes*1000000.0/(max_latency*1024*1024);
+	    double mpi_bandwidth = nbytes*1000000.0/(max_mpi_latency*1024*1024);
+	    printf("%d \t %8.6f \t %8.4f \t %8.4f \t %8.6f \t %8.4f\n", nbytes, bandwidth, max_latency, max_hier_latency,
+		    mpi_bandwidth, max_mpi_latency);
+	    if(total_errors > 0)
+		printf("Error: Invalid received data on %d ranks\n", total_errors);
+	}
+    }
+
+    node.uGNI_barrier();
+
+    node.uGNI_finalize();
+
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,350 @@
+// Node-leader bootstrap for the node class. Ranks sharing a nid hand their
+// bootstrap records to the lowest local rank through a shared memory
+// segment; only these leaders talk to each other through the PMI KVS, and
+// each publishes the global table back into the segment, where every rank
+// of the node reads the one copy. PMI traffic then follows the number of
+// nodes instead of the number of ranks.
+//
+// The global tables derived from the records (NIC addresses, memory and
+// sync region handles) live in the same segment, once per node, and are
+// mapped read-only once built.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+
+#include "node.h"
+
+#define BOOT_KEY_LENGTH 64
+
+/*
+ * Segment layout: this header and the records of the local ranks indexed
+ * by local index, both writable; then, from a page boundary so they can be
+ * protected, the read-only tables indexed by rank: the bootstrap records,
+ * NIC addresses, memory handles and sync region handles, each cache aligned.
+ */
+typedef struct {
+    std::atomic<int> arrived;	/* local records written */
+    std::atomic<int> ready;	/* global table published */
+    std::atomic<int> attached;	/* local ranks done with the name */
+    int world_size;
+    int local_size;
+} boot_shm_hdr_t;
+
+static inline size_t cacheline_round(size_t n) {
+    return (n + CACHELINE_SIZE - 1) & ~((size_t) CACHELINE_SIZE - 1);
+}
+
+static inline size_t page_round(size_t n) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+static void hex_encode(const unsigned char *in, int len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < len; i++) {
+	out[2 * i] = digits[in[i] >> 4];
+	out[2 * i + 1] = digits[in[i] & 0xf];
+    }
+    out[2 * len] = '\0';
+}
+
+static inline int hex_digit(char c) {
+    return (c <= '9') ? c - '0' : c - 'a' + 10;
+}
+
+static void hex_decode(const char *in, int len, unsigned char *out) {
+    for (int i = 0; i < len; i++)
+	out[i] = (unsigned char) ((hex_digit(in[2 * i]) << 4) | hex_digit(in[2 * i + 1]));
+}
+
+/* FNV-1a of a string, to tell job steps apart in the segment name. */
+static uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261U;
+    for (; *s != '\0'; s++)
+	h = (h ^ (unsigned char) *s) * 16777619U;
+    return h;
+}
+
+/* KVS key of chunk of rank's records, or of their count for chunk -1. */
+static void boot_key(char *key, int key_length, int rank, int chunk) {
+    int len = (chunk < 0) ? snprintf(key, BOOT_KEY_LENGTH, "ub-%d-n", rank)
+			  : snprintf(key, BOOT_KEY_LENGTH, "ub-%d-%d", rank, chunk);
+    if (len >= BOOT_KEY_LENGTH || len >= key_length)
+	PMI_Abort(-1, "bootstrap key too long");
+}
+
+/*
+ * Pause between two polls of the segment for the other local ranks. They
+ * may start late, so there is no limit: yield at first, then sleep so a
+ * long wait does not take a core from the ranks still starting up.
+ */
+static void boot_idle(int *wait_count) {
+    if (++(*wait_count) < MAXIMUM_CQ_RETRY_COUNT)
+	sched_yield();
+    else
+	usleep(100);
+}
+
+/*
+ * Choose how uGNI_regAndExchangeMem gathers the bootstrap records: one
+ * flat PMI_Allgather over all ranks, or through node leaders. Must be the
+ * same on all ranks.
+ */
+void Node::uGNI_setBootstrapMode(int mode) {
+    bootstrap_mode = mode;
+}
+
+/*
+ * Find the ranks sharing this nid. The leader is the lowest of them.
+ */
+void Node::uGNI_getLocalRanks() {
+    int rc, i;
+
+    if (local_ranks != NULL)
+	return;
+
+    rc = PMI_Get_clique_size(&local_size);
+    assert(rc == PMI_SUCCESS);
+
+    local_ranks = (int *) malloc(local_size * sizeof(int));
+    assert(local_ranks != NULL);
+    rc = PMI_Get_clique_ranks(local_ranks, local_size);
+    assert(rc == PMI_SUCCESS);
+
+    local_leader = world_rank;
+    local_index = -1;
+    for (i = 0; i < local_size; i++) {
+	if (local_ranks[i] < local_leader)
+	    local_leader = local_ranks[i];
+	if (local_ranks[i] == world_rank)
+	    local_index = i;
+    }
+    assert(local_index >= 0);
+}
+
+/*
+ * Gather the bootstrap records of all ranks through the node leaders and
+ * point bootstrap_table at the node's shared copy. Collective over all
+ * ranks; costs one PMI barrier, which makes the leaders' KVS puts visible,
+ * and on leaders only one KVS put per value-sized chunk of their node's
+ * records and one get per remote chunk. Members find the segment by
+ * polling for it, which needs no PMI traffic.
+ */
+void Node::uGNI_bootstrapNode(bootstrap_rec_t *my_record) {
+    char name[BOOT_KEY_LENGTH];
+    int rc, fd, i, name_length;
+    struct stat st;
+
+    uGNI_getLocalRanks();
+    bool leader = (world_rank == local_leader);
+
+    rc = PMI_KVS_Get_name_length_max(&name_length);
+    assert(rc == PMI_SUCCESS);
+    char *kvs = (char *) malloc(name_length);
+    assert(kvs != NULL);
+    rc = PMI_KVS_Get_my_name(kvs, name_length);
+    assert(rc == PMI_SUCCESS);
+
+    size_t local_offset = cacheline_round(sizeof(boot_shm_hdr_t));
+    size_t global_offset = page_round(local_offset + local_size * sizeof(bootstrap_rec_t));
+    size_t nic_offset = global_offset + cacheline_round(world_size * sizeof(bootstrap_rec_t));
+    size_t mem_offset = nic_offset + cacheline_round(world_size * sizeof(unsigned int));
+    size_t sync_offset = mem_offset + cacheline_round(world_size * sizeof(mdh_addr_t));
+    boot_shm_size = page_round(sync_offset + world_size * sizeof(mdh_addr_t));
+
+    // The KVS name is unique per job step, so members never find a stale segment.
+    snprintf(name, sizeof(name), "/ugni-boot-%u-%u-%08x-%d", cookie, (unsigned int) ptag, name_hash(kvs), nid);
+
+    if (leader) {
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+	    // Left behind by a job that died before unlinking it.
+	    shm_unlink(name);
+	    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd < 0 || ftruncate(fd, boot_shm_size) != 0) {
+	    fprintf(stdout, "[%s] Rank: %4i shm_open %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	    PMI_Abort(-1, "bootstrap segment");
+	}
+    }
+
+    // Members wait for the leader to create the segment and size it.
+    if (!leader) {
+	int wait_count = 0;
+
+	while ((fd = shm_open(name, O_RDWR, 0600)) < 0 && errno == ENOENT)
+	    boot_idle(&wait_count);
+	if (fd < 0) {
+	    fprintf(stdout, "[%s] Rank: %4i shm_open %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	    PMI_Abort(-1, "bootstrap segment");
+	}
+	while ((rc = fstat(fd, &st)) == 0 && (size_t) st.st_size < boot_shm_size)
+	    boot_idle(&wait_count);
+	if (rc != 0) {
+	    fprintf(stdout, "[%s] Rank: %4i fstat %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	    PMI_Abort(-1, "bootstrap segment");
+	}
+    }
+
+    boot_shm = mmap(NULL, boot_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (boot_shm == MAP_FAILED) {
+	fprintf(stdout, "[%s] Rank: %4i mmap bootstrap segment ERROR errno: %d\n", uts_info.nodename, world_rank, errno);
+	PMI_Abort(-1, "bootstrap segment");
+    }
+
+    boot_shm_hdr_t *hdr = (boot_shm_hdr_t *) boot_shm;
+    bootstrap_rec_t *local_recs = (bootstrap_rec_t *) ((char *) boot_shm + local_offset);
+    bootstrap_table = (bootstrap_rec_t *) ((char *) boot_shm + global_offset);
+    unsigned int *shared_nic = (unsigned int *) ((char *) boot_shm + nic_offset);
+    mdh_addr_t *shared_mem = (mdh_addr_t *) ((char *) boot_shm + mem_offset);
+    mdh_addr_t *shared_sync = (mdh_addr_t *) ((char *) boot_shm + sync_offset);
+
+    // A fresh segment is zero filled, so the counters start at 0.
+    local_recs[local_index] = *my_record;
+    hdr->arrived.fetch_add(1, std::memory_order_release);
+
+    if (leader) {
+	int key_length, value_length;
+	char key[BOOT_KEY_LENGTH];
+
+	hdr->world_size = world_size;
+	hdr->local_size = local_size;
+	int wait_count = 0;
+
+	while (hdr->arrived.load(std::memory_order_acquire) < local_size)
+	    boot_idle(&wait_count);
+
+	rc = PMI_KVS_Get_key_length_max(&key_length);
+	assert(rc == PMI_SUCCESS);
+	rc = PMI_KVS_Get_value_length_max(&value_length);
+	assert(rc == PMI_SUCCESS);
+
+	char *value = (char *) malloc(value_length + 1);
+	assert(value != NULL);
+
+	// Hex encoded, so a chunk holds (value_length - 1) / 2 bytes.
+	int per_chunk = ((value_length - 1) / 2) / sizeof(bootstrap_rec_t);
+	assert(per_chunk > 0);
+	int chunks = (local_size + per_chunk - 1) / per_chunk;
+
+	boot_key(key, key_length, world_rank, -1);
+	snprintf(value, value_length, "%d %d", chunks, local_size);
+	rc = PMI_KVS_Put(kvs, key, value);
+	assert(rc == PMI_SUCCESS);
+
+	for (i = 0; i < chunks; i++) {
+	    int first = i * per_chunk;
+	    int count = (local_size - first < per_chunk) ? local_size - first : per_chunk;
+	    boot_key(key, key_length, world_rank, i);
+	    hex_encode((unsigned char *) &local_recs[first], count * sizeof(bootstrap_rec_t), value);
+	    rc = PMI_KVS_Put(kvs, key, value);
+	    assert(rc == PMI_SUCCESS);
+	}
+
+	rc = PMI_KVS_Commit(kvs);
+	assert(rc == PMI_SUCCESS);
+
+	rc = PMI_Barrier();
+	assert(rc == PMI_SUCCESS);
+
+	/*
+	 * Every leader is the lowest rank of its node, so scanning the ranks
+	 * in order, the first one not yet covered by a node's records is
+	 * always a leader. Only one lookup per node is needed.
+	 */
+	for (i = 0; i < world_size; i++)
+	    bootstrap_table[i].rank = -1;
+
+	bootstrap_rec_t *chunk_recs = (bootstrap_rec_t *) malloc(per_chunk * sizeof(bootstrap_rec_t));
+	assert(chunk_recs != NULL);
+
+	for (int r = 0; r < world_size; r++) {
+	    int peer_chunks, peer_size, j, k;
+
+	    if (bootstrap_table[r].rank == r)
+		continue;
+
+	    if (r == world_rank) {
+		for (j = 0; j < local_size; j++)
+		    bootstrap_table[local_recs[j].rank] = local_recs[j];
+		continue;
+	    }
+
+	    boot_key(key, key_length, r, -1);
+	    rc = PMI_KVS_Get(kvs, key, value, value_length);
+	    if (rc != PMI_SUCCESS) {
+		fprintf(stdout, "[%s] Rank: %4i PMI_KVS_Get %s ERROR rc: %d\n", uts_info.nodename, world_rank, key, rc);
+		PMI_Abort(rc, "bootstrap exchange");
+	    }
+	    sscanf(value, "%d %d", &peer_chunks, &peer_size);
+
+	    for (j = 0; j < peer_chunks; j++) {
+		int first = j * per_chunk;
+		int count = (peer_size - first < per_chunk) ? peer_size - first : per_chunk;
+
+		boot_key(key, key_length, r, j);
+		rc = PMI_KVS_Get(kvs, key, value, value_length);
+		if (rc != PMI_SUCCESS) {
+		    fprintf(stdout, "[%s] Rank: %4i PMI_KVS_Get %s ERROR rc: %d\n", uts_info.nodename, world_rank, key, rc);
+		    PMI_Abort(rc, "bootstrap exchange");
+		}
+		hex_decode(value, count * sizeof(bootstrap_rec_t), (unsigned char *) chunk_recs);
+		for (k = 0; k < count; k++)
+		    bootstrap_table[chunk_recs[k].rank] = chunk_recs[k];
+	    }
+	}
+
+	free(chunk_recs);
+	free(value);
+
+	for (i = 0; i < world_size; i++) {
+	    shared_nic[i] = bootstrap_table[i].nic_addr;
+	    shared_mem[i] = bootstrap_table[i].mem;
+	    shared_sync[i] = bootstrap_table[i].sync;
+	}
+
+	hdr->ready.store(1, std::memory_order_release);
+    } else {
+	rc = PMI_Barrier();
+	assert(rc == PMI_SUCCESS);
+
+	int wait_count = 0;
+
+	while (hdr->ready.load(std::memory_order_acquire) == 0)
+	    boot_idle(&wait_count);
+    }
+
+    free(kvs);
+
+    // The name is only needed until everyone has mapped the segment.
+    if (hdr->attached.fetch_add(1, std::memory_order_acq_rel) + 1 == local_size)
+	shm_unlink(name);
+
+    if (mprotect((char *) boot_shm + global_offset, boot_shm_size - global_offset, PROT_READ) != 0) {
+	fprintf(stdout, "[%s] Rank: %4i mprotect bootstrap tables ERROR errno: %d\n", uts_info.nodename, world_rank, errno);
+    }
+
+    // Switch over from the private tables uGNI_createAndBindEndpoints and
+    // uGNI_regAndExchangeMem allocated.
+    free(all_nic_addresses);
+    free(remote_memory_handle_array);
+    free(remote_sync_array);
+    all_nic_addresses = shared_nic;
+    remote_memory_handle_array = shared_mem;
+    remote_sync_array = shared_sync;
+}
+
+/*
+ * Unmap the node's bootstrap segment.
+ */
+void Node::uGNI_bootstrapDestroy() {
+    if (boot_shm != NULL) {
+	munmap(boot_shm, boot_shm_size);
+	boot_shm = NULL;
+    } else {
+	free(bootstrap_table);
+    }
+    bootstrap_table = NULL;
+}
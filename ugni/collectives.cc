@@ -0,0 +1,1334 @@
+// Collectives for the node class, see collectives.h.
+
+#include <algorithm>
+
+#include "collectives.h"
+
+/* World rank of member i of a group; a NULL group is all ranks. */
+static inline int group_rank(const int *ranks, int i) {
+    return (ranks != NULL) ? ranks[i] : i;
+}
+
+static int group_index(const int *ranks, int size, int rank) {
+    int i;
+
+    if (ranks == NULL)
+	return rank;
+    for (i = 0; i < size; i++) {
+	if (ranks[i] == rank)
+	    return i;
+    }
+    assert(0);
+    return -1;
+}
+
+/* Parent and children of rank in a fanout-ary tree rooted at root. */
+static int tree_links(int rank, int root, int size, int fanout, int *children, int *num_children) {
+    int vr = (rank - root + size) % size;
+    int j;
+
+    *num_children = 0;
+    for (j = 1; j <= fanout && fanout * vr + j < size; j++)
+	children[(*num_children)++] = (fanout * vr + j + root) % size;
+
+    return (vr == 0) ? -1 : ((vr - 1) / fanout + root) % size;
+}
+
+void CollBcast::plan(Node *n, int root, uint64_t off, uint64_t len, uint64_t chunk_bytes, int fanout,
+	const int *ranks, int size) {
+    int j;
+
+    assert(fanout > 0 && fanout <= UGNI_COLL_MAX_FANOUT);
+    assert(chunk_bytes > 0 && chunk_bytes % 4 == 0);
+
+    node = n;
+    offset = off;
+    length = len;
+    chunk = chunk_bytes;
+    num_chunks = (length + chunk - 1) / chunk;
+
+    if (ranks == NULL)
+	size = node->world_size;
+    parent = tree_links(group_index(ranks, size, node->world_rank), group_index(ranks, size, root), size,
+	    fanout, children, &num_children);
+    if (parent >= 0)
+	parent = group_rank(ranks, parent);
+    for (j = 0; j < num_children; j++)
+	children[j] = group_rank(ranks, children[j]);
+
+    // Keep the source CQ from overflowing with the puts to the children.
+    max_inflight = (node->number_of_cq_entries > num_children) ? node->number_of_cq_entries : num_children;
+
+    send_reqs = NULL;
+    if (num_children > 0 && num_chunks > 0) {
+	send_reqs = (uGNI_req_t *) malloc(num_chunks * num_children * sizeof(uGNI_req_t));
+	assert(send_reqs != NULL);
+    }
+}
+
+/*
+ * Claim this run's arrivals on the held stream, or on the one of its
+ * collective number when held is 0.
+ */
+void CollBcast::restart(int held) {
+    epoch = ++node->coll_epoch;
+    stream = held ? held : node->uGNI_collStream(epoch);
+    arrived = node->uGNI_stream(stream)->arrived;
+    expected = node->uGNI_stream(stream)->expected;
+    ready = 0;
+    forwarded = 0;
+    sends_posted = 0;
+    sends_done = 0;
+    rc = 0;
+
+    // Claim the parent's next num_chunks events before any can arrive,
+    // then let the parent know our buffer is free.
+    if (parent >= 0) {
+	recv_base = expected[parent];
+	expected[parent] += num_chunks;
+	node->uGNI_collSignal(parent, epoch);
+    }
+}
+
+void CollBcast::start(Node *n, int root, uint64_t off, uint64_t len, uint64_t chunk_bytes, int fanout,
+	const int *ranks, int size) {
+    plan(n, root, off, len, chunk_bytes, fanout, ranks, size);
+    restart();
+}
+
+/*
+ * Forward every chunk that has landed and is not passed on yet, as far as
+ * the in-flight bound allows and once every child has started this call,
+ * and reap completed puts in post order.
+ *
+ *   Returns: the number of puts posted or reaped.
+ */
+int CollBcast::advance() {
+    uint64_t landed = num_chunks;
+    int work = 0;
+    int j;
+
+    if (parent >= 0 && arrived[parent] - recv_base < landed)
+	landed = arrived[parent] - recv_base;
+
+    while (sends_done < sends_posted && node->uGNI_done(send_reqs[sends_done])) {
+	int error = 0;
+	node->uGNI_test(&send_reqs[sends_done], &error);
+	if (error != 0)
+	    rc = 1;
+	sends_done++;
+	work++;
+    }
+
+    while (ready < num_children && node->uGNI_collReady(children[ready], epoch))
+	ready++;
+
+    while (forwarded < landed && ready == num_children && num_children > 0 &&
+	    sends_posted - sends_done + num_children <= max_inflight) {
+	uint64_t off = offset + forwarded * chunk;
+	uint64_t size = (forwarded + 1 == num_chunks) ? length - forwarded * chunk : chunk;
+
+	for (j = 0; j < num_children; j++) {
+	    uGNI_req_t req = node->uGNI_postT<PutSignalPost>(children[j], node->my_memory_handle.addr + off,
+		    node->recv_mem_handle, off, size, stream);
+	    if (req == UGNI_REQ_NULL)
+		rc = 1;
+	    send_reqs[sends_posted++] = req;
+	}
+	forwarded++;
+	work++;
+    }
+
+    if (num_children == 0)
+	forwarded = landed;
+
+    return work;
+}
+
+bool CollBcast::done() {
+    if (forwarded < num_chunks || sends_done < sends_posted)
+	return false;
+    return parent < 0 || arrived[parent] - recv_base >= num_chunks;
+}
+
+void CollBcast::finish() {
+    free(send_reqs);
+    send_reqs = NULL;
+}
+
+/*
+ * Chunk size and fan-out of uGNI_broadcast. A fan-out of 1 streams down a
+ * chain, which suits long messages; a wider tree has fewer hops for short
+ * ones.
+ */
+void Node::uGNI_setBroadcast(uint64_t chunk_bytes, int fanout) {
+    bcast_chunk_bytes = chunk_bytes;
+    bcast_fanout = fanout;
+}
+
+/*
+ * Broadcast length bytes at buf from root to every rank. buf must lie in
+ * the registered receive buffer, at the same offset on every rank.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_broadcast(int root, void *buf, uint64_t length) {
+    uint64_t offset = (uint64_t) buf - my_memory_handle.addr;
+    CollBcast bcast;
+
+    assert((uint64_t) buf >= my_memory_handle.addr && offset + length <= recv_buffer_length);
+
+    bcast.start(this, root, offset, length, bcast_chunk_bytes, bcast_fanout);
+    int rc = coll_wait(this, &bcast);
+    bcast.finish();
+
+    return (rc != 0) ? rc : bcast.rc;
+}
+
+enum {
+    RD_FOLD_SEND = 0,	/* extra even rank: hand the vector to r + 1 */
+    RD_WAIT_RESULT,	/* extra even rank: wait for the result */
+    RD_FOLD_RECV,	/* odd partner: add in the extra rank's vector */
+    RD_STEP,
+    RD_UNFOLD,		/* odd partner: send the result back to r - 1 */
+    RD_DONE
+};
+
+static inline int mod(int a, int n) {
+    return ((a % n) + n) % n;
+}
+
+int CollAllreduce::choose(Node *node, int n, uint64_t count, uGNI_dtype_t type) {
+    if (n == 1 || count < (uint64_t) n || count * dtype_size(type) <= node->allreduce_rd_bytes)
+	return UGNI_ALLREDUCE_RD;
+    return UGNI_ALLREDUCE_RING;
+}
+
+/* Scratch an allreduce of count elements needs in the receive buffer. */
+uint64_t CollAllreduce::scratchBytes(Node *node, int n, uint64_t count, uGNI_dtype_t type) {
+    uint64_t esize = dtype_size(type);
+
+    if (choose(node, n, count, type) == UGNI_ALLREDUCE_RING)
+	return (n - 1) * round_cacheline((count + n - 1) / n * esize);
+
+    int steps = 0;
+    while ((2 << steps) <= n)
+	steps++;
+    return (steps + 1) * round_cacheline(count * esize);
+}
+
+uint64_t CollAllreduce::segBegin(int seg) {
+    return (uint64_t) seg * count / n;
+}
+
+uint64_t CollAllreduce::pieces(int seg) {
+    return (segBegin(seg + 1) - segBegin(seg) + chunk_elems - 1) / chunk_elems;
+}
+
+int CollAllreduce::rdPeer(int vrank) {
+    return group_rank(ranks, (vrank < rem) ? 2 * vrank + 1 : vrank + rem);
+}
+
+void CollAllreduce::plan(Node *nd, uint64_t buf, uint64_t scratch, uint64_t cnt, uGNI_dtype_t t, uGNI_op_t o,
+	const int *group, int size) {
+    uint64_t max_posts;
+    int k;
+
+    node = nd;
+    buf_off = buf;
+    scratch_off = scratch;
+    count = cnt;
+    type = t;
+    op = o;
+    esize = dtype_size(type);
+    ranks = group;
+    n = (group != NULL) ? size : node->world_size;
+    r = group_index(group, n, node->world_rank);
+    algorithm = choose(node, n, count, type);
+
+    max_inflight = (node->number_of_cq_entries > 1) ? node->number_of_cq_entries : 1;
+
+    if (algorithm == UGNI_ALLREDUCE_RING) {
+	left = group_rank(ranks, mod(r - 1, n));
+	right = group_rank(ranks, mod(r + 1, n));
+	chunk_elems = node->allreduce_chunk_bytes / esize;
+	if (chunk_elems == 0)
+	    chunk_elems = 1;
+	slot_bytes = round_cacheline((count + n - 1) / n * esize);
+
+	ring_arrivals = 0;
+	for (k = 0; k < n - 1; k++)
+	    ring_arrivals += pieces(mod(r - k - 1, n)) + pieces(mod(r - k, n));
+	max_posts = ring_arrivals;
+    } else {
+	pof2 = 1;
+	steps = 0;
+	while (pof2 * 2 <= n) {
+	    pof2 *= 2;
+	    steps++;
+	}
+	rem = n - pof2;
+	slot_bytes = round_cacheline(count * esize);
+
+	if (r < 2 * rem && r % 2 == 0)
+	    newrank = -1;
+	else if (r < 2 * rem)
+	    newrank = r / 2;
+	else
+	    newrank = r - rem;
+	max_posts = steps + 1;
+    }
+
+    send_reqs = (uGNI_req_t *) malloc((max_posts + 1) * sizeof(uGNI_req_t));
+    assert(send_reqs != NULL);
+}
+
+void CollAllreduce::restart(int held) {
+    int k;
+
+    rc = 0;
+    sends_posted = 0;
+    sends_done = 0;
+    epoch = ++node->coll_epoch;
+    stream = held ? held : node->uGNI_collStream(epoch);
+    arrived = node->uGNI_stream(stream)->arrived;
+    expected = node->uGNI_stream(stream)->expected;
+
+    // Claim the arrivals of this call before any can come, then let every
+    // rank that puts into us know that our buffers are free.
+    if (algorithm == UGNI_ALLREDUCE_RING) {
+	recv_base = expected[left];
+	expected[left] += ring_arrivals;
+	if (n > 1)
+	    node->uGNI_collSignal(left, epoch);
+
+	consumed = 0;
+	initial_posted = 0;
+	right_ready = false;
+	phase = 0;
+	step = 0;
+	piece = 0;
+	return;
+    }
+
+    if (newrank < 0) {
+	state = RD_FOLD_SEND;
+	targets[steps] = expected[group_rank(ranks, r + 1)] += 1;
+	node->uGNI_collSignal(group_rank(ranks, r + 1), epoch);
+    } else {
+	if (r < 2 * rem) {
+	    state = RD_FOLD_RECV;
+	    targets[steps] = expected[group_rank(ranks, r - 1)] += 1;
+	    node->uGNI_collSignal(group_rank(ranks, r - 1), epoch);
+	} else {
+	    state = RD_STEP;
+	}
+	for (k = 0; k < steps; k++) {
+	    int partner = rdPeer(newrank ^ (1 << k));
+	    targets[k] = expected[partner] += 1;
+	    node->uGNI_collSignal(partner, epoch);
+	}
+    }
+
+    step = 0;
+    posted = false;
+}
+
+void CollAllreduce::start(Node *nd, uint64_t buf, uint64_t scratch, uint64_t cnt, uGNI_dtype_t t, uGNI_op_t o,
+	const int *group, int size) {
+    plan(nd, buf, scratch, cnt, t, o, group, size);
+    restart();
+}
+
+bool CollAllreduce::post(int peer, uint64_t local_off, uint64_t remote_off, uint64_t bytes) {
+    uGNI_req_t req = node->uGNI_postT<PutSignalPost>(peer, node->my_memory_handle.addr + local_off,
+	    node->recv_mem_handle, remote_off, bytes, stream);
+    if (req == UGNI_REQ_NULL)
+	rc = 1;
+    send_reqs[sends_posted++] = req;
+    return req != UGNI_REQ_NULL;
+}
+
+/* Has peer started this call, so that we may put into it? */
+bool CollAllreduce::ready(int peer) {
+    return node->uGNI_collReady(peer, epoch);
+}
+
+void CollAllreduce::reap() {
+    while (sends_done < sends_posted && node->uGNI_done(send_reqs[sends_done])) {
+	int error = 0;
+	node->uGNI_test(&send_reqs[sends_done], &error);
+	if (error != 0)
+	    rc = 1;
+	sends_done++;
+    }
+}
+
+/*
+ * Ring: the first step's chunks of our own segment go out as soon as the
+ * right neighbour has started this call; every chunk that arrives
+ * afterwards is reduced (reduce-scatter) or kept (allgather) and passed
+ * on to the right, chunk by chunk.
+ */
+int CollAllreduce::advanceRing() {
+    uint8_t *base = (uint8_t *) node->my_memory_handle.addr;
+    uint64_t landed = arrived[left] - recv_base;
+    int work = 0;
+
+    if (!right_ready)
+	right_ready = ready(right);
+    if (!right_ready)
+	return 0;
+
+    while (initial_posted < pieces(r) && sends_posted - sends_done < max_inflight) {
+	uint64_t lo = segBegin(r) + initial_posted * chunk_elems;
+	uint64_t cnt = segBegin(r + 1) - lo;
+	if (cnt > chunk_elems)
+	    cnt = chunk_elems;
+	post(right, buf_off + lo * esize, scratch_off + initial_posted * chunk_elems * esize, cnt * esize);
+	initial_posted++;
+	work++;
+    }
+
+    while (phase < 2 && consumed < landed && sends_posted - sends_done < max_inflight) {
+	int seg = (phase == 0) ? mod(r - step - 1, n) : mod(r - step, n);
+	uint64_t lo = segBegin(seg) + piece * chunk_elems;
+	uint64_t cnt = segBegin(seg + 1) - lo;
+	if (cnt > chunk_elems)
+	    cnt = chunk_elems;
+
+	if (phase == 0) {
+	    reduce_local(base + buf_off + lo * esize,
+		    base + scratch_off + step * slot_bytes + piece * chunk_elems * esize, cnt, type, op);
+	    if (step < n - 2)
+		post(right, buf_off + lo * esize, scratch_off + (step + 1) * slot_bytes + piece * chunk_elems * esize, cnt * esize);
+	    else
+		post(right, buf_off + lo * esize, buf_off + lo * esize, cnt * esize);
+	} else if (step < n - 2) {
+	    post(right, buf_off + lo * esize, buf_off + lo * esize, cnt * esize);
+	}
+
+	if (++piece == pieces(seg)) {
+	    piece = 0;
+	    if (++step == n - 1) {
+		step = 0;
+		phase++;
+	    }
+	}
+	consumed++;
+	work++;
+    }
+
+    return work;
+}
+
+/*
+ * Recursive doubling: post the whole vector to the step's partner once it
+ * has started this call, and once the partner's has landed and ours has
+ * left, add it in.
+ */
+int CollAllreduce::advanceRd() {
+    uint8_t *base = (uint8_t *) node->my_memory_handle.addr;
+    uint64_t bytes = count * esize;
+    int last = state + 1;
+    int work = 0;
+
+    while (state != last) {
+	last = state;
+	reap();
+
+	switch (state) {
+	    case RD_FOLD_SEND:
+		if (!ready(group_rank(ranks, r + 1)))
+		    break;
+		post(group_rank(ranks, r + 1), buf_off, scratch_off + steps * slot_bytes, bytes);
+		state = RD_WAIT_RESULT;
+		work++;
+		break;
+
+	    case RD_WAIT_RESULT:
+		if (arrived[group_rank(ranks, r + 1)] >= targets[steps] && sends_done == sends_posted)
+		    state = RD_DONE;
+		break;
+
+	    case RD_FOLD_RECV:
+		if (arrived[group_rank(ranks, r - 1)] >= targets[steps]) {
+		    reduce_local(base + buf_off, base + scratch_off + steps * slot_bytes, count, type, op);
+		    state = RD_STEP;
+		    work++;
+		}
+		break;
+
+	    case RD_STEP: {
+		if (step == steps) {
+		    state = (r < 2 * rem) ? RD_UNFOLD : RD_DONE;
+		    break;
+		}
+		int partner = rdPeer(newrank ^ (1 << step));
+		if (!posted && ready(partner)) {
+		    post(partner, buf_off, scratch_off + step * slot_bytes, bytes);
+		    posted = true;
+		    work++;
+		    reap();
+		}
+		if (posted && arrived[partner] >= targets[step] && sends_done == sends_posted) {
+		    reduce_local(base + buf_off, base + scratch_off + step * slot_bytes, count, type, op);
+		    step++;
+		    posted = false;
+		    last = -1;
+		    work++;
+		}
+		break;
+	    }
+
+	    case RD_UNFOLD:
+		if (!posted && ready(group_rank(ranks, r - 1))) {
+		    post(group_rank(ranks, r - 1), buf_off, buf_off, bytes);
+		    posted = true;
+		    work++;
+		    reap();
+		}
+		if (posted && sends_done == sends_posted)
+		    state = RD_DONE;
+		break;
+	}
+    }
+
+    return work;
+}
+
+int CollAllreduce::advance() {
+    reap();
+    if (algorithm == UGNI_ALLREDUCE_RING)
+	return advanceRing();
+    return advanceRd();
+}
+
+bool CollAllreduce::done() {
+    if (sends_done < sends_posted)
+	return false;
+    if (algorithm == UGNI_ALLREDUCE_RING)
+	return phase == 2 || n == 1;
+    return state == RD_DONE;
+}
+
+void CollAllreduce::finish() {
+    free(send_reqs);
+    send_reqs = NULL;
+}
+
+/*
+ * Chunk size of the ring allreduce and the vector size up to which
+ * recursive doubling is used instead.
+ */
+void Node::uGNI_setAllreduce(uint64_t chunk_bytes, uint64_t rd_bytes) {
+    allreduce_chunk_bytes = chunk_bytes;
+    allreduce_rd_bytes = rd_bytes;
+}
+
+uint64_t Node::uGNI_allreduceScratch(uint64_t count, uGNI_dtype_t type) {
+    return CollAllreduce::scratchBytes(this, world_size, count, type);
+}
+
+/*
+ * Combine count elements at buf across all ranks with op, leaving the
+ * result at buf everywhere. buf and scratch must lie in the registered
+ * receive buffer, at the same offsets on every rank; scratch must hold
+ * uGNI_allreduceScratch(count, type) bytes. Allreduces may follow each
+ * other back to back: a rank puts into a partner only once the partner
+ * has reached the same call.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_allreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    uint64_t buf_off = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t scratch_off = (uint64_t) scratch - my_memory_handle.addr;
+    CollAllreduce allreduce;
+
+    assert((uint64_t) buf >= my_memory_handle.addr && buf_off + count * dtype_size(type) <= recv_buffer_length);
+    assert((uint64_t) scratch >= my_memory_handle.addr &&
+	    scratch_off + uGNI_allreduceScratch(count, type) <= recv_buffer_length);
+
+    allreduce.start(this, buf_off, scratch_off, count, type, op);
+    int rc = coll_wait(this, &allreduce);
+    allreduce.finish();
+
+    return (rc != 0) ? rc : allreduce.rc;
+}
+
+/*
+ * Scratch a reduce of count elements needs in the receive buffer, one
+ * slot per child.
+ */
+uint64_t CollReduce::scratchBytes(int n, uint64_t count, uGNI_dtype_t type, int fanout) {
+    int slots = (fanout < n - 1) ? fanout : n - 1;
+
+    return slots * round_cacheline(count * dtype_size(type));
+}
+
+void CollReduce::start(Node *nd, int root, uint64_t buf, uint64_t scratch, uint64_t cnt, uGNI_dtype_t t,
+	uGNI_op_t o, int fanout, const int *ranks, int size) {
+    int j;
+
+    assert(fanout > 0 && fanout <= UGNI_COLL_MAX_FANOUT);
+
+    node = nd;
+    buf_off = buf;
+    count = cnt;
+    type = t;
+    op = o;
+    esize = dtype_size(type);
+    rc = 0;
+    reduced = 0;
+    sends_posted = 0;
+    sends_done = 0;
+
+    if (ranks == NULL)
+	size = node->world_size;
+    int me = group_index(ranks, size, node->world_rank);
+    int vr = (me - group_index(ranks, size, root) + size) % size;
+
+    parent = tree_links(me, group_index(ranks, size, root), size, fanout, children, &num_children);
+    if (parent >= 0)
+	parent = group_rank(ranks, parent);
+    slot = (vr > 0) ? (vr - 1) % fanout : 0;
+
+    chunk_elems = node->allreduce_chunk_bytes / esize;
+    if (chunk_elems == 0)
+	chunk_elems = 1;
+    num_chunks = (count + chunk_elems - 1) / chunk_elems;
+    slot_bytes = round_cacheline(count * esize);
+
+    scratch_off = scratch;
+    epoch = ++node->coll_epoch;
+    stream = node->uGNI_collStream(epoch);
+    arrived = node->uGNI_stream(stream)->arrived;
+    parent_ready = false;
+
+    // Claim every child's next num_chunks events before any can arrive,
+    // then let the child know its slot is free.
+    uint64_t *expected = node->uGNI_stream(stream)->expected;
+    for (j = 0; j < num_children; j++) {
+	children[j] = group_rank(ranks, children[j]);
+	recv_base[j] = expected[children[j]];
+	expected[children[j]] += num_chunks;
+	node->uGNI_collSignal(children[j], epoch);
+    }
+
+    max_inflight = (node->number_of_cq_entries > 1) ? node->number_of_cq_entries : 1;
+
+    send_reqs = NULL;
+    if (parent >= 0 && num_chunks > 0) {
+	send_reqs = (uGNI_req_t *) malloc(num_chunks * sizeof(uGNI_req_t));
+	assert(send_reqs != NULL);
+    }
+}
+
+/*
+ * Combine every chunk all children have delivered and pass it up, as far
+ * as the in-flight bound allows and once the parent has started this
+ * call, and reap completed puts in post order.
+ *
+ *   Returns: the number of chunks combined or puts reaped.
+ */
+int CollReduce::advance() {
+    uint8_t *base = (uint8_t *) node->my_memory_handle.addr;
+    uint64_t landed = num_chunks;
+    int work = 0;
+    int j;
+
+    for (j = 0; j < num_children; j++) {
+	if (arrived[children[j]] - recv_base[j] < landed)
+	    landed = arrived[children[j]] - recv_base[j];
+    }
+
+    while (sends_done < sends_posted && node->uGNI_done(send_reqs[sends_done])) {
+	int error = 0;
+	node->uGNI_test(&send_reqs[sends_done], &error);
+	if (error != 0)
+	    rc = 1;
+	sends_done++;
+	work++;
+    }
+
+    if (parent >= 0 && !parent_ready)
+	parent_ready = node->uGNI_collReady(parent, epoch);
+
+    while (reduced < landed && (parent < 0 || (parent_ready && sends_posted - sends_done < max_inflight))) {
+	uint64_t lo = reduced * chunk_elems;
+	uint64_t cnt = (count - lo < chunk_elems) ? count - lo : chunk_elems;
+
+	for (j = 0; j < num_children; j++)
+	    reduce_local(base + buf_off + lo * esize, base + scratch_off + j * slot_bytes + lo * esize, cnt, type, op);
+
+	if (parent >= 0) {
+	    uGNI_req_t req = node->uGNI_postT<PutSignalPost>(parent, node->my_memory_handle.addr + buf_off + lo * esize,
+		    node->recv_mem_handle, scratch_off + slot * slot_bytes + lo * esize, cnt * esize, stream);
+	    if (req == UGNI_REQ_NULL)
+		rc = 1;
+	    send_reqs[sends_posted++] = req;
+	}
+	reduced++;
+	work++;
+    }
+
+    return work;
+}
+
+bool CollReduce::done() {
+    return reduced == num_chunks && sends_done == sends_posted;
+}
+
+void CollReduce::finish() {
+    free(send_reqs);
+    send_reqs = NULL;
+}
+
+uint64_t Node::uGNI_reduceScratch(uint64_t count, uGNI_dtype_t type) {
+    return CollReduce::scratchBytes(world_size, count, type, bcast_fanout);
+}
+
+/*
+ * Combine count elements at buf across all ranks with op, leaving the
+ * result at buf on root and partial results elsewhere. The tree is the
+ * one uGNI_setBroadcast configures, the chunk size uGNI_setAllreduce's.
+ * buf and scratch must lie in the registered receive buffer, at the same
+ * offsets on every rank; scratch must hold uGNI_reduceScratch(count, type)
+ * bytes. Reduces may follow each other back to back: a rank puts into its
+ * parent's scratch only once the parent has reached the same call.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_reduce(int root, void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    uint64_t buf_off = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t scratch_off = (uint64_t) scratch - my_memory_handle.addr;
+    CollReduce reduce;
+
+    assert((uint64_t) buf >= my_memory_handle.addr && buf_off + count * dtype_size(type) <= recv_buffer_length);
+    assert((uint64_t) scratch >= my_memory_handle.addr &&
+	    scratch_off + uGNI_reduceScratch(count, type) <= recv_buffer_length);
+
+    reduce.start(this, root, buf_off, scratch_off, count, type, op, bcast_fanout);
+    int rc = coll_wait(this, &reduce);
+    reduce.finish();
+
+    return (rc != 0) ? rc : reduce.rc;
+}
+
+/*
+ * Order in which this rank visits its peers in an all-to-all, built once
+ * from the bootstrap table: ranks on the same Aries router first, then
+ * the rest of the group, then the other groups. The mesh x coordinate
+ * stands for the group. Within a tier peers are taken from r + 1 upwards,
+ * and every rank of a group starts the remote groups, and the ranks in
+ * them, at its own index within the group, so the group's ranks spread
+ * over the global links instead of all hitting the same group at once.
+ */
+void Node::uGNI_topoOrder() {
+    int n = world_size;
+    int r = world_rank;
+    const pmi_mesh_coord_t &me = bootstrap_table[r].coord;
+    int *by_group;
+    int num_order = 0;
+    int i, k;
+
+    if (a2a_order != NULL)
+	return;
+
+    a2a_order = (int *) malloc(n * sizeof(int));
+    by_group = (int *) malloc(n * sizeof(int));
+    assert(a2a_order != NULL && by_group != NULL);
+
+    for (k = 1; k < n; k++) {
+	const pmi_mesh_coord_t &c = bootstrap_table[(r + k) % n].coord;
+	if (c.mesh_x == me.mesh_x && c.mesh_y == me.mesh_y && c.mesh_z == me.mesh_z)
+	    a2a_order[num_order++] = (r + k) % n;
+    }
+    for (k = 1; k < n; k++) {
+	const pmi_mesh_coord_t &c = bootstrap_table[(r + k) % n].coord;
+	if (c.mesh_x == me.mesh_x && (c.mesh_y != me.mesh_y || c.mesh_z != me.mesh_z))
+	    a2a_order[num_order++] = (r + k) % n;
+    }
+
+    // All ranks sorted by group, then rank; find the group boundaries.
+    for (i = 0; i < n; i++)
+	by_group[i] = i;
+    std::sort(by_group, by_group + n, [this](int a, int b) {
+	    uint16_t ga = bootstrap_table[a].coord.mesh_x, gb = bootstrap_table[b].coord.mesh_x;
+	    return (ga != gb) ? ga < gb : a < b;
+	    });
+
+    int num_groups = 0, my_group = 0, my_index = 0;
+    int *group_start = (int *) malloc((n + 1) * sizeof(int));
+    assert(group_start != NULL);
+    for (i = 0; i < n; i++) {
+	if (i == 0 || bootstrap_table[by_group[i]].coord.mesh_x != bootstrap_table[by_group[i - 1]].coord.mesh_x)
+	    group_start[num_groups++] = i;
+	if (by_group[i] == r) {
+	    my_group = num_groups - 1;
+	    my_index = i - group_start[my_group];
+	}
+    }
+    group_start[num_groups] = n;
+
+    // Offsets 1 .. num_groups - 1, rotated by our index in the group.
+    for (k = 0; k < num_groups - 1; k++) {
+	int g = (my_group + 1 + (my_index + k) % (num_groups - 1)) % num_groups;
+	int size = group_start[g + 1] - group_start[g];
+	for (i = 0; i < size; i++)
+	    a2a_order[num_order++] = by_group[group_start[g] + (my_index + i) % size];
+    }
+    assert(num_order == n - 1);
+
+    free(group_start);
+    free(by_group);
+}
+
+void CollAlltoall::plan(Node *nd, uint64_t soff, const uint64_t *scounts, const uint64_t *sdisp,
+	uint64_t roff, const uint64_t *rcounts, const uint64_t *rdisp) {
+    int n = nd->world_size;
+
+    node = nd;
+    send_off = soff;
+    recv_off = roff;
+    chunk = node->a2a_chunk_bytes;
+    window = node->a2a_window;
+    per_peer = node->a2a_per_peer;
+    max_inflight = (node->number_of_cq_entries > 1) ? node->number_of_cq_entries : 1;
+
+    node->uGNI_topoOrder();
+
+    sendcounts = (uint64_t *) malloc(6 * n * sizeof(uint64_t));
+    assert(sendcounts != NULL);
+    sdispls = sendcounts + n;
+    remote_displs = sdispls + n;
+    recvcounts = remote_displs + n;
+    recv_targets = recvcounts + n;
+    posted_to = recv_targets + n;
+    memcpy(sendcounts, scounts, n * sizeof(uint64_t));
+    memcpy(sdispls, sdisp, n * sizeof(uint64_t));
+    memcpy(remote_displs, rdisp, n * sizeof(uint64_t));
+    memcpy(recvcounts, rcounts, n * sizeof(uint64_t));
+
+    inflight_to = (int *) calloc(n + max_inflight, sizeof(int));
+    reqs = (uGNI_req_t *) malloc(max_inflight * sizeof(uGNI_req_t));
+    assert(inflight_to != NULL && reqs != NULL);
+    req_peer = inflight_to + n;
+}
+
+void CollAlltoall::restart(int held) {
+    int n = node->world_size;
+    int r = node->world_rank;
+    int p;
+
+    rc = 0;
+    cursor = 0;
+    recv_cursor = 0;
+    epoch = ++node->coll_epoch;
+    stream = held ? held : node->uGNI_collStream(epoch);
+    arrived = node->uGNI_stream(stream)->arrived;
+    uint64_t *expected = node->uGNI_stream(stream)->expected;
+    signaled = 0;
+    outstanding = 0;
+    memset(posted_to, 0, n * sizeof(uint64_t));
+    memset(inflight_to, 0, n * sizeof(int));
+
+    // Claim every peer's chunks before any can arrive.
+    for (p = 0; p < n; p++) {
+	if (p == r)
+	    continue;
+	expected[p] += (recvcounts[p] + chunk - 1) / chunk;
+	recv_targets[p] = expected[p];
+    }
+
+    // Our own block is a local copy.
+    memcpy((void *) (node->my_memory_handle.addr + recv_off + remote_displs[r]),
+	    (void *) (node->send_buffer_addr + send_off + sdispls[r]), sendcounts[r]);
+}
+
+void CollAlltoall::start(Node *nd, uint64_t soff, const uint64_t *scounts, const uint64_t *sdisp,
+	uint64_t roff, const uint64_t *rcounts, const uint64_t *rdisp) {
+    plan(nd, soff, scounts, sdisp, roff, rcounts, rdisp);
+    restart();
+}
+
+/*
+ * Reap completed puts, tell the peers we send to in topology order that
+ * this call has started here, then post to the next window peers that
+ * have started it too, as far as the per-peer and total bounds allow.
+ * The ready writes count against the total bound like the puts.
+ *
+ *   Returns: the number of puts posted or reaped.
+ */
+int CollAlltoall::advance() {
+    int n = node->world_size;
+    const int *order = node->a2a_order;
+    int work = 0;
+    int i, w;
+
+    for (i = 0; i < outstanding; ) {
+	if (!node->uGNI_done(reqs[i])) {
+	    i++;
+	    continue;
+	}
+	int error = 0;
+	node->uGNI_test(&reqs[i], &error);
+	if (error != 0)
+	    rc = 1;
+	if (req_peer[i] >= 0)
+	    inflight_to[req_peer[i]]--;
+	outstanding--;
+	reqs[i] = reqs[outstanding];
+	req_peer[i] = req_peer[outstanding];
+	work++;
+    }
+
+    while (signaled < n - 1 && outstanding < max_inflight) {
+	int p = order[signaled++];
+
+	// Nothing comes from p, so p never waits for us.
+	if (recvcounts[p] == 0)
+	    continue;
+	uGNI_req_t req = node->uGNI_collSignal(p, epoch, true);
+	work++;
+	if (req == UGNI_REQ_NULL) {
+	    rc = 1;
+	    continue;
+	}
+	reqs[outstanding] = req;
+	req_peer[outstanding] = -1;
+	outstanding++;
+    }
+
+    while (cursor < n - 1 && posted_to[order[cursor]] >= sendcounts[order[cursor]])
+	cursor++;
+
+    for (i = cursor, w = 0; i < n - 1 && w < window && outstanding < max_inflight; i++) {
+	int p = order[i];
+
+	if (posted_to[p] >= sendcounts[p] || !node->uGNI_collReady(p, epoch))
+	    continue;
+	w++;
+
+	while (posted_to[p] < sendcounts[p] && inflight_to[p] < per_peer && outstanding < max_inflight) {
+	    uint64_t size = sendcounts[p] - posted_to[p];
+	    if (size > chunk)
+		size = chunk;
+
+	    uGNI_req_t req = node->uGNI_postT<PutSignalPost>(p, node->send_buffer_addr + send_off + sdispls[p] + posted_to[p],
+		    node->send_mem_handle, recv_off + remote_displs[p] + posted_to[p], size, stream);
+	    posted_to[p] += size;
+	    work++;
+	    if (req == UGNI_REQ_NULL) {
+		rc = 1;
+		continue;
+	    }
+	    reqs[outstanding] = req;
+	    req_peer[outstanding] = p;
+	    outstanding++;
+	    inflight_to[p]++;
+	}
+    }
+
+    return work;
+}
+
+bool CollAlltoall::done() {
+    int n = node->world_size;
+
+    if (outstanding > 0 || cursor < n - 1 || signaled < n - 1)
+	return false;
+
+    while (recv_cursor < n) {
+	int p = recv_cursor;
+	if (p != node->world_rank && arrived[p] < recv_targets[p])
+	    return false;
+	recv_cursor++;
+    }
+    return true;
+}
+
+void CollAlltoall::finish() {
+    free(sendcounts);
+    free(inflight_to);
+    free(reqs);
+    sendcounts = NULL;
+    inflight_to = NULL;
+    reqs = NULL;
+}
+
+/*
+ * Chunk size of all-to-all puts, how many peers are served at a time and
+ * how many chunks each may have in flight.
+ */
+void Node::uGNI_setAlltoall(uint64_t chunk_bytes, int window, int per_peer) {
+    a2a_chunk_bytes = chunk_bytes;
+    a2a_window = window;
+    a2a_per_peer = per_peer;
+}
+
+/*
+ * Personalized exchange with per-peer sizes. Block p starts at sendbuf +
+ * sdispls[p], in the registered send buffer, and is sendcounts[p] bytes
+ * long. It lands in peer p's receive buffer at recvbuf + remote_displs[p]:
+ * the offset p's own rdispls give to this rank, which a caller with
+ * MPI-style receive displacements learns with one uGNI_alltoall of them.
+ * recvcounts[p] is the size of the block coming from p. recvbuf must be at
+ * the same offset of the receive buffer on every rank. Sizes and
+ * displacements must be multiples of 4. Exchanges may follow each other
+ * back to back: a rank puts into a peer only once the peer has reached
+ * the same call, so recvbuf is never overwritten before it is returned.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_alltoallv(void *sendbuf, const uint64_t *sendcounts, const uint64_t *sdispls,
+	void *recvbuf, const uint64_t *recvcounts, const uint64_t *remote_displs) {
+    CollAlltoall a2a;
+
+    assert((uint64_t) sendbuf >= send_buffer_addr && (uint64_t) recvbuf >= my_memory_handle.addr);
+
+    a2a.start(this, (uint64_t) sendbuf - send_buffer_addr, sendcounts, sdispls,
+	    (uint64_t) recvbuf - my_memory_handle.addr, recvcounts, remote_displs);
+    int rc = coll_wait(this, &a2a);
+    a2a.finish();
+
+    return (rc != 0) ? rc : a2a.rc;
+}
+
+/* Counts, displacements and remote displacements of bytes per peer. */
+static uint64_t *uniform_counts(Node *node, uint64_t bytes) {
+    int n = node->world_size;
+    uint64_t *counts = (uint64_t *) malloc(3 * n * sizeof(uint64_t));
+    int p;
+
+    assert(counts != NULL);
+    for (p = 0; p < n; p++) {
+	counts[p] = bytes;
+	counts[n + p] = p * bytes;
+	counts[2 * n + p] = node->world_rank * bytes;
+    }
+    return counts;
+}
+
+/*
+ * Personalized exchange of bytes per peer: block p of sendbuf goes to
+ * block world_rank of peer p's recvbuf.
+ */
+int Node::uGNI_alltoall(void *sendbuf, void *recvbuf, uint64_t bytes) {
+    uint64_t *counts = uniform_counts(this, bytes);
+    uint64_t *displs = counts + world_size;
+    uint64_t *remote_displs = displs + world_size;
+
+    assert((uint64_t) sendbuf + world_size * bytes <= send_buffer_addr + send_buffer_length);
+    assert((uint64_t) recvbuf + world_size * bytes <= my_memory_handle.addr + recv_buffer_length);
+
+    int rc = uGNI_alltoallv(sendbuf, counts, displs, recvbuf, counts, remote_displs);
+    free(counts);
+
+    return rc;
+}
+
+void CollPlan::restart() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: bcast.restart(stream); break;
+	case UGNI_COLL_ALLREDUCE: allreduce.restart(stream); break;
+	case UGNI_COLL_ALLTOALL: alltoall.restart(stream); break;
+    }
+}
+
+int CollPlan::advance() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: return bcast.advance();
+	case UGNI_COLL_ALLREDUCE: return allreduce.advance();
+	default: return alltoall.advance();
+    }
+}
+
+bool CollPlan::done() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: return bcast.done();
+	case UGNI_COLL_ALLREDUCE: return allreduce.done();
+	default: return alltoall.done();
+    }
+}
+
+int CollPlan::status() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: return bcast.rc;
+	case UGNI_COLL_ALLREDUCE: return allreduce.rc;
+	default: return alltoall.rc;
+    }
+}
+
+int CollPlan::runStream() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: return bcast.stream;
+	case UGNI_COLL_ALLREDUCE: return allreduce.stream;
+	default: return alltoall.stream;
+    }
+}
+
+/*
+ * Byte ranges of the receive buffer the plan's peers write into: the
+ * broadcast data, the allreduce vector and its scratch, or the all-to-all
+ * blocks, taken as packed one after the other.
+ *
+ *   Returns: the number of ranges.
+ */
+int CollPlan::recvRanges(uint64_t *lo, uint64_t *hi) {
+    uint64_t total = 0;
+    int p;
+
+    switch (kind) {
+	case UGNI_COLL_BCAST:
+	    lo[0] = bcast.offset;
+	    hi[0] = bcast.offset + bcast.length;
+	    return 1;
+	case UGNI_COLL_ALLREDUCE:
+	    lo[0] = allreduce.buf_off;
+	    hi[0] = allreduce.buf_off + allreduce.count * allreduce.esize;
+	    lo[1] = allreduce.scratch_off;
+	    hi[1] = allreduce.scratch_off + CollAllreduce::scratchBytes(allreduce.node, allreduce.n,
+		    allreduce.count, allreduce.type);
+	    return 2;
+	default:
+	    for (p = 0; p < alltoall.node->world_size; p++)
+		total += alltoall.recvcounts[p];
+	    lo[0] = alltoall.recv_off;
+	    hi[0] = alltoall.recv_off + total;
+	    return 1;
+    }
+}
+
+/* Do the two plans write any byte of the receive buffer in common? */
+bool CollPlan::overlaps(CollPlan *other) {
+    uint64_t lo[2], hi[2], olo[2], ohi[2];
+    int n = recvRanges(lo, hi);
+    int on = other->recvRanges(olo, ohi);
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < on; j++) {
+	    if (lo[i] < ohi[j] && olo[j] < hi[i])
+		return true;
+	}
+    }
+    return false;
+}
+
+void CollPlan::finish() {
+    switch (kind) {
+	case UGNI_COLL_BCAST: bcast.finish(); break;
+	case UGNI_COLL_ALLREDUCE: allreduce.finish(); break;
+	case UGNI_COLL_ALLTOALL: alltoall.finish(); break;
+    }
+}
+
+static CollPlan *plan_alloc(int kind) {
+    CollPlan *plan = (CollPlan *) calloc(1, sizeof(CollPlan));
+    assert(plan != NULL);
+    plan->kind = kind;
+    plan->req = UGNI_REQ_NULL;
+    return plan;
+}
+
+/*
+ * Plan a broadcast, with the buffer rules of uGNI_broadcast. The tree and
+ * chunk size are those set when the plan is made.
+ */
+CollPlan *Node::uGNI_broadcastInit(int root, void *buf, uint64_t length) {
+    uint64_t offset = (uint64_t) buf - my_memory_handle.addr;
+    CollPlan *plan = plan_alloc(UGNI_COLL_BCAST);
+
+    assert((uint64_t) buf >= my_memory_handle.addr && offset + length <= recv_buffer_length);
+
+    plan->bcast.plan(this, root, offset, length, bcast_chunk_bytes, bcast_fanout);
+    return plan;
+}
+
+/* Plan an allreduce, with the buffer rules of uGNI_allreduce. */
+CollPlan *Node::uGNI_allreduceInit(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    uint64_t buf_off = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t scratch_off = (uint64_t) scratch - my_memory_handle.addr;
+    CollPlan *plan = plan_alloc(UGNI_COLL_ALLREDUCE);
+
+    assert((uint64_t) buf >= my_memory_handle.addr && buf_off + count * dtype_size(type) <= recv_buffer_length);
+    assert((uint64_t) scratch >= my_memory_handle.addr &&
+	    scratch_off + uGNI_allreduceScratch(count, type) <= recv_buffer_length);
+
+    plan->allreduce.plan(this, buf_off, scratch_off, count, type, op);
+    return plan;
+}
+
+/* Plan a personalized exchange, with the buffer rules of uGNI_alltoallv. */
+CollPlan *Node::uGNI_alltoallvInit(void *sendbuf, const uint64_t *sendcounts, const uint64_t *sdispls,
+	void *recvbuf, const uint64_t *recvcounts, const uint64_t *remote_displs) {
+    CollPlan *plan = plan_alloc(UGNI_COLL_ALLTOALL);
+
+    assert((uint64_t) sendbuf >= send_buffer_addr && (uint64_t) recvbuf >= my_memory_handle.addr);
+
+    plan->alltoall.plan(this, (uint64_t) sendbuf - send_buffer_addr, sendcounts, sdispls,
+	    (uint64_t) recvbuf - my_memory_handle.addr, recvcounts, remote_displs);
+    return plan;
+}
+
+/* Plan an exchange of bytes per peer, as uGNI_alltoall does. */
+CollPlan *Node::uGNI_alltoallInit(void *sendbuf, void *recvbuf, uint64_t bytes) {
+    uint64_t *counts = uniform_counts(this, bytes);
+    uint64_t *displs = counts + world_size;
+    uint64_t *remote_displs = displs + world_size;
+
+    assert((uint64_t) sendbuf + world_size * bytes <= send_buffer_addr + send_buffer_length);
+    assert((uint64_t) recvbuf + world_size * bytes <= my_memory_handle.addr + recv_buffer_length);
+
+    CollPlan *plan = uGNI_alltoallvInit(sendbuf, counts, displs, recvbuf, counts, remote_displs);
+    free(counts);
+
+    return plan;
+}
+
+/*
+ * Wait until no running plan is on the given arrival stream, or when
+ * plan is set, until none writes receive buffer bytes that plan writes.
+ *
+ *   Returns: 0 on success, 3 on timeout.
+ */
+int Node::uGNI_collQuiesce(int stream, CollPlan *plan) {
+    int wait_count = 0;
+
+    for (;;) {
+	CollPlan *p;
+
+	for (p = coll_running; p != NULL; p = p->next) {
+	    if (plan != NULL ? p->overlaps(plan) : p->runStream() == stream)
+		break;
+	}
+	if (p == NULL)
+	    return 0;
+
+	if (uGNI_progress() == 0 && uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i collective ERROR a conflicting plan never finished, retry count: %d\n",
+		    uts_info.nodename, world_rank, wait_count);
+	    return 3;
+	}
+    }
+}
+
+/*
+ * Arrival stream of the collective numbered epoch that holds none of its
+ * own. The numbers agree on all ranks, so the streams do too; a stream
+ * still used by a running plan, which takes UGNI_MAX_STREAMS -
+ * UGNI_STREAMS_HELD one-shot collectives in flight, is waited for.
+ */
+int Node::uGNI_collStream(uint64_t epoch) {
+    int stream = UGNI_STREAMS_HELD + epoch % (UGNI_MAX_STREAMS - UGNI_STREAMS_HELD);
+
+    uGNI_collQuiesce(stream, NULL);
+    return stream;
+}
+
+/*
+ * Begin a run of a plan that is not running. All ranks must start their
+ * plans in the same order. A plan that writes receive buffer bytes a
+ * running plan writes too first waits for that plan to finish, so the
+ * two never overwrite each other's data.
+ *
+ *   Returns: the request that completes with the run, for uGNI_test and
+ *            the uGNI_wait family, which report a failed run through the
+ *            request's error.
+ */
+uGNI_req_t Node::uGNI_start(CollPlan *plan) {
+    assert(plan->req == UGNI_REQ_NULL);
+
+    if (uGNI_collQuiesce(0, plan) != 0) {
+	uGNI_req_t req = requests.alloc(UGNI_REQ_COLL, -1);
+	requests.lookup(req)->error = 3;
+	requests.complete(req);
+	if (plan->oneshot)
+	    uGNI_planFree(plan);
+	return req;
+    }
+
+    if (!plan->oneshot && plan->stream == 0)
+	plan->stream = uGNI_streamAlloc();
+    plan->restart();
+    plan->req = requests.alloc(UGNI_REQ_COLL, -1);
+    plan->next = coll_running;
+    coll_running = plan;
+
+    uGNI_req_t req = plan->req;
+    uGNI_advanceCollectives();
+    return req;
+}
+
+void Node::uGNI_planFree(CollPlan *plan) {
+    if (plan == NULL)
+	return;
+    assert(plan->req == UGNI_REQ_NULL);
+    uGNI_streamFree(plan->stream);
+    plan->finish();
+    free(plan);
+}
+
+/*
+ * Advance every running plan once and complete the requests of those that
+ * finished. Called from uGNI_progress, which the plans themselves may call
+ * while they post; such nested calls return at once.
+ *
+ *   Returns: the number of steps taken.
+ */
+int Node::uGNI_advanceCollectives() {
+    CollPlan **link = &coll_running;
+    int work = 0;
+
+    if (coll_advancing)
+	return 0;
+    coll_advancing = true;
+
+    while (*link != NULL) {
+	CollPlan *plan = *link;
+
+	work += plan->advance();
+	if (!plan->done()) {
+	    link = &plan->next;
+	    continue;
+	}
+
+	*link = plan->next;
+	if (plan->status() != 0)
+	    fprintf(stdout, "[%s] Rank: %4i non-blocking collective ERROR status: %d\n",
+		    uts_info.nodename, world_rank, plan->status());
+	requests.lookup(plan->req)->error = plan->status();
+	requests.complete(plan->req);
+	plan->req = UGNI_REQ_NULL;
+	if (plan->oneshot)
+	    uGNI_planFree(plan);
+	work++;
+    }
+
+    coll_advancing = false;
+    return work;
+}
+
+/*
+ * Non-blocking forms of uGNI_broadcast, uGNI_allreduce and uGNI_alltoall,
+ * with the same buffer rules. The buffers must be left alone until the
+ * returned request completes.
+ */
+uGNI_req_t Node::uGNI_ibroadcast(int root, void *buf, uint64_t length) {
+    CollPlan *plan = uGNI_broadcastInit(root, buf, length);
+    plan->oneshot = true;
+    return uGNI_start(plan);
+}
+
+uGNI_req_t Node::uGNI_iallreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    CollPlan *plan = uGNI_allreduceInit(buf, scratch, count, type, op);
+    plan->oneshot = true;
+    return uGNI_start(plan);
+}
+
+uGNI_req_t Node::uGNI_ialltoall(void *sendbuf, void *recvbuf, uint64_t bytes) {
+    CollPlan *plan = uGNI_alltoallInit(sendbuf, recvbuf, bytes);
+    plan->oneshot = true;
+    return uGNI_start(plan);
+}
@@ -0,0 +1,324 @@
+// Collectives for the node class, built on puts with remote events between
+// the registered buffers. Every rank registers its receive buffer at the
+// same layout, so a collective names its data by an offset into that
+// buffer and the same offset is valid on every peer.
+//
+// A collective is a state machine: start() sets it up, advance() posts
+// whatever has become possible and reaps completions without blocking,
+// and done() tells when it finished. start() is plan(), which does the
+// set-up that depends only on the arguments, followed by restart(), which
+// claims the arrivals of one run, so a persistent CollPlan pays for the
+// set-up once. The blocking Node methods drive one to completion between
+// polls of the CQs; the non-blocking ones leave that to uGNI_progress.
+// Each run counts its arrivals in an arrival stream of its own (see
+// Node::uGNI_stream), so other traffic between the same ranks may flow
+// meanwhile: a persistent plan holds one, any other run takes the one
+// uGNI_collStream gives its collective number.
+
+#ifndef COLLECTIVES_H
+#define COLLECTIVES_H
+
+#include "node.h"
+#include "reduce_kernels.h"
+
+#define UGNI_COLL_MAX_FANOUT 16
+
+/*
+ * Pipelined broadcast down a k-ary tree of ranks rooted at root, in ranks
+ * relative to the root: the parent of r is (r - 1) / k and its children
+ * are k * r + 1 .. k * r + k. With k = 1 the tree is a chain. Each chunk is
+ * forwarded to the children as soon as it lands, so for long messages all
+ * links of the tree are busy at once. A parent puts into its children only
+ * once they have started the same call (see Node::uGNI_collSignal), so a
+ * broadcast never overwrites a buffer a child is still forwarding from.
+ */
+class CollBcast {
+    public:
+	Node *node;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t chunk;
+	int parent;			/* -1 at the root */
+	int num_children;
+	int children[UGNI_COLL_MAX_FANOUT];
+
+	uint64_t num_chunks;
+	int stream;			/* arrival stream of this call */
+	uint64_t *arrived;		/* its counters */
+	uint64_t *expected;
+	uint64_t recv_base;		/* expected[parent] at start */
+	uint64_t epoch;			/* collective number of this call */
+	int ready;			/* children known to have started it */
+	uint64_t forwarded;		/* chunks passed on to every child */
+	uGNI_req_t *send_reqs;		/* in post order */
+	uint64_t sends_posted;
+	uint64_t sends_done;
+	uint64_t max_inflight;
+	int rc;
+
+    public:
+	void plan(Node *node, int root, uint64_t offset, uint64_t length, uint64_t chunk, int fanout,
+		const int *ranks = NULL, int size = 0);
+	void restart(int held = 0);
+	void start(Node *node, int root, uint64_t offset, uint64_t length, uint64_t chunk, int fanout,
+		const int *ranks = NULL, int size = 0);
+	int advance();
+	bool done();
+	void finish();
+};
+
+/*
+ * Allreduce in place. Long vectors take a ring: n - 1 reduce-scatter steps
+ * into the right neighbour's scratch, then n - 1 allgather steps straight
+ * into its buffer. Every segment moves in chunks, and a chunk is reduced
+ * and passed on as soon as it lands, so the reduction of one chunk runs
+ * while the next is on the wire. Short vectors take recursive doubling,
+ * with the ranks beyond the largest power of two folded into a partner
+ * first and sent the result last.
+ *
+ * Scratch holds one slot per step. A rank puts into a partner, the right
+ * neighbour of the ring or the partner of a fold or doubling step, only
+ * once the partner has started the same call (see Node::uGNI_collSignal),
+ * so a partner that already started the next one never overwrites a slot
+ * still to be reduced.
+ */
+enum {
+    UGNI_ALLREDUCE_RING = 0,
+    UGNI_ALLREDUCE_RD
+};
+
+class CollAllreduce {
+    public:
+	Node *node;
+	const int *ranks;		/* the group, NULL for all ranks */
+	uint64_t buf_off;
+	uint64_t scratch_off;
+	uint64_t count;
+	uint64_t esize;
+	uGNI_dtype_t type;
+	uGNI_op_t op;
+	int algorithm;
+	int n;				/* group size */
+	int r;				/* our index in the group */
+	uint64_t epoch;			/* collective number of this call */
+	int stream;			/* arrival stream of this call */
+	uint64_t *arrived;		/* its counters */
+	uint64_t *expected;
+	int rc;
+
+	// Puts in post order, at most max_inflight outstanding.
+	uGNI_req_t *send_reqs;
+	uint64_t sends_posted;
+	uint64_t sends_done;
+	uint64_t max_inflight;
+
+	// Ring.
+	int left;
+	int right;
+	uint64_t chunk_elems;
+	uint64_t slot_bytes;
+	uint64_t ring_arrivals;		/* chunks expected from left per run */
+	uint64_t recv_base;
+	uint64_t consumed;		/* arrivals from left handled */
+	uint64_t initial_posted;	/* chunks of the first step posted */
+	bool right_ready;		/* right has started this call */
+	int phase;			/* 0 reduce-scatter, 1 allgather, 2 done */
+	int step;
+	uint64_t piece;
+
+	// Recursive doubling.
+	int pof2;
+	int rem;
+	int newrank;			/* -1 for a rank folded into its partner */
+	int steps;
+	int state;
+	bool posted;
+	uGNI_req_t step_req;
+	uint64_t targets[34];		/* arrival count expected of each step's partner */
+
+    public:
+	static int choose(Node *node, int n, uint64_t count, uGNI_dtype_t type);
+	static uint64_t scratchBytes(Node *node, int n, uint64_t count, uGNI_dtype_t type);
+	void plan(Node *node, uint64_t buf_off, uint64_t scratch_off, uint64_t count, uGNI_dtype_t type, uGNI_op_t op,
+		const int *ranks = NULL, int size = 0);
+	void restart(int held = 0);
+	void start(Node *node, uint64_t buf_off, uint64_t scratch_off, uint64_t count, uGNI_dtype_t type, uGNI_op_t op,
+		const int *ranks = NULL, int size = 0);
+	int advance();
+	bool done();
+	void finish();
+
+    private:
+	uint64_t segBegin(int seg);
+	uint64_t pieces(int seg);
+	bool post(int peer, uint64_t local_off, uint64_t remote_off, uint64_t bytes);
+	bool ready(int peer);
+	void reap();
+	int advanceRing();
+	int advanceRd();
+	int rdPeer(int vrank);
+};
+
+/*
+ * Reduce to root up a fanout-ary tree of the same shape as the broadcast
+ * tree. Every child puts its vector, chunk by chunk, into a scratch slot
+ * of its own at the parent; the parent adds a chunk in once every child's
+ * copy of it has landed and passes the partial result up, so the levels
+ * of the tree work on different chunks at once. buf is left holding
+ * partial results on every rank but the root. A child puts into its slot
+ * only once the parent has started the same call (see
+ * Node::uGNI_collSignal), by which time the parent has combined whatever
+ * the previous call left there.
+ */
+class CollReduce {
+    public:
+	Node *node;
+	uint64_t buf_off;
+	uint64_t scratch_off;
+	uint64_t count;
+	uint64_t esize;
+	uGNI_dtype_t type;
+	uGNI_op_t op;
+	uint64_t chunk_elems;
+	uint64_t slot_bytes;
+	int parent;			/* -1 at the root */
+	int slot;			/* ours at the parent */
+	int num_children;
+	int children[UGNI_COLL_MAX_FANOUT];
+	int stream;			/* arrival stream of this call */
+	uint64_t *arrived;		/* its counters */
+	uint64_t recv_base[UGNI_COLL_MAX_FANOUT];
+	uint64_t epoch;			/* collective number of this call */
+	bool parent_ready;		/* the parent has started it */
+	int rc;
+
+	uint64_t num_chunks;
+	uint64_t reduced;		/* chunks combined with every child's */
+	uGNI_req_t *send_reqs;		/* in post order */
+	uint64_t sends_posted;
+	uint64_t sends_done;
+	uint64_t max_inflight;
+
+    public:
+	static uint64_t scratchBytes(int n, uint64_t count, uGNI_dtype_t type, int fanout);
+	void start(Node *node, int root, uint64_t buf_off, uint64_t scratch_off, uint64_t count, uGNI_dtype_t type,
+		uGNI_op_t op, int fanout, const int *ranks = NULL, int size = 0);
+	int advance();
+	bool done();
+	void finish();
+};
+
+/*
+ * Personalized all-to-all. Block p of this rank goes to peer p, in chunks
+ * of at most chunk bytes, visiting the peers in the node's topology order
+ * (see Node::uGNI_topoOrder). At most window peers are served at a time,
+ * each with at most per_peer chunks in flight, so no single link or
+ * endpoint gets flooded. The receiver counts the chunks it expects from
+ * every peer. A rank puts into a peer only once the peer has started the
+ * same call (see Node::uGNI_collSignal), so an exchange never overwrites
+ * a block the peer has not returned from the previous one yet.
+ */
+class CollAlltoall {
+    public:
+	Node *node;
+	uint64_t send_off;		/* into the send buffer */
+	uint64_t recv_off;		/* into the receive buffer */
+	uint64_t *sendcounts;		/* copies of the caller's arrays */
+	uint64_t *sdispls;
+	uint64_t *remote_displs;
+	uint64_t *recvcounts;
+	uint64_t chunk;
+	int window;
+	int per_peer;
+	int rc;
+
+	int stream;			/* arrival stream of this call */
+	uint64_t *arrived;		/* its counters */
+	uint64_t *recv_targets;		/* arrival count that completes each peer */
+	uint64_t *posted_to;		/* bytes of each peer's block posted */
+	int *inflight_to;
+	int cursor;			/* first peer in topology order not fully posted */
+	int recv_cursor;		/* first peer whose block has not fully arrived */
+	uint64_t epoch;			/* collective number of this call */
+	int signaled;			/* peers in topology order told we started it */
+
+	uGNI_req_t *reqs;		/* outstanding puts and ready writes, packed */
+	int *req_peer;			/* -1 for ready writes */
+	int outstanding;
+	int max_inflight;
+
+    public:
+	void plan(Node *node, uint64_t send_off, const uint64_t *sendcounts, const uint64_t *sdispls,
+		uint64_t recv_off, const uint64_t *recvcounts, const uint64_t *remote_displs);
+	void restart(int held = 0);
+	void start(Node *node, uint64_t send_off, const uint64_t *sendcounts, const uint64_t *sdispls,
+		uint64_t recv_off, const uint64_t *recvcounts, const uint64_t *remote_displs);
+	int advance();
+	bool done();
+	void finish();
+};
+
+/*
+ * A collective set up once and run any number of times without blocking.
+ * Each run, begun by Node::uGNI_start, completes a request of its own;
+ * uGNI_progress advances every running plan, so any poll or wait moves
+ * it along. Plans may run at the same time between the same ranks, each
+ * on its own arrival stream; one that would write receive buffer bytes a
+ * running plan writes too waits for that plan to finish.
+ */
+enum {
+    UGNI_COLL_BCAST = 0,
+    UGNI_COLL_ALLREDUCE,
+    UGNI_COLL_ALLTOALL
+};
+
+class CollPlan {
+    public:
+	int kind;
+	bool oneshot;			/* freed when its run completes */
+	int stream;			/* held from the first start, 0 for a one-shot */
+	uGNI_req_t req;			/* of the run in progress, UGNI_REQ_NULL when idle */
+	CollPlan *next;			/* in the node's list of running plans */
+	CollBcast bcast;
+	CollAllreduce allreduce;
+	CollAlltoall alltoall;
+
+    public:
+	void restart();
+	int advance();
+	bool done();
+	int status();
+	int runStream();
+	bool overlaps(CollPlan *other);
+	void finish();
+
+    private:
+	int recvRanges(uint64_t *lo, uint64_t *hi);
+};
+
+/*
+ * Drive a collective to completion, polling between steps and backing off
+ * by the source CQ's wait policy when nothing moves.
+ *
+ *   Returns: 0 on success, 3 if the collective stalled.
+ */
+template <class Coll>
+static int coll_wait(Node *node, Coll *coll) {
+    int wait_count = 0;
+
+    while (!coll->done()) {
+	int work = node->uGNI_progress() + coll->advance();
+	if (work > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+	if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i collective ERROR no progress, retry count: %d\n",
+		    node->uts_info.nodename, node->world_rank, wait_count);
+	    return 3;
+	}
+    }
+    return 0;
+}
+
+#endif
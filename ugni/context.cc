@@ -0,0 +1,397 @@
+// Per-thread communication contexts for the node class
+
+#include "context.h"
+
+/*
+ * Create the context of one worker thread: a CDM instance of its own
+ * attached to the NIC, a source and a destination CQ, and endpoints to
+ * the context with the same thread_id on every peer, bound on first use.
+ * Only reads shared Node state, so every thread may create its own context
+ * concurrently once uGNI_createAndBindEndpoints has run.
+ *
+ *   Returns: the context, or NULL if thread_id already has one.
+ */
+ThreadContext *Node::uGNI_createThreadContext(int thread_id, int number_of_cq_entries, int number_of_dest_cq_entries) {
+    unsigned int    local_address;
+    gni_return_t    status;
+    int             rc;
+
+    assert(thread_id >= 0 && thread_id < UGNI_MAX_THREAD_CONTEXTS);
+
+    // Also catches a worker colliding with a channel, see uGNI_createChannels.
+    if (thread_contexts[thread_id] != NULL) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i uGNI_createThreadContext ERROR thread id already in use\n", uts_info.nodename, world_rank, thread_id);
+	return NULL;
+    }
+
+    ThreadContext *ctx = new ThreadContext;
+    ctx->node = this;
+    ctx->thread_id = thread_id;
+    ctx->inst_id = UGNI_CONTEXT_INST_ID(thread_id, world_rank, world_size);
+    ctx->destination_cq_handle = NULL;
+    ctx->remote_memory_handle_array = NULL;
+    ctx->send_buffer_addr = 0;
+    ctx->bytes_put = 0;
+    ctx->put_usec = 0;
+    ctx->stripes = 0;
+
+    // Start out with the rank's source CQ policy; the thread may change it.
+    memset(&ctx->wait, 0, sizeof(ctx->wait));
+    ctx->uGNI_setWaitPolicy(cq_wait[1].policy, cq_wait[1].spin_limit);
+
+    status = GNI_CdmCreate(ctx->inst_id, ptag, cookie, modes, &ctx->cdm_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CdmCreate ERROR status: %d\n", uts_info.nodename, world_rank, thread_id, status);
+    }
+
+    status = GNI_CdmAttach(ctx->cdm_handle, device_id, &local_address, &ctx->nic_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CdmAttach     ERROR status: %d\n", uts_info.nodename, world_rank, thread_id, status);
+    }
+
+    status = GNI_CqCreate(ctx->nic_handle, number_of_cq_entries, 0, GNI_CQ_NOBLOCK, NULL, NULL, &ctx->cq_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CqCreate source ERROR status: %d\n", uts_info.nodename, world_rank, thread_id, status);
+    }
+
+    status = GNI_CqCreate(ctx->nic_handle, number_of_dest_cq_entries, 0, GNI_CQ_NOBLOCK, NULL, NULL, &ctx->destination_cq_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CqCreate      destination ERROR status: %d\n", uts_info.nodename, world_rank, thread_id, status);
+    }
+
+    // Counters are touched on every event, keep them off other threads' lines.
+    rc = posix_memalign((void **) &ctx->send_completed, CACHELINE_SIZE, 5 * world_size * sizeof(uint64_t));
+    assert(rc == 0);
+    memset(ctx->send_completed, 0, 5 * world_size * sizeof(uint64_t));
+    ctx->send_expected = ctx->send_completed + world_size;
+    ctx->recv_arrived = ctx->send_expected + world_size;
+    ctx->recv_expected = ctx->recv_arrived + world_size;
+    ctx->send_failed = ctx->recv_expected + world_size;
+
+    ctx->num_descs = number_of_cq_entries;
+    ctx->next_desc = 0;
+    ctx->descs = (gni_post_descriptor_t *) calloc(number_of_cq_entries, sizeof(gni_post_descriptor_t));
+    assert(ctx->descs != NULL);
+
+    // Bound on first use, see ThreadContext::uGNI_getEndpoint.
+    ctx->endpoint_handles_array = (gni_ep_handle_t *) calloc(world_size, sizeof(gni_ep_handle_t));
+    assert(ctx->endpoint_handles_array != NULL);
+
+    thread_contexts[thread_id] = ctx;
+    return ctx;
+}
+
+/*
+ * Register this context's buffers with its NIC handle and exchange the
+ * receive buffer handle with the same context on every rank. This is a PMI
+ * collective: call it from one thread at a time, in the same order on
+ * every rank.
+ */
+void ThreadContext::uGNI_regAndExchangeMem(void *send_buf, int send_length, void *recv_buf, int recv_length) {
+    struct {
+	int rank;	/* must come first, see allgather() */
+	mdh_addr_t handle;
+    } my_record, *records;
+
+    remote_memory_handle_array = (mdh_addr_t *) calloc(node->world_size, sizeof(mdh_addr_t));
+    assert(remote_memory_handle_array);
+
+    gni_return_t status = GNI_MemRegister(nic_handle, (uint64_t)send_buf, send_length, NULL,
+	    GNI_MEM_READWRITE, -1, &send_mem_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_MemRegister  send_buffer ERROR status: %d\n",
+		node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    status = GNI_MemRegister(nic_handle, (uint64_t)recv_buf, recv_length, destination_cq_handle,
+	    GNI_MEM_READWRITE, -1, &recv_mem_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_MemRegister   receive_buffer ERROR status: %d\n",
+		node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    send_buffer_addr = (uint64_t)send_buf;
+    memset(&my_record, 0, sizeof(my_record));
+    my_record.rank = node->world_rank;
+    my_record.handle.addr = (uint64_t)recv_buf;
+    my_record.handle.mdh = recv_mem_handle;
+
+    records = (decltype(records)) malloc(node->world_size * sizeof(my_record));
+    assert(records != NULL);
+    allgather(&my_record, records, sizeof(my_record));
+    for (int i = 0; i < node->world_size; i++)
+	remote_memory_handle_array[i] = records[i].handle;
+    free(records);
+}
+
+/*
+ * Put length bytes from this context's send buffer into the peer context's
+ * receive buffer. Descriptors are recycled round robin; if the next one is
+ * still in flight the CQs are drained until it comes back. The descriptor
+ * is stored in *posted when given: its post_id drops to 0 when the put
+ * completes, and its status then tells how.
+ *
+ *   Returns: 0 on success, 1 if the post failed.
+ */
+int ThreadContext::uGNI_put(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length,
+	gni_post_descriptor_t **posted) {
+    gni_post_descriptor_t *desc = &descs[next_desc];
+    int wait_count = 0;
+
+    while (desc->post_id != 0) {
+	if (uGNI_progress() == 0 && ++wait_count >= MAXIMUM_CQ_RETRY_COUNT) {
+	    fprintf(stderr, "[%s] Rank: %4i Thread: %2i no descriptor came back\n", node->uts_info.nodename, node->world_rank, thread_id);
+	    return 1;
+	}
+    }
+    next_desc = (next_desc + 1) % num_descs;
+
+    desc->type = GNI_POST_RDMA_PUT;
+    desc->cq_mode = GNI_CQMODE_GLOBAL_EVENT | GNI_CQMODE_REMOTE_EVENT;
+    desc->dlvr_mode = node->uGNI_dlvrMode(dest_rankId, length);
+    desc->local_addr = send_buffer_addr + local_offset;
+    desc->local_mem_hndl = send_mem_handle;
+    desc->remote_addr = remote_memory_handle_array[dest_rankId].addr + remote_offset;
+    desc->remote_mem_hndl = remote_memory_handle_array[dest_rankId].mdh;
+    desc->length = length;
+    desc->rdma_mode = GNI_RDMAMODE_FENCE;
+    desc->src_cq_hndl = cq_handle;
+    desc->post_id = 1;
+
+    gni_return_t status = GNI_PostRdma(uGNI_getEndpoint(dest_rankId), desc);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_PostRdma data ERROR status: %d\n", node->uts_info.nodename, node->world_rank, thread_id, status);
+	postRdmaStatus(status);
+	desc->post_id = 0;
+	return 1;
+    }
+
+    if (posted != NULL)
+	*posted = desc;
+    return 0;
+}
+
+/*
+ * Endpoint to context thread_id of a peer, created and bound on first use.
+ */
+gni_ep_handle_t ThreadContext::uGNI_getEndpoint(int rank) {
+    gni_return_t status;
+    gni_ep_handle_t ep;
+
+    if (endpoint_handles_array[rank] != NULL)
+	return endpoint_handles_array[rank];
+
+    status = GNI_EpCreate(nic_handle, cq_handle, &ep);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_EpCreate ERROR status: %d\n", node->uts_info.nodename, node->world_rank, thread_id, status);
+	return NULL;
+    }
+
+    status = GNI_EpBind(ep, node->uGNI_nicAddress(rank), UGNI_CONTEXT_INST_ID(thread_id, rank, node->world_size));
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_EpBind ERROR status: %d\n", node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    status = GNI_EpSetEventData(ep, rank, node->world_rank);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_EpSetEventData ERROR status: %d\n", node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    endpoint_handles_array[rank] = ep;
+    return ep;
+}
+
+void ThreadContext::uGNI_setWaitPolicy(uGNI_wait_policy_t policy, int spin_limit) {
+    wait.policy = policy;
+    wait.spin_limit = spin_limit;
+    wait.max_polls = (policy == UGNI_WAIT_SPIN) ? 100 * MAXIMUM_CQ_RETRY_COUNT : MAXIMUM_CQ_RETRY_COUNT;
+}
+
+/*
+ * Poll one CQ of the context once. Unlike Node::uGNI_get_cq_event this
+ * touches no Node state, so worker threads may call it concurrently.
+ *
+ *   Returns: 0 if event holds the next event
+ *            1 if the queue reported an error, 2 on an overrun
+ *            3 if no event is pending
+ */
+static int context_get_event(ThreadContext *ctx, gni_cq_handle_t cq, gni_cq_entry_t *event) {
+    gni_return_t status = GNI_CqGetEvent(cq, event);
+
+    if (status == GNI_RC_SUCCESS)
+	return 0;
+    if (status == GNI_RC_NOT_DONE)
+	return 3;
+
+    fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CqGetEvent    ERROR %sstatus: %d event: 0x%16.16lx\n",
+	    ctx->node->uts_info.nodename, ctx->node->world_rank, ctx->thread_id,
+	    GNI_CQ_OVERRUN(*event) ? "CQ_OVERRUN detected " : "", status, *event);
+    return GNI_CQ_OVERRUN(*event) ? 2 : 1;
+}
+
+/*
+ * Drain both CQs of this context without blocking. A post whose event
+ * reports an error is counted in send_failed, for the next send wait on
+ * its peer to report.
+ *
+ *   Returns: the number of events processed.
+ */
+int ThreadContext::uGNI_progress() {
+    gni_cq_entry_t  event;
+    gni_post_descriptor_t *desc;
+    unsigned int    event_id;
+    int             processed = 0;
+    int             rc;
+
+    // An error event still names its post; fail it and keep draining.
+    while ((rc = context_get_event(this, cq_handle, &event)) == 0 || rc == 1) {
+	desc = NULL;
+	gni_return_t status = GNI_GetCompleted(cq_handle, event, &desc);
+	if (status == GNI_RC_SUCCESS && !GNI_CQ_STATUS_OK(event))
+	    status = GNI_RC_TRANSACTION_ERROR;
+	if (status != GNI_RC_SUCCESS) {
+	    fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_GetCompleted  data ERROR status: %d\n", node->uts_info.nodename, node->world_rank, thread_id, status);
+	}
+	if (desc != NULL) {
+	    desc->status = status;
+	    desc->post_id = 0;
+	}
+
+	event_id = GNI_CQ_GET_INST_ID(event);
+	if (event_id < (unsigned int) node->world_size) {
+	    if (status != GNI_RC_SUCCESS)
+		send_failed[event_id]++;
+	    else
+		send_completed[event_id]++;
+	}
+	processed++;
+    }
+
+    // A destination error event carries no arrival we can trust; drop it.
+    while ((rc = context_get_event(this, destination_cq_handle, &event)) == 0 || rc == 1) {
+	event_id = GNI_CQ_GET_INST_ID(event);
+	if (rc == 0 && event_id < (unsigned int) node->world_size)
+	    recv_arrived[event_id]++;
+	processed++;
+    }
+
+    return processed;
+}
+
+/*
+ * Poll until *done, plus *failed when given, reaches *expected, spending
+ * the time between polls as the context's wait policy says, see
+ * Node::uGNI_cqIdle.
+ */
+static int context_wait(ThreadContext *ctx, uint64_t *done, uint64_t *failed, uint64_t *expected) {
+    cq_wait_t *w = &ctx->wait;
+    int wait_count = 0;
+
+    while (*done + (failed != NULL ? *failed : 0) < *expected) {
+	if (ctx->uGNI_progress() > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+
+	if (++wait_count >= w->max_polls) {
+	    w->timeouts++;
+	    fprintf(stderr, "[%s] Rank: %4i Thread: %2i uGNI_wait         ERROR no event was received retry count: %d\n",
+		    ctx->node->uts_info.nodename, ctx->node->world_rank, ctx->thread_id, wait_count);
+	    *expected = *done + (failed != NULL ? *failed : 0);
+	    return 3;
+	}
+
+	if (wait_count <= w->spin_limit || w->policy == UGNI_WAIT_SPIN) {
+	    w->spins++;
+	} else if ((wait_count % (MAXIMUM_CQ_RETRY_COUNT / 10)) == 0) {
+	    w->sleeps++;
+	    usleep(50);
+	} else {
+	    w->yields++;
+	    sched_yield();
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for num_req more posts to the peer to complete. Failed posts count
+ * as done, so the wait ends, and are reported once by it.
+ *
+ *   Returns: 0 on success, 1 if a post to the peer failed, 3 on timeout.
+ */
+int ThreadContext::uGNI_waitAllSendDone(int dest_rankId, int num_req) {
+    send_expected[dest_rankId] += num_req;
+    int rc = context_wait(this, &send_completed[dest_rankId], &send_failed[dest_rankId], &send_expected[dest_rankId]);
+
+    if (rc == 0 && send_failed[dest_rankId] != 0) {
+	send_completed[dest_rankId] += send_failed[dest_rankId];
+	send_failed[dest_rankId] = 0;
+	return 1;
+    }
+    return rc;
+}
+
+int ThreadContext::uGNI_waitAllRecvDone(int source_rankId, int num_req) {
+    recv_expected[source_rankId] += num_req;
+    return context_wait(this, &recv_arrived[source_rankId], NULL, &recv_expected[source_rankId]);
+}
+
+/*
+ * Tear the context down. Outstanding events must have been waited for,
+ * otherwise the endpoints can not be unbound.
+ */
+void ThreadContext::uGNI_destroy() {
+    gni_return_t status;
+    int i;
+
+    for (i = 0; i < node->world_size; i++) {
+	if (endpoint_handles_array[i] == 0)
+	    continue;
+
+	status = GNI_EpUnbind(endpoint_handles_array[i]);
+	if (status != GNI_RC_SUCCESS) {
+	    fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_EpUnbind      ERROR remote rank: %4i status: %d\n",
+		    node->uts_info.nodename, node->world_rank, thread_id, i, status);
+	    continue;
+	}
+
+	status = GNI_EpDestroy(endpoint_handles_array[i]);
+	if (status != GNI_RC_SUCCESS) {
+	    fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_EpDestroy     ERROR remote rank: %4i status: %d\n",
+		    node->uts_info.nodename, node->world_rank, thread_id, i, status);
+	}
+    }
+
+    if (remote_memory_handle_array != NULL) {
+	GNI_MemDeregister(nic_handle, &recv_mem_handle);
+	GNI_MemDeregister(nic_handle, &send_mem_handle);
+	free(remote_memory_handle_array);
+    }
+
+    status = GNI_CqDestroy(destination_cq_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CqDestroy     destination ERROR status: %d\n",
+		node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    status = GNI_CqDestroy(cq_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CqDestroy     source ERROR status: %d\n",
+		node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    status = GNI_CdmDestroy(cdm_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i Thread: %2i GNI_CdmDestroy    ERROR status: %d\n",
+		node->uts_info.nodename, node->world_rank, thread_id, status);
+    }
+
+    node->thread_contexts[thread_id] = NULL;
+
+    free(endpoint_handles_array);
+    free(send_completed);
+    free(descs);
+    delete this;
+}
@@ -0,0 +1,66 @@
+// Per-thread communication contexts for the node class. Each worker thread
+// drives its own communication domain, NIC attachment, CQs and endpoints,
+// so threads inject in parallel without sharing any mutable state.
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "node.h"
+
+/*
+ * Context number t of a rank uses the CDM instance id
+ * (t + 1) * world_size + world_rank and talks to context t of every peer.
+ * Instance ids 0 .. world_size - 1 stay with the Node's own CDM.
+ */
+#define UGNI_CONTEXT_INST_ID(thread_id, rank, world_size) \
+	((uint32_t) (((thread_id) + 1) * (world_size) + (rank)))
+
+class alignas(CACHELINE_SIZE) ThreadContext {
+    public:
+	Node *node;		/* read-only: ranks, NIC addresses, uts_info */
+	int thread_id;
+	uint32_t inst_id;
+	gni_cdm_handle_t cdm_handle;
+	gni_nic_handle_t nic_handle;
+	gni_cq_handle_t cq_handle;
+	gni_cq_handle_t destination_cq_handle;
+	gni_ep_handle_t *endpoint_handles_array;
+	gni_mem_handle_t send_mem_handle;
+	gni_mem_handle_t recv_mem_handle;
+	uint64_t send_buffer_addr;
+	mdh_addr_t *remote_memory_handle_array;
+
+	// Per-peer event counters, private to the owning thread.
+	uint64_t *send_completed;
+	uint64_t *send_expected;
+	uint64_t *recv_arrived;
+	uint64_t *recv_expected;
+	uint64_t *send_failed;	/* failed posts no send wait has reported yet */
+
+	// Wait policy of this context's CQs. They are created non-blocking,
+	// so UGNI_WAIT_SPIN_BLOCK yields like UGNI_WAIT_SPIN_YIELD.
+	cq_wait_t wait;
+
+	// Descriptors of posts in flight, reused round robin.
+	gni_post_descriptor_t *descs;
+	int num_descs;
+	int next_desc;
+
+	// Striped put statistics when the context serves as a channel.
+	uint64_t bytes_put;
+	uint64_t put_usec;
+	uint64_t stripes;
+
+    public:
+	void uGNI_regAndExchangeMem(void *, int, void *, int);
+	gni_ep_handle_t uGNI_getEndpoint(int rank);
+	int uGNI_put(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length,
+		gni_post_descriptor_t **posted = NULL);
+	int uGNI_progress();
+	void uGNI_setWaitPolicy(uGNI_wait_policy_t policy, int spin_limit);
+	int uGNI_waitAllSendDone(int dest_rankId, int num_req);
+	int uGNI_waitAllRecvDone(int source_rankId, int num_req);
+	void uGNI_destroy();
+};
+
+#endif
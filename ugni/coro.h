@@ -0,0 +1,243 @@
+// C++20 coroutine front end for the node class. Puts, gets and receive
+// signals are awaitable, and a small scheduler resumes each coroutine when
+// the CQ event it waits for arrives, so multi-stage protocols read as
+// straight-line code while many transfers stay in flight.
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <vector>
+#include <deque>
+
+#include "node.h"
+
+class Scheduler;
+
+/*
+ * A coroutine run by the scheduler. It starts suspended; spawn it on a
+ * scheduler, or co_await it from another Task to run it as a sub-protocol.
+ */
+class Task {
+    public:
+	struct promise_type {
+	    std::coroutine_handle<> continuation;
+
+	    Task get_return_object() {
+		return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+	    }
+
+	    std::suspend_always initial_suspend() noexcept { return {}; }
+
+	    // Hand control straight back to an awaiting Task, if there is one.
+	    struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+		    if (h.promise().continuation)
+			return h.promise().continuation;
+		    return std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	    };
+
+	    FinalAwaiter final_suspend() noexcept { return {}; }
+	    void return_void() {}
+	    void unhandled_exception() { abort(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+    public:
+	explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	Task(Task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	Task(const Task &) = delete;
+	~Task() {
+	    if (handle)
+		handle.destroy();
+	}
+
+	bool await_ready() { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+	    handle.promise().continuation = awaiting;
+	    return handle;
+	}
+	void await_resume() {}
+};
+
+/*
+ * An operation already posted to the NIC. Creating it starts the transfer;
+ * co_await only parks the coroutine until the request completes, so a
+ * coroutine may start several before awaiting any of them. An Op dropped
+ * without being awaited hands its request back to the node.
+ *
+ *   co_await yields 0 on success, 1 if the transfer failed, 3 on timeout.
+ */
+class Op {
+    public:
+	Scheduler *sched;
+	uGNI_req_t req;
+	int status;
+
+    public:
+	Op(Scheduler *s, uGNI_req_t r) : sched(s), req(r), status(r == UGNI_REQ_NULL ? 1 : 0) {}
+	Op(Op &&other) noexcept : sched(other.sched), req(other.req), status(other.status) { other.req = UGNI_REQ_NULL; }
+	Op(const Op &) = delete;
+	~Op();
+
+	// Awaiting goes through a handle on the Op, so it is never copied.
+	struct Awaiter {
+	    Op *op;
+
+	    bool await_ready() { return op->ready(); }
+	    void await_suspend(std::coroutine_handle<> h);
+	    int await_resume() { return op->status; }
+	};
+
+	Awaiter operator co_await() { return Awaiter{this}; }
+	bool ready();
+};
+
+class Scheduler {
+    public:
+	typedef struct {
+	    Op *op;
+	    std::coroutine_handle<> handle;
+	} parked_t;
+
+	Node *node;
+	std::deque<std::coroutine_handle<> > ready;
+	std::vector<parked_t> parked;
+	std::vector<std::coroutine_handle<Task::promise_type> > spawned;
+
+    public:
+	Scheduler(Node *n) : node(n) {}
+
+	~Scheduler() {
+	    for (size_t i = 0; i < spawned.size(); i++)
+		spawned[i].destroy();
+	}
+
+	Op put(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length) {
+	    return Op(this, node->uGNI_put(dest_rankId, local_offset, remote_offset, length));
+	}
+
+	Op get(int src_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length) {
+	    return Op(this, node->uGNI_get(src_rankId, local_offset, remote_offset, length));
+	}
+
+	// Completes once num_events more destination events from the peer arrived.
+	Op recv_signal(int source_rankId, int num_events = 1) {
+	    return Op(this, node->uGNI_irecv(source_rankId, num_events));
+	}
+
+	// Take ownership of a task; it starts running on the next run().
+	void spawn(Task &&task) {
+	    std::coroutine_handle<Task::promise_type> h = task.handle;
+	    task.handle = nullptr;
+	    spawned.push_back(h);
+	    ready.push_back(h);
+	}
+
+	void park(Op *op, std::coroutine_handle<> h) {
+	    parked_t p;
+	    p.op = op;
+	    p.handle = h;
+	    parked.push_back(p);
+	}
+
+	/*
+	 * Run until every spawned task has finished. Between rounds of ready
+	 * coroutines the CQs are polled once and the coroutines whose
+	 * requests completed are made ready again.
+	 *
+	 *   Returns: 0 when all tasks finished, 3 if the CQs stayed silent
+	 *            for the whole retry budget while tasks were waiting.
+	 */
+	int run() {
+	    int wait_count = 0;
+	    int rc = 0;
+
+	    for (;;) {
+		while (!ready.empty()) {
+		    std::coroutine_handle<> h = ready.front();
+		    ready.pop_front();
+		    h.resume();
+		}
+
+		if (parked.empty())
+		    break;
+
+		int events = node->uGNI_progress();
+
+		size_t kept = 0;
+		for (size_t i = 0; i < parked.size(); i++) {
+		    if (node->uGNI_done(parked[i].op->req)) {
+			int error = 0;
+			node->uGNI_test(&parked[i].op->req, &error);
+			if (error != 0)
+			    parked[i].op->status = 1;
+			ready.push_back(parked[i].handle);
+		    } else {
+			parked[kept++] = parked[i];
+		    }
+		}
+		parked.resize(kept);
+
+		if (events > 0 || !ready.empty()) {
+		    wait_count = 0;
+		} else if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+		    // Give up on the stuck operations rather than hang.
+		    for (size_t i = 0; i < parked.size(); i++) {
+			parked[i].op->status = 3;
+			ready.push_back(parked[i].handle);
+		    }
+		    parked.clear();
+		    wait_count = 0;
+		    rc = 3;
+		}
+	    }
+
+	    for (size_t i = 0; i < spawned.size(); i++)
+		spawned[i].destroy();
+	    spawned.clear();
+
+	    return rc;
+	}
+};
+
+/*
+ * A send still in flight can not give its request back yet, as the NIC
+ * holds its descriptor: it becomes internal and is released when it
+ * completes. Anything else is released right away.
+ */
+inline Op::~Op() {
+    if (req == UGNI_REQ_NULL)
+	return;
+
+    RequestTable &requests = sched->node->requests;
+    uGNI_req_entry_t *e = requests.lookup(req);
+    if (e == NULL)
+	return;
+    if (e->type == UGNI_REQ_SEND && !requests.isComplete(req))
+	e->internal = 1;
+    else
+	requests.release(req);
+}
+
+inline bool Op::ready() {
+    int error = 0;
+
+    if (status != 0)
+	return true;
+    if (!sched->node->uGNI_test(&req, &error))
+	return false;
+    if (error != 0)
+	status = 1;
+    return true;
+}
+
+inline void Op::Awaiter::await_suspend(std::coroutine_handle<> h) {
+    op->sched->park(op, h);
+}
+
+#endif
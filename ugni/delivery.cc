@@ -0,0 +1,107 @@
+// Delivery mode policy for the node class. Every post through the node
+// takes the delivery (routing) mode of its destination, so the mode can be
+// changed per peer, or for all peers through UGNI_DLVR_MODE, without
+// touching the code that builds the descriptors.
+
+#include "node.h"
+
+static const struct {
+    const char *name;
+    uint16_t    mode;
+} dlvr_names[] = {
+    { "performance", GNI_DLVMODE_PERFORMANCE },
+    { "no_adapt",    GNI_DLVMODE_NO_ADAPT },
+    { "no_hash",     GNI_DLVMODE_NO_HASH },
+    { "no_radapt",   GNI_DLVMODE_NO_RADAPT },
+    { "in_order",    GNI_DLVMODE_IN_ORDER },
+    { "auto",        UGNI_DLVR_AUTO },
+};
+
+static const char *dlvr_name(uint16_t mode) {
+    for (size_t i = 0; i < sizeof(dlvr_names) / sizeof(dlvr_names[0]); i++) {
+	if (dlvr_names[i].mode == mode)
+	    return dlvr_names[i].name;
+    }
+    return "?";
+}
+
+/*
+ * Allocate the per-peer policy, all GNI_DLVMODE_PERFORMANCE unless the
+ * UGNI_DLVR_MODE environment variable names another mode. Called from
+ * uGNI_init once world_size is known.
+ */
+void Node::uGNI_initDelivery() {
+    uint16_t mode = GNI_DLVMODE_PERFORMANCE;
+    const char *env = getenv("UGNI_DLVR_MODE");
+    int i;
+
+    if (env != NULL) {
+	for (i = 0; i < (int) (sizeof(dlvr_names) / sizeof(dlvr_names[0])); i++) {
+	    if (strcasecmp(env, dlvr_names[i].name) == 0)
+		break;
+	}
+	if (i < (int) (sizeof(dlvr_names) / sizeof(dlvr_names[0])))
+	    mode = dlvr_names[i].mode;
+	else
+	    fprintf(stdout, "[%s] Rank: %4i unknown UGNI_DLVR_MODE %s, using performance\n", uts_info.nodename, world_rank, env);
+    }
+
+    peer_dlvr = (uint16_t *) malloc(world_size * sizeof(uint16_t));
+    assert(peer_dlvr != NULL);
+    lat_ewma_ns = (uint64_t *) calloc(world_size, sizeof(uint64_t));
+    assert(lat_ewma_ns != NULL);
+    for (i = 0; i < world_size; i++)
+	peer_dlvr[i] = mode;
+}
+
+/*
+ * Set the delivery mode of posts to a peer, or to every peer when peer is
+ * negative: a GNI_DLVMODE_* value or UGNI_DLVR_AUTO. Posts whose builder
+ * names a mode of its own (e.g. PutSignalInOrderPost) keep it.
+ */
+void Node::uGNI_setDeliveryMode(int peer, uint16_t mode) {
+    int i;
+
+    if (peer >= 0) {
+	peer_dlvr[peer] = mode;
+	return;
+    }
+    for (i = 0; i < world_size; i++)
+	peer_dlvr[i] = mode;
+}
+
+/*
+ * Tune UGNI_DLVR_AUTO: posts of up to small_bytes go in order while the
+ * peer's completion latency average stays within latency_usec.
+ */
+void Node::uGNI_setDeliveryAuto(uint64_t small_bytes, uint64_t latency_usec) {
+    dlvr_small_bytes = small_bytes;
+    dlvr_latency_ns = latency_usec * 1000;
+}
+
+/*
+ * Fold the post-to-completion time of a post into the peer's moving
+ * average, weighing the newest sample 1/8.
+ */
+void Node::uGNI_recordLatency(int peer, uint64_t post_ns) {
+    if (peer < 0 || peer >= world_size)
+	return;
+
+    int64_t sample = (int64_t) (uGNI_now_ns() - post_ns);
+    int64_t avg = (int64_t) lat_ewma_ns[peer];
+
+    // Stored whole, thread contexts read it in uGNI_dlvrMode.
+    __atomic_store_n(&lat_ewma_ns[peer], (uint64_t) ((avg == 0) ? sample : avg + (sample - avg) / 8), __ATOMIC_RELAXED);
+}
+
+void Node::uGNI_printDeliveryStats() {
+    int i;
+
+    printf("rank %d automatic delivery: %lu in order %lu adaptive\n", world_rank, dlvr_in_order.load(), dlvr_adaptive.load());
+    for (i = 0; i < world_size; i++) {
+	if (peer_dlvr[i] != UGNI_DLVR_AUTO && lat_ewma_ns[i] == 0)
+	    continue;
+	printf("rank %d peer %4d delivery %s latency average %.2f usec\n",
+		world_rank, i, dlvr_name(peer_dlvr[i]), lat_ewma_ns[i] / 1000.0);
+    }
+}
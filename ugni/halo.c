@@ -0,0 +1,154 @@
+/*
+ ** Halo exchange of a 3D block decomposition over uGNI puts
+ **
+ ** usage: halo.x [n ghost steps]
+ **
+ ** Every rank owns an n^3 block of doubles on a periodic process grid and
+ ** exchanges faces, edges and corners each step. Ghost cells are checked
+ ** against the owner's rank after the last step.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+#include "halo.h"
+
+#define BLOCK_CELLS              32
+#define GHOST_CELLS              1
+#define NUMBER_OF_STEPS          100
+#define ROOT                     0
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+/* Split size ranks into a grid as close to a cube as possible. */
+static void grid_dims(int size, int *p) {
+    int a, f;
+
+    p[0] = p[1] = p[2] = 1;
+    for (f = 2; size > 1; ) {
+	if (size % f != 0) {
+	    f++;
+	    continue;
+	}
+	a = (p[0] <= p[1] && p[0] <= p[2]) ? 0 : (p[1] <= p[2]) ? 1 : 2;
+	p[a] *= f;
+	size /= f;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int n = BLOCK_CELLS;
+    int ghost = GHOST_CELLS;
+    int steps = NUMBER_OF_STEPS;
+    int p[3];
+    int i, s, rc;
+
+    if(argc == 4) {
+	n = atoi(argv[1]);
+	ghost = atoi(argv[2]);
+	steps = atoi(argv[3]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+
+    // Up to 26 puts out and 26 in per step.
+    int number_of_cq_entries = 64;
+    int number_of_dest_cq_entries = 128;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    HaloExchange halo;
+    halo.init(&node, n, n, n, ghost, sizeof(double), UGNI_HALO_ALL);
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, halo.sendBytes());
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, halo.recvBytes());
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, halo.sendBytes(), receive_buffer, halo.recvBytes());
+
+    bool periodic[3] = { true, true, true };
+    grid_dims(node.world_size, p);
+    halo.setGrid(p[0], p[1], p[2], periodic, true);
+    halo.commit(0, 0);
+
+    int L = n + 2 * ghost;
+    double *field = (double *) malloc((size_t) L * L * L * sizeof(double));
+    assert(field != NULL);
+    for(i = 0; i < L * L * L; i++)
+	field[i] = node.world_rank;
+
+    if(node.world_rank == ROOT) {
+	printf("\nranks = %d, grid = %d x %d x %d, block = %d^3, ghost = %d, steps = %d\n",
+		node.world_size, p[0], p[1], p[2], n, ghost, steps);
+	printf("\nsend bytes \t step lat\n");
+    }
+
+    struct timeval t1, t2;
+
+    node.uGNI_barrier();
+    gettimeofday(&t1, NULL);
+    for(s = 0; s < steps; s++) {
+	if(halo.exchange(field) != 0)
+	    fprintf(stderr, "Rank %d halo exchange failed at step %d\n", node.world_rank, s);
+    }
+    gettimeofday(&t2, NULL);
+
+    /*Every ghost cell must hold the rank of the neighbor it faces*/
+    int errors = 0;
+    int x, y, z;
+    for(x = 0; x < L; x++) {
+	for(y = 0; y < L; y++) {
+	    for(z = 0; z < L; z++) {
+		int dx = (x < ghost) ? -1 : (x >= n + ghost) ? 1 : 0;
+		int dy = (y < ghost) ? -1 : (y >= n + ghost) ? 1 : 0;
+		int dz = (z < ghost) ? -1 : (z >= n + ghost) ? 1 : 0;
+		int owner = halo.neighbors[UGNI_HALO_DIR(dx, dy, dz)];
+		if(dx == 0 && dy == 0 && dz == 0)
+		    owner = node.world_rank;
+		if(field[((size_t) x * L + y) * L + z] != owner)
+		    errors++;
+	    }
+	}
+    }
+
+    double latency = elapsed_usec(&t1, &t2)/steps;
+    double max_latency = 0;
+    MPI_Reduce(&latency, &max_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+
+    int total_errors = 0;
+    MPI_Reduce(&errors, &total_errors, 1, MPI_INT, MPI_SUM, ROOT, MPI_COMM_WORLD);
+
+    if(node.world_rank == ROOT) {
+	printf("%lu \t %8.4f\n", halo.sendBytes(), max_latency);
+	if(total_errors > 0)
+	    printf("Error: %d ghost cells hold wrong data\n", total_errors);
+    }
+
+    halo.destroy();
+    node.uGNI_finalize();
+
+    free(field);
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,313 @@
+// Halo exchange for the node class, see halo.h.
+
+#include <algorithm>
+
+#include "halo.h"
+
+/* Direction pointing the other way. */
+static inline int opposite(int d) {
+    return UGNI_HALO_DIRS - 1 - d;
+}
+
+/*
+ * Copy a box of ext cells at slo of the C-order array src, of dimensions
+ * sdims, to dlo of dst, of dimensions ddims. The z rows are contiguous on
+ * both sides and go with one memcpy each.
+ */
+static void copy_box(uint8_t *dst, const int *ddims, const int *dlo,
+	const uint8_t *src, const int *sdims, const int *slo, const int *ext, uint64_t esize) {
+    uint64_t row = (uint64_t) ext[2] * esize;
+    int x, y;
+
+    for (x = 0; x < ext[0]; x++) {
+	for (y = 0; y < ext[1]; y++) {
+	    uint64_t d = (((uint64_t) (dlo[0] + x) * ddims[1] + dlo[1] + y) * ddims[2] + dlo[2]) * esize;
+	    uint64_t s = (((uint64_t) (slo[0] + x) * sdims[1] + slo[1] + y) * sdims[2] + slo[2]) * esize;
+	    memcpy(dst + d, src + s, row);
+	}
+    }
+}
+
+/*
+ * Describe a block of nx * ny * nz interior cells of esize bytes with
+ * ghost layers of width ghost, exchanging the regions region_mask selects
+ * (UGNI_HALO_FACES, _EDGES, _CORNERS). No neighbors are set yet.
+ */
+void HaloExchange::init(Node *nd, int nx, int ny, int nz, int g, uint64_t elem_size, int mask) {
+    uint64_t send_off = 0;
+    int d, a;
+
+    assert(g > 0 && g <= nx && g <= ny && g <= nz);
+
+    node = nd;
+    dims[0] = nx;
+    dims[1] = ny;
+    dims[2] = nz;
+    ghost = g;
+    esize = elem_size;
+    region_mask = mask;
+    num_active = 0;
+    step = 0;
+    rc = 0;
+    stream = node->uGNI_streamAlloc();
+
+    // Every rank lays out the same regions at the same offsets, whichever
+    // neighbors it has, so a sender knows where its data lands.
+    for (d = 0; d < UGNI_HALO_DIRS; d++) {
+	int dir[3] = { d / 9 - 1, d / 3 % 3 - 1, d % 3 - 1 };
+	int kind = (dir[0] != 0) + (dir[1] != 0) + (dir[2] != 0);
+	halo_region_t *rg = &regions[d];
+
+	neighbors[d] = -1;
+	rg->bytes = 0;
+	if (kind == 0 || !(mask & (1 << (kind - 1))))
+	    continue;
+
+	rg->bytes = esize;
+	for (a = 0; a < 3; a++) {
+	    if (dir[a] < 0) {
+		rg->send_lo[a] = g;
+		rg->recv_lo[a] = 0;
+		rg->extent[a] = g;
+	    } else if (dir[a] > 0) {
+		rg->send_lo[a] = dims[a];
+		rg->recv_lo[a] = dims[a] + g;
+		rg->extent[a] = g;
+	    } else {
+		rg->send_lo[a] = g;
+		rg->recv_lo[a] = g;
+		rg->extent[a] = dims[a];
+	    }
+	    rg->bytes *= rg->extent[a];
+	}
+	assert(rg->bytes % 4 == 0);
+
+	rg->send_off = send_off;
+	rg->recv_off = send_off;
+	send_off += round_cacheline(rg->bytes);
+    }
+    slot_bytes = send_off;
+}
+
+/* The rank in direction (dx, dy, dz), or -1 for none. */
+void HaloExchange::setNeighbor(int dx, int dy, int dz, int rank) {
+    assert(dx >= -1 && dx <= 1 && dy >= -1 && dy <= 1 && dz >= -1 && dz <= 1);
+    neighbors[UGNI_HALO_DIR(dx, dy, dz)] = rank;
+}
+
+/*
+ * Set all neighbors from a px * py * pz grid of ranks, z fastest, wrapping
+ * around along the periodic axes. With by_topology the grid is filled in
+ * the order of the ranks' mesh coordinates instead of rank order, so grid
+ * neighbors tend to share a router or group. Every rank must call it with
+ * the same arguments.
+ */
+void HaloExchange::setGrid(int px, int py, int pz, const bool periodic[3], bool by_topology) {
+    int n = node->world_size;
+    int p[3] = { px, py, pz };
+    int me[3];
+    int pos = node->world_rank;
+    int i, d, a;
+
+    assert(px * py * pz == n);
+
+    int *order = (int *) malloc(n * sizeof(int));
+    assert(order != NULL);
+    for (i = 0; i < n; i++)
+	order[i] = i;
+
+    if (by_topology) {
+	const bootstrap_rec_t *t = node->bootstrap_table;
+	std::sort(order, order + n, [t](int x, int y) {
+		const pmi_mesh_coord_t &cx = t[x].coord, &cy = t[y].coord;
+		if (cx.mesh_x != cy.mesh_x)
+		    return cx.mesh_x < cy.mesh_x;
+		if (cx.mesh_y != cy.mesh_y)
+		    return cx.mesh_y < cy.mesh_y;
+		if (cx.mesh_z != cy.mesh_z)
+		    return cx.mesh_z < cy.mesh_z;
+		return x < y;
+		});
+	for (i = 0; i < n; i++) {
+	    if (order[i] == node->world_rank)
+		pos = i;
+	}
+    }
+
+    me[0] = pos / (py * pz);
+    me[1] = pos / pz % py;
+    me[2] = pos % pz;
+
+    for (d = 0; d < UGNI_HALO_DIRS; d++) {
+	int dir[3] = { d / 9 - 1, d / 3 % 3 - 1, d % 3 - 1 };
+	int c[3];
+
+	neighbors[d] = -1;
+	if (d == UGNI_HALO_SELF)
+	    continue;
+	for (a = 0; a < 3; a++) {
+	    c[a] = me[a] + dir[a];
+	    if (c[a] < 0 || c[a] >= p[a]) {
+		if (!periodic[a])
+		    break;
+		c[a] = (c[a] + p[a]) % p[a];
+	    }
+	}
+	if (a == 3)
+	    neighbors[d] = order[(c[0] * py + c[1]) * pz + c[2]];
+    }
+
+    free(order);
+}
+
+/* Bytes of the send buffer and of the receive buffer the exchange uses. */
+uint64_t HaloExchange::sendBytes() {
+    return slot_bytes;
+}
+
+uint64_t HaloExchange::recvBytes() {
+    return 2 * slot_bytes;
+}
+
+/*
+ * Place the packed regions at send_offset of the send buffer and the
+ * ghost slots at recv_offset of the receive buffer, and build the
+ * descriptors of every remote neighbor. Must follow the last neighbor
+ * change.
+ */
+void HaloExchange::commit(uint64_t send_offset, uint64_t recv_offset) {
+    int d, h;
+
+    assert(send_offset + sendBytes() <= node->send_buffer_length);
+    assert(recv_offset + recvBytes() <= node->recv_buffer_length);
+
+    send_base = send_offset;
+    recv_base = recv_offset;
+    num_active = 0;
+
+    for (d = 0; d < UGNI_HALO_DIRS; d++) {
+	halo_region_t *rg = &regions[d];
+	int peer = neighbors[d];
+
+	if (rg->bytes == 0 || peer < 0 || peer == node->world_rank)
+	    continue;
+	active[num_active++] = d;
+
+	// Our data goes to the slot the neighbor fills from the opposite side.
+	for (h = 0; h < 2; h++) {
+	    memset(&desc[h][d], 0, sizeof(gni_post_descriptor_t));
+	    PutSignalPost::fill(&desc[h][d], node->cq_handle,
+		    node->send_buffer_addr + send_base + rg->send_off, node->send_mem_handle,
+		    node->peers.target(peer).remote_addr + recv_base + h * slot_bytes + regions[opposite(d)].recv_off,
+		    node->peers.target(peer).remote_mdh, rg->bytes);
+	}
+    }
+}
+
+/*
+ * Pack the boundary regions of field, which holds (nx + 2 ghost) *
+ * (ny + 2 ghost) * (nz + 2 ghost) cells, and put them to the neighbors.
+ * field must not change before wait() returns.
+ *
+ *   Returns: 0 on success, 1 if a post failed.
+ */
+int HaloExchange::start(const void *field) {
+    int fdims[3] = { dims[0] + 2 * ghost, dims[1] + 2 * ghost, dims[2] + 2 * ghost };
+    int zero[3] = { 0, 0, 0 };
+    uint8_t *send = (uint8_t *) node->send_buffer_addr + send_base;
+    int h = step & 1;
+    int i;
+
+    rc = 0;
+
+    // Claim the neighbors' puts of this step before any can arrive.
+    for (i = 0; i < num_active; i++)
+	targets[i] = ++node->uGNI_stream(stream)->expected[neighbors[active[i]]];
+
+    for (i = 0; i < num_active; i++) {
+	int d = active[i];
+	halo_region_t *rg = &regions[d];
+
+	copy_box(send + rg->send_off, rg->extent, zero, (const uint8_t *) field, fdims, rg->send_lo, rg->extent, esize);
+	reqs[i] = node->uGNI_postRdma(neighbors[d], &desc[h][d], stream);
+	if (reqs[i] == UGNI_REQ_NULL)
+	    rc = 1;
+    }
+
+    return rc;
+}
+
+/*
+ * Wait until our puts completed and the neighbors' landed, then unpack
+ * them into the ghost cells of field. Ghost cells facing a neighbor that
+ * is this rank itself are copied locally; those facing none are left to
+ * the application. A timeout leaves the step's arrival targets claimed
+ * and the step unfinished, so puts landing late still count towards it:
+ * call wait() again before starting another step.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int HaloExchange::wait(void *field) {
+    int fdims[3] = { dims[0] + 2 * ghost, dims[1] + 2 * ghost, dims[2] + 2 * ghost };
+    int zero[3] = { 0, 0, 0 };
+    uint8_t *recv = (uint8_t *) node->my_memory_handle.addr + recv_base + (step & 1) * slot_bytes;
+    int wait_count = 0;
+    int pending = num_active;
+    int i, d;
+
+    while (pending > 0) {
+	int work = node->uGNI_progress();
+
+	pending = 0;
+	for (i = 0; i < num_active; i++) {
+	    int error = 0;
+
+	    if (!node->uGNI_test(&reqs[i], &error)) {
+		pending++;
+		continue;
+	    }
+	    if (error)
+		rc = 1;
+	    if (node->uGNI_stream(stream)->arrived[neighbors[active[i]]] < targets[i])
+		pending++;
+	}
+	if (pending == 0 || work > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+	if (node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i HaloExchange      ERROR %d regions of step %lu never completed\n",
+		    node->uts_info.nodename, node->world_rank, pending, step);
+	    return 3;
+	}
+    }
+
+    for (i = 0; i < num_active; i++) {
+	halo_region_t *rg = &regions[active[i]];
+	copy_box((uint8_t *) field, fdims, rg->recv_lo, recv + rg->recv_off, rg->extent, zero, rg->extent, esize);
+    }
+
+    for (d = 0; d < UGNI_HALO_DIRS; d++) {
+	if (regions[d].bytes == 0 || neighbors[d] != node->world_rank)
+	    continue;
+	copy_box((uint8_t *) field, fdims, regions[d].recv_lo,
+		(const uint8_t *) field, fdims, regions[opposite(d)].send_lo, regions[d].extent, esize);
+    }
+
+    step++;
+    return rc;
+}
+
+/* One whole step: start() and wait(). */
+int HaloExchange::exchange(void *field) {
+    int rc = start(field);
+    int wrc = wait(field);
+
+    return (wrc != 0) ? wrc : rc;
+}
+
+/* Release the arrival stream. The exchange must not be mid-step. */
+void HaloExchange::destroy() {
+    node->uGNI_streamFree(stream);
+    stream = 0;
+}
@@ -0,0 +1,80 @@
+// Persistent halo exchange for 3D block decompositions. Every rank owns a
+// block of nx * ny * nz cells surrounded by ghost layers, stored as one
+// array in C order (z fastest). Each step the boundary layers facing
+// every neighbor (the 6 faces, 12 edges and 8 corners, or a subset) are
+// packed into the registered send buffer and put, with a remote event,
+// straight into the matching ghost slot of the neighbor's receive buffer.
+//
+// Regions, buffer offsets and one descriptor per neighbor and receive
+// slot are laid out once by commit(); a step only packs, posts the ready
+// descriptors, waits and unpacks. Receive slots alternate between two
+// halves by step, so a neighbor already a step ahead never overwrites a
+// ghost slot that is still being unpacked.
+//
+// Arrivals are counted in an arrival stream the exchange holds until
+// destroy(), so other remote-event traffic between neighbors may run
+// alongside a step. All ranks must use the same block and ghost sizes and
+// the same offsets, and create their exchanges, plans and aggregators in
+// the same order, so the streams agree.
+
+#ifndef HALO_H
+#define HALO_H
+
+#include "node.h"
+
+#define UGNI_HALO_FACES   1
+#define UGNI_HALO_EDGES   2
+#define UGNI_HALO_CORNERS 4
+#define UGNI_HALO_ALL     (UGNI_HALO_FACES | UGNI_HALO_EDGES | UGNI_HALO_CORNERS)
+
+/* Directions (dx, dy, dz) in {-1, 0, 1}^3 are numbered (dx+1)*9 + (dy+1)*3 + dz+1. */
+#define UGNI_HALO_DIRS    27
+#define UGNI_HALO_SELF    13
+#define UGNI_HALO_DIR(dx, dy, dz) (((dx) + 1) * 9 + ((dy) + 1) * 3 + (dz) + 1)
+
+typedef struct {
+    int             send_lo[3];	/* boundary cells sent to the neighbor */
+    int             recv_lo[3];	/* ghost cells filled from it */
+    int             extent[3];
+    uint64_t        bytes;
+    uint64_t        send_off;	/* packed copy in the send buffer */
+    uint64_t        recv_off;	/* ghost slot in the receive buffer, first half */
+} halo_region_t;
+
+class HaloExchange {
+    public:
+	Node *node;
+	int dims[3];			/* interior cells */
+	int ghost;
+	uint64_t esize;
+	int region_mask;
+	int neighbors[UGNI_HALO_DIRS];	/* -1 where there is none */
+	int stream;			/* arrival stream of the puts */
+
+	halo_region_t regions[UGNI_HALO_DIRS];
+	int active[UGNI_HALO_DIRS];	/* directions with a remote neighbor */
+	int num_active;
+	uint64_t send_base;
+	uint64_t recv_base;
+	uint64_t slot_bytes;		/* one half of the ghost slots */
+	gni_post_descriptor_t desc[2][UGNI_HALO_DIRS];
+
+	uint64_t step;
+	uGNI_req_t reqs[UGNI_HALO_DIRS];
+	uint64_t targets[UGNI_HALO_DIRS];
+	int rc;
+
+    public:
+	void init(Node *node, int nx, int ny, int nz, int ghost, uint64_t esize, int region_mask);
+	void setNeighbor(int dx, int dy, int dz, int rank);
+	void setGrid(int px, int py, int pz, const bool periodic[3], bool by_topology);
+	uint64_t sendBytes();
+	uint64_t recvBytes();
+	void commit(uint64_t send_offset, uint64_t recv_offset);
+	int start(const void *field);
+	int wait(void *field);
+	int exchange(void *field);
+	void destroy();
+};
+
+#endif
@@ -0,0 +1,410 @@
+// Hierarchical collectives for the node class. The ranks of a node
+// combine or share their data through a shared memory segment, and only
+// one leader per node, its lowest rank, takes part in the collective over
+// the network. The NIC of a node then injects one copy of the data
+// instead of one per rank.
+//
+// Every local rank calls the same hierarchical collectives in the same
+// order, counting them in hier_epoch. The segment's flag words carry the
+// epoch they were last set in and only ever grow, so they never need to
+// be reset between calls.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+
+#include "collectives.h"
+
+#define HIER_KEY_LENGTH 64
+
+typedef struct {
+    std::atomic<uint64_t> value;
+    char pad[CACHELINE_SIZE - sizeof(std::atomic<uint64_t>)];
+} hier_word_t;
+
+/*
+ * Segment layout, in cache lines: the attach count, an arrival and a done
+ * word per local rank and the release word; then a data slot per local
+ * rank, indexed by local index, and the result slot.
+ *
+ *   arrive[i]  2e - 1 once local rank i's data of call e is in its slot,
+ *              2e once it combined its share of the slots
+ *   done[i]    e once local rank i returned from call e
+ *   release    e once the leader put the result of call e in the result slot
+ */
+#define HIER_ATTACHED    0
+#define HIER_ARRIVE(i)   (1 + (i))
+#define HIER_DONE(i)     (1 + local_size + (i))
+#define HIER_RELEASE     (1 + 2 * local_size)
+#define HIER_WORDS       (2 + 2 * local_size)
+
+/*
+ * Map the node's collective segment, with data slots of slot_bytes, and
+ * find the node leaders. A collective call: every rank calls it after
+ * uGNI_regAndExchangeMem, with the same slot_bytes.
+ */
+void Node::uGNI_hierInit(uint64_t slot_bytes) {
+    char name[HIER_KEY_LENGTH];
+    int fd = -1;
+    int i;
+
+    uGNI_getLocalRanks();
+
+    // Leaders from the bootstrap table: the lowest rank of every nid.
+    int *by_nid = (int *) malloc(world_size * sizeof(int));
+    leaders = (int *) malloc(world_size * sizeof(int));
+    leader_of = (int *) malloc(world_size * sizeof(int));
+    assert(by_nid != NULL && leaders != NULL && leader_of != NULL);
+
+    for (i = 0; i < world_size; i++)
+	by_nid[i] = i;
+    std::sort(by_nid, by_nid + world_size, [this](int a, int b) {
+	    int na = bootstrap_table[a].nid, nb = bootstrap_table[b].nid;
+	    return (na != nb) ? na < nb : a < b;
+	    });
+
+    num_leaders = 0;
+    for (i = 0; i < world_size; i++) {
+	if (i == 0 || bootstrap_table[by_nid[i]].nid != bootstrap_table[by_nid[i - 1]].nid)
+	    leaders[num_leaders++] = by_nid[i];
+	leader_of[by_nid[i]] = leaders[num_leaders - 1];
+    }
+    std::sort(leaders, leaders + num_leaders);
+    free(by_nid);
+    assert(leader_of[world_rank] == local_leader);
+
+    hier_slot_bytes = round_cacheline(slot_bytes);
+    hier_shm_size = HIER_WORDS * sizeof(hier_word_t) + (local_size + 1) * hier_slot_bytes;
+    hier_epoch = 0;
+
+    snprintf(name, sizeof(name), "/ugni-coll-%u-%u-%d", cookie, (unsigned int) ptag, nid);
+
+    if (world_rank == local_leader) {
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+	    shm_unlink(name);
+	    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	}
+	if (fd < 0 || ftruncate(fd, hier_shm_size) != 0) {
+	    fprintf(stdout, "[%s] Rank: %4i shm_open %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	    abort();
+	}
+    }
+
+    // Members open the segment only once the leader created it.
+    uGNI_barrier();
+
+    if (world_rank != local_leader) {
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+	    fprintf(stdout, "[%s] Rank: %4i shm_open %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	    abort();
+	}
+    }
+
+    hier_shm = mmap(NULL, hier_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hier_shm == MAP_FAILED) {
+	fprintf(stdout, "[%s] Rank: %4i mmap %s ERROR errno: %d\n", uts_info.nodename, world_rank, name, errno);
+	abort();
+    }
+
+    // The name is only needed until everyone has mapped the segment.
+    hier_word_t *w = (hier_word_t *) hier_shm;
+    if (w[HIER_ATTACHED].value.fetch_add(1, std::memory_order_acq_rel) + 1 == (uint64_t) local_size)
+	shm_unlink(name);
+}
+
+void Node::uGNI_hierDestroy() {
+    if (hier_shm != NULL) {
+	munmap(hier_shm, hier_shm_size);
+	hier_shm = NULL;
+    }
+    free(leaders);
+    free(leader_of);
+    leaders = NULL;
+    leader_of = NULL;
+    num_leaders = 0;
+}
+
+/*
+ * Scratch the inter-node stage of a hierarchical reduce or allreduce of
+ * count elements needs in the receive buffer of every rank.
+ */
+uint64_t Node::uGNI_hierScratch(uint64_t count, uGNI_dtype_t type) {
+    uint64_t a = CollAllreduce::scratchBytes(this, num_leaders, count, type);
+    uint64_t r = CollReduce::scratchBytes(num_leaders, count, type, bcast_fanout);
+
+    return (a > r) ? a : r;
+}
+
+static inline std::atomic<uint64_t> &hier_word(Node *node, int i) {
+    return ((hier_word_t *) node->hier_shm)[i].value;
+}
+
+static inline uint8_t *hier_slot(Node *node, int i) {
+    int local_size = node->local_size;
+    return (uint8_t *) node->hier_shm + HIER_WORDS * sizeof(hier_word_t) + i * node->hier_slot_bytes;
+}
+
+/*
+ * Poll a segment word until it reaches target. Local ranks need no NIC
+ * progress, but a leader keeps its CQs drained while it waits.
+ *
+ *   Returns: 0 on success, 3 on timeout.
+ */
+static int hier_wait(Node *node, int word, uint64_t target) {
+    std::atomic<uint64_t> &w = hier_word(node, word);
+    int wait_count = 0;
+
+    while (w.load(std::memory_order_acquire) < target) {
+	if (node->uGNI_progress() == 0 && node->uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i hierarchical collective ERROR local word %d stuck below %lu\n",
+		    node->uts_info.nodename, node->world_rank, word, target);
+	    return 3;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Wait until every local rank returned from the previous call, after
+ * which no one reads the slots any more and they may be written again.
+ */
+static int hier_quiesce(Node *node, uint64_t epoch) {
+    int local_size = node->local_size;
+    int i;
+
+    for (i = 0; i < local_size; i++) {
+	if (hier_wait(node, HIER_DONE(i), epoch - 1) != 0)
+	    return 3;
+    }
+    return 0;
+}
+
+static inline int local_index_of(Node *node, int rank) {
+    int i;
+
+    for (i = 0; i < node->local_size; i++) {
+	if (node->local_ranks[i] == rank)
+	    return i;
+    }
+    return -1;
+}
+
+/*
+ * Combine the vectors of all local ranks into the leader's slot. Every
+ * rank copies its vector into its slot, then combines one share of the
+ * elements across all slots, so the reduction is spread over the node.
+ */
+static int hier_local_reduce(Node *node, uint64_t epoch, void *buf, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    int local_size = node->local_size;
+    int me = node->local_index;
+    int lead = local_index_of(node, node->local_leader);
+    uint64_t esize = dtype_size(type);
+    int i;
+
+    memcpy(hier_slot(node, me), buf, count * esize);
+    hier_word(node, HIER_ARRIVE(me)).store(2 * epoch - 1, std::memory_order_release);
+
+    for (i = 0; i < local_size; i++) {
+	if (hier_wait(node, HIER_ARRIVE(i), 2 * epoch - 1) != 0)
+	    return 3;
+    }
+
+    uint64_t lo = (uint64_t) me * count / local_size;
+    uint64_t hi = (uint64_t) (me + 1) * count / local_size;
+    for (i = 0; i < local_size; i++) {
+	if (i != lead && hi > lo)
+	    reduce_local(hier_slot(node, lead) + lo * esize, hier_slot(node, i) + lo * esize, hi - lo, type, op);
+    }
+    hier_word(node, HIER_ARRIVE(me)).store(2 * epoch, std::memory_order_release);
+
+    if (node->world_rank != node->local_leader)
+	return 0;
+
+    for (i = 0; i < local_size; i++) {
+	if (hier_wait(node, HIER_ARRIVE(i), 2 * epoch) != 0)
+	    return 3;
+    }
+    memcpy(buf, hier_slot(node, lead), count * esize);
+    return 0;
+}
+
+/* Hand the leader's buf to the local ranks through the result slot. */
+static void hier_release(Node *node, uint64_t epoch, const void *buf, uint64_t length) {
+    int local_size = node->local_size;
+
+    memcpy(hier_slot(node, local_size), buf, length);
+    hier_word(node, HIER_RELEASE).store(epoch, std::memory_order_release);
+}
+
+static int hier_take(Node *node, uint64_t epoch, void *buf, uint64_t length) {
+    int local_size = node->local_size;
+
+    if (hier_wait(node, HIER_RELEASE, epoch) != 0)
+	return 3;
+    memcpy(buf, hier_slot(node, local_size), length);
+    return 0;
+}
+
+static inline void hier_done(Node *node, uint64_t epoch) {
+    int local_size = node->local_size;
+
+    hier_word(node, HIER_DONE(node->local_index)).store(epoch, std::memory_order_release);
+}
+
+/*
+ * Broadcast length bytes at buf from root: to the leader of root's node
+ * through its slot, over the network among the leaders with the tree of
+ * uGNI_broadcast, then to every rank of each node through the result
+ * slot. buf must lie in the registered receive buffer, at the same offset
+ * on every rank, and length must fit a slot.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_hierBroadcast(int root, void *buf, uint64_t length) {
+    uint64_t offset = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t epoch = ++hier_epoch;
+    bool leader = (world_rank == local_leader);
+    int root_index = local_index_of(this, root);
+    int rc = 0;
+
+    assert(hier_shm != NULL && length <= hier_slot_bytes);
+    assert((uint64_t) buf >= my_memory_handle.addr && offset + length <= recv_buffer_length);
+
+    if (world_rank == root && !leader) {
+	rc = hier_quiesce(this, epoch);
+	memcpy(hier_slot(this, local_index), buf, length);
+	hier_word(this, HIER_ARRIVE(local_index)).store(2 * epoch - 1, std::memory_order_release);
+    }
+
+    if (leader) {
+	if (root_index >= 0 && root != world_rank && rc == 0) {
+	    rc = hier_wait(this, HIER_ARRIVE(root_index), 2 * epoch - 1);
+	    memcpy(buf, hier_slot(this, root_index), length);
+	}
+
+	if (num_leaders > 1 && rc == 0) {
+	    CollBcast bcast;
+
+	    bcast.start(this, leader_of[root], offset, length, bcast_chunk_bytes, bcast_fanout, leaders, num_leaders);
+	    rc = coll_wait(this, &bcast);
+	    bcast.finish();
+	    if (rc == 0)
+		rc = bcast.rc;
+	}
+
+	if (local_size > 1 && hier_quiesce(this, epoch) == 0)
+	    hier_release(this, epoch, buf, length);
+    } else {
+	// Keep the collective numbers in step with the leaders'.
+	if (num_leaders > 1)
+	    coll_epoch++;
+	if (world_rank != root)
+	    rc = hier_take(this, epoch, buf, length);
+    }
+
+    hier_done(this, epoch);
+    return rc;
+}
+
+/*
+ * Combine count elements at buf across all ranks with op, leaving the
+ * result at buf everywhere: first across each node through its segment,
+ * then among the leaders with uGNI_allreduce's algorithms, then back to
+ * every rank through the result slot. buf and scratch must lie in the
+ * registered receive buffer, at the same offsets on every rank; scratch
+ * must hold uGNI_hierScratch(count, type) bytes and the vector must fit
+ * a slot.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_hierAllreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    uint64_t buf_off = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t scratch_off = (uint64_t) scratch - my_memory_handle.addr;
+    uint64_t bytes = count * dtype_size(type);
+    uint64_t epoch = ++hier_epoch;
+    int rc;
+
+    assert(hier_shm != NULL && bytes <= hier_slot_bytes);
+    assert((uint64_t) buf >= my_memory_handle.addr && buf_off + bytes <= recv_buffer_length);
+    assert((uint64_t) scratch >= my_memory_handle.addr &&
+	    scratch_off + uGNI_hierScratch(count, type) <= recv_buffer_length);
+
+    rc = hier_quiesce(this, epoch);
+    if (rc == 0 && local_size > 1)
+	rc = hier_local_reduce(this, epoch, buf, count, type, op);
+
+    if (world_rank == local_leader) {
+	if (num_leaders > 1 && rc == 0) {
+	    CollAllreduce allreduce;
+
+	    allreduce.start(this, buf_off, scratch_off, count, type, op, leaders, num_leaders);
+	    rc = coll_wait(this, &allreduce);
+	    allreduce.finish();
+	    if (rc == 0)
+		rc = allreduce.rc;
+	}
+	if (local_size > 1)
+	    hier_release(this, epoch, buf, bytes);
+    } else {
+	// Keep the collective numbers in step with the leaders'.
+	if (num_leaders > 1)
+	    coll_epoch++;
+	if (rc == 0)
+	    rc = hier_take(this, epoch, buf, bytes);
+    }
+
+    hier_done(this, epoch);
+    return rc;
+}
+
+/*
+ * Combine count elements at buf across all ranks with op, leaving the
+ * result at buf on root: across each node through its segment, then up
+ * the reduce tree among the leaders, then from root's leader to root
+ * through the result slot. buf is left with partial results elsewhere.
+ * Buffer requirements as for uGNI_hierAllreduce.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_hierReduce(int root, void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    uint64_t buf_off = (uint64_t) buf - my_memory_handle.addr;
+    uint64_t scratch_off = (uint64_t) scratch - my_memory_handle.addr;
+    uint64_t bytes = count * dtype_size(type);
+    uint64_t epoch = ++hier_epoch;
+    int rc;
+
+    assert(hier_shm != NULL && bytes <= hier_slot_bytes);
+    assert((uint64_t) buf >= my_memory_handle.addr && buf_off + bytes <= recv_buffer_length);
+    assert((uint64_t) scratch >= my_memory_handle.addr &&
+	    scratch_off + uGNI_hierScratch(count, type) <= recv_buffer_length);
+
+    rc = hier_quiesce(this, epoch);
+    if (rc == 0 && local_size > 1)
+	rc = hier_local_reduce(this, epoch, buf, count, type, op);
+
+    if (world_rank == local_leader) {
+	if (num_leaders > 1 && rc == 0) {
+	    CollReduce reduce;
+
+	    reduce.start(this, leader_of[root], buf_off, scratch_off, count, type, op, bcast_fanout, leaders, num_leaders);
+	    rc = coll_wait(this, &reduce);
+	    reduce.finish();
+	    if (rc == 0)
+		rc = reduce.rc;
+	}
+	if (leader_of[root] == world_rank && root != world_rank)
+	    hier_release(this, epoch, buf, bytes);
+    } else {
+	if (num_leaders > 1)
+	    coll_epoch++;
+	if (world_rank == root && rc == 0)
+	    rc = hier_take(this, epoch, buf, bytes);
+    }
+
+    hier_done(this, epoch);
+    return rc;
+}
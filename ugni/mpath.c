@@ -25,31 +25,44 @@ int main(int argv, char **argc) {
 
     Node node;
     node.uGNI_init();    
-    node.uGNI_getTopoInfo();
+    node.uGNI_setBootstrapMode(UGNI_BOOTSTRAP_NODE);
 
-    proc_t *proc = (proc_t*)malloc(sizeof(proc_t));
-    proc->world_rank = node.world_rank;
-    proc->nid = node.nid;
-    proc->coord_x = node.coord.mesh_x;
-    proc->coord_y = node.coord.mesh_y;
-    proc->coord_z = node.coord.mesh_z;
+    int iters = 30;
+    int nbytes = 4*1024*1024;
+
+    char *send_buf = (char*)malloc(nbytes*iters);
+    char *recv_buf = (char*)malloc(nbytes*iters);
+
+    gni_return_t   gni_status = GNI_RC_SUCCESS;
+    int create_destination_cq = 1;
+    int number_of_cq_entries  = iters;
+    int number_of_dest_cq_entries = 1;
+    gni_post_descriptor_t *rdma_data_desc;
+
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    /*
+     * The bootstrap exchange also brings everyone's nid and coordinates,
+     * in a table shared read-only by all ranks of the node.
+     */
+    node.uGNI_regAndExchangeMem(send_buf, nbytes * iters, recv_buf, nbytes * iters);
 
-    proc_t *procs = (proc_t*)malloc(sizeof(proc_t)*node.world_size);
-    MPI_Allgather(proc, 5, MPI_INT, procs, 5, MPI_INT, MPI_COMM_WORLD); 
+    const bootstrap_rec_t *procs = node.bootstrap_table;
 
     if(node.world_rank == 0) {
 	for(int i = 0; i < node.world_size; i++) {
-	    printf("Rank %d [%d %d %d %d]\n", procs[i].world_rank, procs[i].coord_x, procs[i].coord_y, procs[i].coord_z, procs[i].nid);
+	    printf("Rank %d [%d %d %d %d]\n", procs[i].rank, procs[i].coord.mesh_x, procs[i].coord.mesh_y, procs[i].coord.mesh_z, procs[i].nid);
 	}
     }
 
     proc_t *distinct_procs = (proc_t*)malloc(sizeof(proc_t)*node.world_size);
     int num_aries;
 
-    distinct_procs[0].world_rank = procs[0].world_rank;
-    distinct_procs[0].coord_x = procs[0].coord_x;
-    distinct_procs[0].coord_y = procs[0].coord_y;
-    distinct_procs[0].coord_z = procs[0].coord_z;
+    distinct_procs[0].world_rank = procs[0].rank;
+    distinct_procs[0].coord_x = procs[0].coord.mesh_x;
+    distinct_procs[0].coord_y = procs[0].coord.mesh_y;
+    distinct_procs[0].coord_z = procs[0].coord.mesh_z;
     distinct_procs[0].nid = procs[0].nid;
     num_aries = 1;
     bool existing = false;
@@ -58,18 +71,18 @@ int main(int argv, char **argc) {
     for(int i = 1; i < node.world_size; i++) {
 	existing = false;
 	for(int j = 0; j < num_aries; j++){
-	    if(distinct_procs[j].coord_x == procs[i].coord_x && 
-		    distinct_procs[j].coord_y == procs[i].coord_y &&
-		    distinct_procs[j].coord_z == procs[i].coord_z) {
+	    if(distinct_procs[j].coord_x == procs[i].coord.mesh_x && 
+		    distinct_procs[j].coord_y == procs[i].coord.mesh_y &&
+		    distinct_procs[j].coord_z == procs[i].coord.mesh_z) {
 		existing = true;
 		break;
 	    }
 	}
 	if(!existing) {
-	    distinct_procs[num_aries].world_rank = procs[i].world_rank;
-	    distinct_procs[num_aries].coord_x = procs[i].coord_x;
-	    distinct_procs[num_aries].coord_y = procs[i].coord_y;
-	    distinct_procs[num_aries].coord_z = procs[i].coord_z;
+	    distinct_procs[num_aries].world_rank = procs[i].rank;
+	    distinct_procs[num_aries].coord_x = procs[i].coord.mesh_x;
+	    distinct_procs[num_aries].coord_y = procs[i].coord.mesh_y;
+	    distinct_procs[num_aries].coord_z = procs[i].coord.mesh_z;
 	    distinct_procs[num_aries].nid = procs[i].nid;
 	    num_aries++;
 	}
@@ -102,16 +115,11 @@ int main(int argv, char **argc) {
     if(node.world_rank == distinct_procs[num_aries/2-1].world_rank) {
 	node.isProxy = true;
     }
-    int iters = 30;
-    int nbytes = 4*1024*1024;
-
     int sourceId = distinct_procs[0].world_rank;
     int destId = distinct_procs[num_aries-1].world_rank;
     int proxy1 = distinct_procs[num_aries/2-1].world_rank;
     int proxy2 = distinct_procs[num_aries/2].world_rank;
 
-    char *send_buf = (char*)malloc(nbytes*iters);
-    char *recv_buf = (char*)malloc(nbytes*iters);
     MPI_Request *request = (MPI_Request*)malloc(sizeof(MPI_Request)*iters);
     MPI_Status *status = (MPI_Status*)malloc(sizeof(MPI_Status)*iters);
 
@@ -120,7 +128,7 @@ int main(int argv, char **argc) {
 
     struct timeval t1, t2;
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
     gettimeofday(&t1, NULL);
 
     if(node.isSource) {
@@ -154,7 +162,7 @@ int main(int argv, char **argc) {
 	    printf("Invalid received data\n");
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
 
@@ -218,7 +226,7 @@ int main(int argv, char **argc) {
     MPI_Win win;
     MPI_Win_create(send_buf, iters*nbytes, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &win);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
     gettimeofday(&t1, NULL);
    
     MPI_Win_fence(0, win);
@@ -248,17 +256,6 @@ int main(int argv, char **argc) {
 	    printf("Invalid received data\n");
     }
 
-    gni_return_t   gni_status = GNI_RC_SUCCESS;
-    int create_destination_cq = 1;
-    int number_of_cq_entries  = iters;
-    int number_of_dest_cq_entries = 1;
-    gni_post_descriptor_t *rdma_data_desc;
-
-    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
-    node.uGNI_createAndBindEndpoints();
-
-    node.uGNI_regAndExchangeMem(send_buf, nbytes * iters, recv_buf, nbytes * iters);
-
     /* Allocate the rdma_data_desc array. */
     rdma_data_desc = (gni_post_descriptor_t *) calloc(iters, sizeof(gni_post_descriptor_t));
     assert(rdma_data_desc != NULL); 
@@ -283,7 +280,7 @@ int main(int argv, char **argc) {
 	memset(send_buf, 0, iters*nbytes);
     memset(recv_buf, 0, iters*nbytes);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
     gettimeofday(&t1, NULL);
 
     if(node.isSource) {
@@ -295,17 +292,17 @@ int main(int argv, char **argc) {
 	    rdma_data_desc[i].remote_addr += i * nbytes;
 	    rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[destId].mdh;
 	    rdma_data_desc[i].length = nbytes;
-	    gni_status = GNI_PostRdma(node.endpoint_handles_array[destId], &rdma_data_desc[i]);
+	    gni_status = node.uGNI_post(destId, &rdma_data_desc[i]);
 	    if (gni_status != GNI_RC_SUCCESS) {
 		fprintf(stdout, "Rank: %4i GNI_PostRdma data ERROR status: %d\n", node.world_rank, gni_status);
 		postRdmaStatus(gni_status);
 		continue;
 	    }
 	}
-	node.uGNI_waitAllSendDone(destId, node.cq_handle, iters);
+	node.uGNI_waitAllSendDone(destId, iters);
     }
     if(node.isDest) {
-	node.uGNI_waitAllRecvDone(sourceId, node.destination_cq_handle, iters);
+	node.uGNI_waitAllRecvDone(sourceId, iters);
     }
 
     gettimeofday(&t2, NULL);
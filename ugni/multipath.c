@@ -23,12 +23,14 @@
 #include "mpi.h"
 
 #include "node.h"
+#include "path.h"
 
 #define CACHELINE_MASK           0x3F   /* 64 byte cacheline */
 #define NUMBER_OF_TRANSFERS      10
 #define SEND_DATA                0xdddd000000000000
 #define TRANSFER_LENGTH          1024
 #define TRANSFER_LENGTH_IN_BYTES ((TRANSFER_LENGTH)*sizeof(uint64_t))
+#define PATH_INFLIGHT            4      /* chunks in flight per path */
 
 int             compare_data_failed = 0;
 struct utsname  uts_info;
@@ -58,8 +60,7 @@ int main(int argc, char **argv)
 
     int             create_destination_cq = 1;
     uint64_t        data = SEND_DATA;
-    register int    i;
-    register int    j;
+    int             i;
     int             rc;
     gni_post_descriptor_t *rdma_data_desc;
     int             receive_from;
@@ -70,7 +71,7 @@ int main(int argc, char **argv)
     int             send_to;
     gni_return_t    status = GNI_RC_SUCCESS;
 
-    int number_of_cq_entries  = iters;
+    int number_of_cq_entries  = iters + 2 * PATH_INFLIGHT;
     int number_of_dest_cq_entries = 1;
 
     Node node;
@@ -115,7 +116,9 @@ int main(int argc, char **argv)
     int *proxies = (int*)malloc(sizeof(int)*num_proxies);
     proxies[1] = dest;
     proxies[0] = node.world_size/2;
-    int proxy = proxies[1];
+    // Path 0 relays through proxies[0]; path 1 is the direct one to dest,
+    // so proxies[0] is the only rank that acts as a proxy.
+    int proxy = proxies[0];
 
     if(node.world_rank == source){
 	send_to = proxy;
@@ -148,6 +151,13 @@ int main(int argc, char **argv)
     int num_loops = 0;
     int num_wins = nbytes/min_wsize*iters;
 
+    /*The source spreads chunks over the proxy path and the direct path*/
+    PathScheduler sched;
+    if(node.isSource)
+	sched.init(&node, num_proxies, proxies, PATH_INFLIGHT);
+    uGNI_req_t *relay_reqs = (uGNI_req_t *) calloc(num_wins, sizeof(uGNI_req_t));
+    assert(relay_reqs != NULL);
+
     /* Allocate the rdma_data_desc array. */
     rdma_data_desc = (gni_post_descriptor_t *) calloc(num_wins, sizeof(gni_post_descriptor_t));
     assert(rdma_data_desc != NULL);
@@ -193,7 +203,7 @@ int main(int argc, char **argv)
     if(node.world_rank ==0)
 	printf("Start transfering data\n");
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     int num_transfers = 0;
 
@@ -205,64 +215,52 @@ int main(int argc, char **argv)
 	gettimeofday(&t1, NULL);
 
 	if(node.isSource) {
-	    /*Transfer to the 1st proxy*/
-	    for(j = 0; j < num_proxies; j++)
-	    {
-		send_to = proxies[j];
-		for (i = num_loops*j/num_proxies; i < num_loops*(j+1)/num_proxies; i++) {
-		    /* Send the data. */
-                    rdma_data_desc[i].local_addr = (uint64_t) send_buffer;
-	            rdma_data_desc[i].local_addr += i * win_size;
-	            rdma_data_desc[i].remote_addr = node.remote_memory_handle_array[send_to].addr;// + sizeof(uint64_t);
-		    rdma_data_desc[i].remote_addr += i * win_size;
-		    rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
-                    rdma_data_desc[i].length = win_size;// - sizeof(uint64_t);
-	            status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
-	            if (status != GNI_RC_SUCCESS) {
-		        fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, node.world_rank, status);
-			postRdmaStatus(status);
-			continue;
-		    }
-		}
-	    }
-
-	    //Check to make sure that all sends are done.
-	    for(j = 0; j < num_proxies; j++) {
-		node.uGNI_waitAllSendDone(proxies[j], node.cq_handle, num_loops/num_proxies);
-	    }
+	    /*Hand each chunk to whichever path frees a slot first*/
+	    uint64_t relayed_before = sched.paths[0].chunks;
+	    if (sched.run(0, 0, (uint64_t) num_loops * win_size, win_size) != 0)
+		fprintf(stderr, "Rank %d path scheduler failed\n", node.world_rank);
+	    //Tell the proxy how many chunks it has to relay.
+	    int relay_count = (int) (sched.paths[0].chunks - relayed_before);
+	    MPI_Send(&relay_count, 1, MPI_INT, proxy, 0, MPI_COMM_WORLD);
 	}
 
 	/*Act as a proxy*/
 	if(node.isProxy) {
-	    for(i = 0; i < num_loops/num_proxies; i++) {
-		node.uGNI_waitRecvDone(receive_from, node.destination_cq_handle);
-		//printf("done waiting at proxy\n");
-		rdma_data_desc[i].local_addr = (uint64_t) send_buffer;
-		rdma_data_desc[i].local_addr += i * win_size;
-		rdma_data_desc[i].remote_addr = node.remote_memory_handle_array[send_to].addr;// + sizeof(uint64_t);
-		rdma_data_desc[i].remote_addr += i * win_size;
-		rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
-		rdma_data_desc[i].length = win_size;// - sizeof(uint64_t);
-
-		status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
-		if (status != GNI_RC_SUCCESS) {
-		    fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, node.world_rank, status);
-		    postRdmaStatus(status);
+	    int relay_count = -1;
+	    int relayed = 0;
+	    int flag = 0;
+	    uint32_t chunk;
+	    MPI_Request count_req;
+	    MPI_Irecv(&relay_count, 1, MPI_INT, receive_from, 0, MPI_COMM_WORLD, &count_req);
+
+	    while(!flag || relayed < relay_count) {
+		if(!flag)
+		    MPI_Test(&count_req, &flag, MPI_STATUS_IGNORE);
+		if(!node.uGNI_pollTag(&chunk))
 		    continue;
-		}
-		//printf("Rank 2 posted a message\n");
+		//Forward the chunk from where it landed to the same offset at the destination.
+		uint64_t offset = (uint64_t) chunk * win_size;
+		relay_reqs[relayed] = node.uGNI_postTagged(send_to, (uint64_t) receive_buffer + offset,
+			node.recv_mem_handle, offset, win_size, chunk, &status);
+		if (relay_reqs[relayed] == UGNI_REQ_NULL)
+		    fprintf(stderr, "Rank %d could not relay chunk %u, status %d\n", node.world_rank, chunk, status);
+		relayed++;
 	    }
 	    //Check to make sure that all sends are done.
-	    node.uGNI_waitAllSendDone(send_to, node.cq_handle, num_loops/num_proxies);
-	    //printf("Rank 2 done all\n");
+	    if (node.uGNI_waitAll(relayed, relay_reqs) != 0)
+		fprintf(stderr, "Rank %d timed out relaying data\n", node.world_rank);
 	}
 
 	/*Destination to receive data*/
 	if(node.isDest) {
-	    //Check to get all data received
-	    node.uGNI_waitAllRecvDone(0, node.destination_cq_handle, num_loops/2);
-	    node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, num_loops/2);
-	    //printf("Rank 3 done waiting all\n");
+	    //Every chunk arrives tagged, directly from the source or through the proxy.
+	    uint32_t chunk;
+	    for(i = 0; i < num_loops; i++) {
+		if (node.uGNI_waitTag(&chunk) != 0) {
+		    fprintf(stderr, "Rank %d timed out waiting for data\n", node.world_rank);
+		    break;
+		}
+	    }
 	}
 
 	gettimeofday(&t2, NULL);
@@ -282,9 +280,12 @@ int main(int argc, char **argv)
 	    memset(receive_buffer, 0, nbytes*iters);
 	}
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	node.uGNI_barrier();
     }
 
+    if(node.isSource)
+	sched.printStats();
+
     /*Direct transfer*/
     if(node.world_rank == 0)
 	printf("\nDirect transfer using GNI_PostRdma\n");
@@ -295,7 +296,7 @@ int main(int argc, char **argv)
     if(node.isDest)
 	receive_from = source;
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
 
@@ -307,23 +308,23 @@ int main(int argc, char **argv)
 	    rdma_data_desc[i].remote_addr += i * nbytes;
 	    rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
 	    rdma_data_desc[i].length = nbytes;// - sizeof(uint64_t);
-	    status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+	    status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 	    if (status != GNI_RC_SUCCESS) {
 		fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d, iter %dth\n", uts_info.nodename, node.world_rank, status, i+1);
 		postRdmaStatus(status);
 		continue;
 	    }
 	}
-	node.uGNI_waitAllSendDone(send_to, node.cq_handle, iters);
+	node.uGNI_waitAllSendDone(send_to, iters);
     }
 
     if(node.isDest) {
-	node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, iters);
+	node.uGNI_waitAllRecvDone(receive_from, iters);
     }
 
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     double latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     double max_latency = 0;
@@ -340,7 +341,7 @@ int main(int argc, char **argv)
 	memset(receive_buffer, 0, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     if(node.world_rank == 0)
 	printf("\nDirect transfer using MPI_Put\n");
@@ -361,7 +362,7 @@ int main(int argc, char **argv)
     MPI_Win_create((void *)win_buf, nbytes*iters, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &win);
 
     /*Direct transfer using MPI_Put*/
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
     MPI_Win_fence(0, win);
@@ -377,7 +378,7 @@ int main(int argc, char **argv)
     MPI_Win_fence(0, win);
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     max_latency = 0;
@@ -394,7 +395,7 @@ int main(int argc, char **argv)
 	memset(win_buf, 7, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     if(node.world_rank == 0)
         printf("\nDirect transfer using MPI_Isend/MPI_Irecv\n");
@@ -427,7 +428,7 @@ int main(int argc, char **argv)
 
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     max_latency = 0;
@@ -444,7 +445,7 @@ int main(int argc, char **argv)
         memset(win_buf, 0, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
     */
     /*for(i = 0; i < iters; i++)
     {
@@ -454,13 +455,14 @@ int main(int argc, char **argv)
 	    MPI_Recv(&recv_buf[i*nbytes], nbytes, MPI_BYTE, receive_from, 0, MPI_COMM_WORLD, &mpi_status[i]);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
     */
     node.uGNI_finalize();
 
     free(receive_buffer);
     free(send_buffer);
     free(rdma_data_desc);
+    free(relay_reqs);
     MPI_Free_mem(win_buf);
     //MPI_Free_mem(recv_buf);
     //free(request);
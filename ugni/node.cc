@@ -3,7 +3,135 @@
 // @date: July 1st, 2014
 
 #include "node.h"
+#include "context.h"
+
+Node::Node() {
+    cdm_handle = NULL;
+    nic_handle = NULL;
+    cq_handle = NULL;
+    destination_cq_handle = NULL;
+    peers.hot = NULL;
+    peers.size = 0;
+    remote_memory_handle_array = NULL;
+    all_nic_addresses = NULL;
+    bootstrap_table = NULL;
+    bootstrap_mode = UGNI_BOOTSTRAP_FLAT;
+    local_size = 0;
+    local_index = -1;
+    local_leader = -1;
+    local_ranks = NULL;
+    boot_shm = NULL;
+    boot_shm_size = 0;
+    endpoints_bound = 0;
+    ep_cache_limit = 0;
+    ep_cache_size = 0;
+    ep_evicting = false;
+    ep_lru_head = -1;
+    ep_lru_tail = -1;
+    ep_lru_prev = NULL;
+    ep_lru_next = NULL;
+    ep_event_data = NULL;
+    ep_hits = 0;
+    ep_misses = 0;
+    ep_evictions = 0;
+    ep_overflows = 0;
+    send_buffer_addr = 0;
+    isSource = false;
+    isProxy = false;
+    isDest = false;
+    send_completed = NULL;
+    send_expected = NULL;
+    recv_arrived = NULL;
+    recv_expected = NULL;
+    send_inflight = NULL;
+    send_failed = NULL;
+    send_submitted = NULL;
+    send_taken = NULL;
+    memset(streams, 0, sizeof(streams));
+    streams_held = 1;
+    overrun_recovery = false;
+    in_recovery = false;
+    flushes = NULL;
+    flush_retry = false;
+    recv_resync_request = false;
+    recv_resyncing = false;
+    recv_resync_again = false;
+    number_of_cq_entries = 0;
+    number_of_dest_cq_entries = 0;
+    sync_region = NULL;
+    barrier_epoch = 0;
+    barrier_amo_epoch = 0;
+    remote_sync_array = NULL;
+    memset(seq_slot_reqs, 0, sizeof(seq_slot_reqs));
+    seq_slot_next = 0;
+    seq_sent = NULL;
+    seq_snapshot = NULL;
+    pending_head = NULL;
+    pending_tail = NULL;
+    pending_free = NULL;
+    pending_count = 0;
+    pending_queued = 0;
+    pending_next_peer = 0;
+    progress_running = false;
+    submit_ring = NULL;
+    completion_ring = NULL;
+    memset(thread_contexts, 0, sizeof(thread_contexts));
+    num_channels = 0;
+    memset(channels, 0, sizeof(channels));
+    peer_dlvr = NULL;
+    lat_ewma_ns = NULL;
+    dlvr_small_bytes = UGNI_DLVR_SMALL_BYTES;
+    dlvr_latency_ns = UGNI_DLVR_LATENCY_NS;
+    dlvr_in_order = 0;
+    dlvr_adaptive = 0;
+    recv_tags = NULL;
+    recv_tags_cap = 0;
+    recv_tags_head = 0;
+    recv_tags_count = 0;
+    recv_buffer_length = 0;
+    bcast_chunk_bytes = UGNI_BCAST_CHUNK_BYTES;
+    bcast_fanout = UGNI_BCAST_FANOUT;
+    allreduce_chunk_bytes = UGNI_ALLREDUCE_CHUNK_BYTES;
+    allreduce_rd_bytes = UGNI_ALLREDUCE_RD_BYTES;
+    coll_epoch = 0;
+    a2a_chunk_bytes = UGNI_A2A_CHUNK_BYTES;
+    a2a_window = UGNI_A2A_WINDOW;
+    a2a_per_peer = UGNI_A2A_PER_PEER;
+    a2a_order = NULL;
+    hier_shm = NULL;
+    hier_shm_size = 0;
+    hier_slot_bytes = 0;
+    hier_epoch = 0;
+    num_leaders = 0;
+    leaders = NULL;
+    leader_of = NULL;
+    coll_running = NULL;
+    coll_advancing = false;
+    send_buffer_length = 0;
+    modes = GNI_CDM_MODE_BTE_SINGLE_CHANNEL;
+    device_id = 0;
+    uname(&uts_info);
+
+    // Default to the historical behaviour: yield between polls.
+    memset(cq_wait, 0, sizeof(cq_wait));
+    uGNI_setWaitPolicy(0, UGNI_WAIT_SPIN_YIELD, 0, 0);
+    uGNI_setWaitPolicy(1, UGNI_WAIT_SPIN_YIELD, 0, 0);
+}
+
+/*
+ * Choose how waits on the source (source_cq = 1) or destination
+ * (source_cq = 0) completion queue behave. UGNI_WAIT_SPIN_BLOCK needs a
+ * blocking CQ, so it must be chosen before uGNI_createBasicCQ; a pure
+ * spin gets a larger poll budget since it never gives up the cpu.
+ */
+void Node::uGNI_setWaitPolicy(unsigned int source_cq, uGNI_wait_policy_t policy, int spin_limit, uint64_t timeout_ms) {
+    cq_wait_t *w = &cq_wait[source_cq ? 1 : 0];
 
+    w->policy = policy;
+    w->spin_limit = spin_limit;
+    w->timeout_ms = (timeout_ms > 0) ? timeout_ms : 1;
+    w->max_polls = (policy == UGNI_WAIT_SPIN) ? 100 * MAXIMUM_CQ_RETRY_COUNT : MAXIMUM_CQ_RETRY_COUNT;
+}
 
 void Node::uGNI_printInfo() {
     printf("rank %d PMI_Get_nid gives nid %d \n", world_rank, nid);
@@ -20,8 +148,18 @@ void Node::uGNI_getTopoInfo() {
     //rca_get_meshcoord( (uint16_t) nid, &coord);
 }
 
+/*
+ * Choose the CDM modes and the NIC device used by uGNI_init and by every
+ * context created afterwards. Must be called before uGNI_init. Without
+ * GNI_CDM_MODE_BTE_SINGLE_CHANNEL the NIC may spread block transfers over
+ * all of its BTE channels.
+ */
+void Node::uGNI_setCdmModes(int cdm_modes, int device) {
+    modes = cdm_modes;
+    device_id = device;
+}
+
 void Node::uGNI_init() {
-    int device_id = 0;
     int             rc;
     unsigned int    local_address;
     int             first_spawned;
@@ -36,12 +174,37 @@ void Node::uGNI_init() {
     rc = PMI_Get_rank(&world_rank);
     assert(rc == PMI_SUCCESS);
 
+    // Per-peer event counters and the request table used by the wait functions.
+    send_completed = (uint64_t *) calloc(10 * world_size, sizeof(uint64_t));
+    assert(send_completed != NULL);
+    send_expected = send_completed + world_size;
+    recv_arrived = send_expected + world_size;
+    recv_expected = recv_arrived + world_size;
+    send_inflight = recv_expected + world_size;
+    seq_sent = send_inflight + world_size;
+    seq_snapshot = seq_sent + world_size;
+    send_failed = seq_snapshot + world_size;
+    send_submitted = send_failed + world_size;
+    send_taken = send_submitted + world_size;
+
+    // The event data of a put carries the sender's rank next to its stream.
+    assert((uint32_t) world_size <= UGNI_STREAM_RANK_MASK + 1);
+    streams[0].arrived = recv_arrived;
+    streams[0].expected = recv_expected;
+    streams[0].seq_sent = seq_sent;
+    streams[0].seq_snapshot = seq_snapshot;
+
+    pending_head = (pending_post_t **) calloc(2 * world_size, sizeof(pending_post_t *));
+    assert(pending_head != NULL);
+    pending_tail = pending_head + world_size;
+    requests.init(UGNI_REQ_BLOCK_SIZE);
+    uGNI_initDelivery();
+
     // Get job attributes from PMI.
-    uint8_t ptag = get_ptag();
-    int cookie = get_cookie();
+    ptag = get_ptag();
+    cookie = get_cookie();
 
-    // Create a handle to the communication domain. GNI_CDM_MODE_BTE_SINGLE_CHANNEL was used for modes variable.
-    modes = GNI_CDM_MODE_BTE_SINGLE_CHANNEL;
+    // Create a handle to the communication domain, see uGNI_setCdmModes.
     gni_return_t status = GNI_CdmCreate(world_rank, ptag, cookie, modes, &cdm_handle);
 
     if (status != GNI_RC_SUCCESS) {
@@ -55,50 +218,222 @@ void Node::uGNI_init() {
     }
 }
 
+/*
+ * Allocate the endpoint table. Endpoints are created and bound on first
+ * use by uGNI_getEndpoint, from the NIC addresses gathered at
+ * uGNI_regAndExchangeMem, so startup cost and endpoint memory follow the
+ * number of peers actually used rather than the job size.
+ */
 void Node::uGNI_createAndBindEndpoints() {
-    register int i;
-
-    /* Get all nic address from all of the other ranks */
-    unsigned int local_addr = get_gni_nic_address(0);
+    int i;
 
-    /* Allocate a buffer to hold the nic address from all of the other  ranks. */
+    /* Filled in by the bootstrap exchange. */
     all_nic_addresses = (unsigned int *) malloc(sizeof(unsigned int) * world_size);
     assert(all_nic_addresses != NULL);
+    for (i = 0; i < world_size; i++)
+	all_nic_addresses[i] = UGNI_NIC_ADDR_UNKNOWN;
+    all_nic_addresses[world_rank] = get_gni_nic_address(0);
 
-    /* Get the nic addresses from all of the other ranks.*/
-    allgather(&local_addr, all_nic_addresses, sizeof(int));
+    /* A NULL handle marks an endpoint that has not been bound yet. */
+    peers.init(world_size);
 
-    /* Allocate the endpoint handles array. */
-    endpoint_handles_array = (gni_ep_handle_t *) calloc(world_size, sizeof(gni_ep_handle_t));
-    assert(endpoint_handles_array != NULL);
+    ep_lru_prev = (int *) malloc(2 * world_size * sizeof(int));
+    assert(ep_lru_prev != NULL);
+    ep_lru_next = ep_lru_prev + world_size;
+    for (i = 0; i < 2 * world_size; i++)
+	ep_lru_prev[i] = -1;
 
-    // Create logical endpoint and bind it to a corresponding 
-    for (i = 0; i < world_size; i++) {
-	if (i == world_rank) {
-	    continue;
-	}
+    ep_event_data = (uint32_t *) malloc(world_size * sizeof(uint32_t));
+    assert(ep_event_data != NULL);
+}
 
-	// Create the logical endpoints
-	gni_return_t status = GNI_EpCreate(nic_handle, cq_handle, &endpoint_handles_array[i]);
-	if (status != GNI_RC_SUCCESS) {
-	    fprintf(stdout, "[%s] Rank: %4i GNI_EpCreate ERROR status: %d\n", uts_info.nodename, world_rank, status);
-	}
+/*
+ * NIC address of a peer, known once uGNI_regAndExchangeMem has run. The
+ * table is not written after that, so thread contexts binding endpoints
+ * lazily may call this concurrently without a lock or atomics.
+ */
+unsigned int Node::uGNI_nicAddress(int rank) {
+    if (all_nic_addresses[rank] == UGNI_NIC_ADDR_UNKNOWN) {
+	fprintf(stdout, "[%s] Rank: %4i NIC address of rank %d used before uGNI_regAndExchangeMem\n", uts_info.nodename, world_rank, rank);
+	PMI_Abort(-1, "NIC address unknown");
+    }
+    return all_nic_addresses[rank];
+}
 
-	// Bind the remote address to the endpoint handler.
-	status = GNI_EpBind(endpoint_handles_array[i], all_nic_addresses[i], i);
-	if (status != GNI_RC_SUCCESS) {
-	    fprintf(stdout, "[%s] Rank: %4i GNI_EpBind ERROR status: %d\n", uts_info.nodename, world_rank, status);
+/*
+ * Create and bind the endpoint to a peer.
+ */
+void Node::uGNI_bindEndpoint(int rank) {
+    gni_ep_handle_t ep;
+
+    gni_return_t status = GNI_EpCreate(nic_handle, cq_handle, &ep);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_EpCreate ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	return;
+    }
+
+    // Bind the remote address to the endpoint handler.
+    status = GNI_EpBind(ep, uGNI_nicAddress(rank), rank);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_EpBind ERROR status: %d\n", uts_info.nodename, world_rank, status);
+    }
+
+    // Local events carry the peer's rank and remote events carry ours, so
+    // both sides can attribute an event to a peer from its inst_id. A post
+    // may ask for other remote event data, see uGNI_postEndpoint.
+    status = GNI_EpSetEventData(ep, rank, world_rank);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_EpSetEventData ERROR status: %d\n", uts_info.nodename, world_rank, status);
+    }
+    ep_event_data[rank] = world_rank;
+
+    peers[rank].ep = ep;
+    endpoints_bound++;
+}
+
+/*
+ * Cap the number of endpoints bound at any time. Beyond the cap, the
+ * least recently used idle endpoint is unbound to make room for a new one.
+ */
+void Node::uGNI_setEndpointCacheLimit(int limit) {
+    ep_cache_limit = limit;
+}
+
+static inline void lru_unlink(int *prev, int *next, int *head, int *tail, int rank) {
+    if (prev[rank] >= 0)
+	next[prev[rank]] = next[rank];
+    else
+	*head = next[rank];
+    if (next[rank] >= 0)
+	prev[next[rank]] = prev[rank];
+    else
+	*tail = prev[rank];
+    prev[rank] = -1;
+    next[rank] = -1;
+}
+
+static inline void lru_push_front(int *prev, int *next, int *head, int *tail, int rank) {
+    prev[rank] = -1;
+    next[rank] = *head;
+    if (*head >= 0)
+	prev[*head] = rank;
+    else
+	*tail = rank;
+    *head = rank;
+}
+
+void Node::uGNI_touchEndpoint(int rank) {
+    lru_unlink(ep_lru_prev, ep_lru_next, &ep_lru_head, &ep_lru_tail, rank);
+    lru_push_front(ep_lru_prev, ep_lru_next, &ep_lru_head, &ep_lru_tail, rank);
+}
+
+/*
+ * Endpoint cache miss: make room if the cache is full, then bind. Waiting
+ * for room polls the CQs, and reposting queued posts from there may miss
+ * again; such a nested miss binds over the cap instead of evicting.
+ */
+gni_ep_handle_t Node::uGNI_missEndpoint(int rank) {
+    int wait_count = 0;
+
+    ep_misses++;
+
+    if (ep_evicting) {
+	if (ep_cache_limit > 0 && ep_cache_size >= ep_cache_limit)
+	    ep_overflows++;
+    } else {
+	ep_evicting = true;
+	while (ep_cache_limit > 0 && ep_cache_size >= ep_cache_limit) {
+	    if (uGNI_evictEndpoint())
+		continue;
+
+	    // Every cached endpoint still has events in flight. The progress
+	    // thread cannot wait for them, as it is the one that would reap them.
+	    if (progress_running.load(std::memory_order_relaxed) ||
+		    (uGNI_progress() == 0 && uGNI_backoff(1, &wait_count) != 0)) {
+		ep_overflows++;
+		break;
+	    }
 	}
+	ep_evicting = false;
+
+	// A nested miss may have bound it meanwhile.
+	if (peers[rank].ep != NULL)
+	    return peers[rank].ep;
     }
+
+    uGNI_bindEndpoint(rank);
+    if (peers[rank].ep == NULL)
+	return NULL;
+
+    lru_push_front(ep_lru_prev, ep_lru_next, &ep_lru_head, &ep_lru_tail, rank);
+    ep_cache_size++;
+
+    return peers[rank].ep;
+}
+
+/*
+ * Unbind and destroy the least recently used endpoint that has nothing
+ * in flight: every post to the peer was reaped and none is queued. An
+ * endpoint with events outstanding can not be unbound, so every post on
+ * a node endpoint must go through the node (uGNI_post, uGNI_postRdma and
+ * friends) to be counted in send_inflight.
+ *
+ *   Returns: true if an endpoint was evicted.
+ */
+bool Node::uGNI_evictEndpoint() {
+    gni_return_t status;
+    int p;
+
+    for (p = ep_lru_tail; p >= 0; p = ep_lru_prev[p]) {
+	if (send_inflight[p] == 0 && pending_head[p] == NULL)
+	    break;
+    }
+    if (p < 0)
+	return false;
+
+    status = GNI_EpUnbind(peers[p].ep);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_EpUnbind      ERROR remote rank: %4i status: %d\n", uts_info.nodename, world_rank, p, status);
+	return false;
+    }
+
+    status = GNI_EpDestroy(peers[p].ep);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_EpDestroy     ERROR remote rank: %4i status: %d\n", uts_info.nodename, world_rank, p, status);
+    }
+
+    peers[p].ep = NULL;
+    lru_unlink(ep_lru_prev, ep_lru_next, &ep_lru_head, &ep_lru_tail, p);
+    ep_cache_size--;
+    ep_evictions++;
+
+    return true;
+}
+
+void Node::uGNI_printEndpointStats() {
+    uint64_t lookups = ep_hits + ep_misses;
+
+    printf("rank %d endpoints bound %lu cached %d limit %d hits %lu misses %lu hit rate %.2f%% evictions %lu overflows %lu\n",
+	    world_rank, endpoints_bound, ep_cache_size, ep_cache_limit, ep_hits, ep_misses,
+	    lookups > 0 ? 100.0 * ep_hits / lookups : 0.0, ep_evictions, ep_overflows);
 }
 
 void Node::uGNI_createBasicCQ(int number_of_cq_entries, int number_of_dest_cq_entries) {
-    gni_return_t status = GNI_CqCreate(nic_handle, number_of_cq_entries, 0, GNI_CQ_NOBLOCK, NULL, NULL, &cq_handle);
+    this->number_of_cq_entries = number_of_cq_entries;
+    this->number_of_dest_cq_entries = number_of_dest_cq_entries;
+
+    // A CQ is only created blocking when its wait policy sleeps in GNI_CqWait.
+    cq_wait[1].blocking = (cq_wait[1].policy == UGNI_WAIT_SPIN_BLOCK);
+    cq_wait[0].blocking = (cq_wait[0].policy == UGNI_WAIT_SPIN_BLOCK);
+
+    gni_return_t status = GNI_CqCreate(nic_handle, number_of_cq_entries, 0,
+	    cq_wait[1].blocking ? GNI_CQ_BLOCKING : GNI_CQ_NOBLOCK, NULL, NULL, &cq_handle);
     if (status != GNI_RC_SUCCESS) {
 	fprintf(stdout, "[%s] Rank: %4i GNI_CqCreate source ERROR status: %d\n", uts_info.nodename, world_rank, status);
     }
 
-    status = GNI_CqCreate(nic_handle, number_of_dest_cq_entries, 0, GNI_CQ_NOBLOCK, NULL, NULL, &destination_cq_handle);
+    status = GNI_CqCreate(nic_handle, number_of_dest_cq_entries, 0,
+	    cq_wait[0].blocking ? GNI_CQ_BLOCKING : GNI_CQ_NOBLOCK, NULL, NULL, &destination_cq_handle);
     if (status != GNI_RC_SUCCESS) {
 	fprintf(stdout,
 		"[%s] Rank: %4i GNI_CqCreate      destination ERROR status: %d\n",
@@ -129,19 +464,134 @@ void Node::uGNI_regAndExchangeMem(void *send_buf, int send_length, void *recv_bu
 		"[%s] Rank: %4i GNI_MemRegister   receive_buffer ERROR status: %d\n",
 		uts_info.nodename, world_rank, status);
     }
+    send_buffer_addr = (uint64_t)send_buf;
     my_memory_handle.addr = (uint64_t)recv_buf;
+    send_buffer_length = send_length;
+    recv_buffer_length = recv_length;
     my_memory_handle.mdh = recv_mem_handle;
 
+    uGNI_regSyncRegion();
+    uGNI_getTopoInfo();
+
     /*
-     * Gather up all of the remote memory handle's.
+     * Exchange everything the peers need to know about us in one go:
+     * NIC address, placement and memory handles.
      * This also acts as a barrier to get all of the ranks to sync up.
      */
 
-    allgather(&my_memory_handle, remote_memory_handle_array, sizeof(mdh_addr_t));
+    bootstrap_rec_t my_record;
+    memset(&my_record, 0, sizeof(my_record));
+    my_record.rank = world_rank;
+    my_record.nic_addr = all_nic_addresses[world_rank];
+    my_record.nid = nid;
+    my_record.coord = coord;
+    my_record.mem = my_memory_handle;
+    my_record.sync.addr = (uint64_t) sync_region;
+    my_record.sync.mdh = sync_mem_handle;
+
+    // The node bootstrap also lays out the tables below, once per node.
+    if (bootstrap_mode == UGNI_BOOTSTRAP_NODE) {
+	uGNI_bootstrapNode(&my_record);
+    } else {
+	bootstrap_table = (bootstrap_rec_t *) malloc(world_size * sizeof(bootstrap_rec_t));
+	assert(bootstrap_table != NULL);
+	allgather(&my_record, bootstrap_table, sizeof(bootstrap_rec_t));
+
+	for (int i = 0; i < world_size; i++) {
+	    all_nic_addresses[i] = bootstrap_table[i].nic_addr;
+	    remote_memory_handle_array[i] = bootstrap_table[i].mem;
+	    remote_sync_array[i] = bootstrap_table[i].sync;
+	}
+    }
+
+    // Posts copy a peer's entry on first use, see peer.h.
+    peers.attach(remote_memory_handle_array);
+}
+
+/*
+ * Post a descriptor whose completion the caller follows through the
+ * per-peer counters, e.g. with uGNI_waitAllSendDone, which also reports a
+ * post that failed later. A post the NIC has no resources for is queued
+ * and reposted from uGNI_progress. The post_id of the descriptor is
+ * overwritten with an internal request handle, and its delivery mode with
+ * the peer's, see uGNI_setDeliveryMode.
+ */
+gni_return_t Node::uGNI_post(int dest_rankId, gni_post_descriptor_t *desc) {
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, dest_rankId);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    e->desc = desc;
+    e->internal = 1;
+    e->counted = 1;
+    desc->post_id = req;
+    uGNI_applyDelivery(dest_rankId, e, desc);
+
+    gni_return_t status = uGNI_submit(dest_rankId, desc);
+    if (status != GNI_RC_SUCCESS) {
+	requests.release(req);
+	return status;
+    }
+
+    if (overrun_recovery && (desc->cq_mode & GNI_CQMODE_REMOTE_EVENT))
+	uGNI_postSeq(dest_rankId, 0);
+
+    return status;
+}
+
+/*
+ * Post a descriptor to a peer and track it in the request table. The
+ * descriptor must stay valid until the returned request completes; its
+ * post_id is overwritten with the request handle and its delivery mode
+ * with the peer's. A remote event is counted in the given arrival stream
+ * at the peer.
+ */
+uGNI_req_t Node::uGNI_postRdma(int dest_rankId, gni_post_descriptor_t *desc, int stream) {
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, dest_rankId);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    e->desc = desc;
+    desc->post_id = req;
+    uGNI_applyDelivery(dest_rankId, e, desc);
+
+    gni_return_t status = uGNI_submit(dest_rankId, desc, UGNI_EVENT_DATA(stream, world_rank));
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	postRdmaStatus(status);
+	requests.release(req);
+	return UGNI_REQ_NULL;
+    }
+
+    if (overrun_recovery && (desc->cq_mode & GNI_CQMODE_REMOTE_EVENT))
+	uGNI_postSeq(dest_rankId, stream);
+
+    return req;
+}
+
+/*
+ * Put length bytes from the registered send buffer into the peer's
+ * registered receive buffer, raising an event on both sides.
+ */
+uGNI_req_t Node::uGNI_put(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length) {
+    return uGNI_postT<PutSignalPost>(dest_rankId, send_buffer_addr + local_offset, send_mem_handle, remote_offset, length);
 }
 
-void Node::uGNI_put() {
+/*
+ * Get length bytes from the peer's registered receive buffer into our own
+ * receive buffer. Only a local event is raised. Offsets and length must be
+ * 4 byte aligned.
+ */
+uGNI_req_t Node::uGNI_get(int src_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length) {
+    return uGNI_postT<GetPost>(src_rankId, my_memory_handle.addr + local_offset, recv_mem_handle, remote_offset, length);
+}
 
+/*
+ * Claim the next num_events destination events from a peer. The request
+ * completes once that many events from the peer have arrived, whatever
+ * the order relative to events from other peers.
+ */
+uGNI_req_t Node::uGNI_irecv(int source_rankId, int num_events) {
+    uGNI_req_t req = requests.alloc(UGNI_REQ_RECV, source_rankId);
+    recv_expected[source_rankId] += num_events;
+    requests.lookup(req)->target = recv_expected[source_rankId];
+    return req;
 }
 
 void Node::uGNI_finalize() {
@@ -156,10 +606,74 @@ void Node::uGNI_finalize() {
     int v_option = 0;
     gni_return_t status = GNI_RC_SUCCESS;
 
-    int rc = PMI_Barrier();
-    assert(rc == PMI_SUCCESS);
+    uGNI_stopProgressThread();
+
+    for (i = 0; i < UGNI_MAX_THREAD_CONTEXTS; i++) {
+	if (thread_contexts[i] != NULL)
+	    thread_contexts[i]->uGNI_destroy();
+    }
+    num_channels = 0;
+
+    // Without a sync region the ranks never exchanged memory; use PMI.
+    // The barrier's own writes may still be in flight afterwards, and the
+    // sync region and request table must outlive every post.
+    if (sync_region != NULL) {
+	int wait_count = 0;
+
+	if (uGNI_barrier() != 0)
+	    fprintf(stdout, "[%s] Rank: %4i uGNI_barrier      ERROR at finalize\n", uts_info.nodename, world_rank);
+	for (i = 0; i < world_size; ) {
+	    if (send_inflight[i] == 0 && pending_head[i] == NULL) {
+		i++;
+	    } else if (uGNI_progress() > 0) {
+		wait_count = 0;
+	    } else if (uGNI_backoff(1, &wait_count) != 0) {
+		fprintf(stdout, "[%s] Rank: %4i posts to rank %4i still in flight at finalize\n", uts_info.nodename, world_rank, i);
+		i++;
+	    }
+	}
+    } else {
+	int rc = PMI_Barrier();
+	assert(rc == PMI_SUCCESS);
+    }
 
-    free(remote_memory_handle_array);
+    // Tables in the node's shared segment go away with uGNI_bootstrapDestroy.
+    if (boot_shm == NULL)
+	free(remote_memory_handle_array);
+
+    if (sync_region != NULL) {
+	status = GNI_MemDeregister(nic_handle, &sync_mem_handle);
+	if (status != GNI_RC_SUCCESS) {
+	    fprintf(stdout,
+		    "[%s] Rank: %4i GNI_MemDeregister sync_region ERROR status: %d\n",
+		    uts_info.nodename, world_rank, status);
+	}
+	free(sync_region);
+	if (boot_shm == NULL)
+	    free(remote_sync_array);
+    }
+    if (coll_running != NULL)
+	fprintf(stdout, "[%s] Rank: %4i non-blocking collectives still running at finalize\n",
+		uts_info.nodename, world_rank);
+    if (pending_count > 0)
+	fprintf(stdout, "[%s] Rank: %4i %lu posts still queued for NIC resources at finalize\n",
+		uts_info.nodename, world_rank, pending_count);
+    while (pending_free != NULL) {
+	pending_post_t *q = pending_free;
+	pending_free = q->next;
+	free(q);
+    }
+    free(pending_head);
+
+    free(send_completed);
+    for (i = 1; i < UGNI_MAX_STREAMS; i++)
+	free(streams[i].arrived);
+    free(flushes);
+    free(peer_dlvr);
+    free(recv_tags);
+    free(a2a_order);
+    free(lat_ewma_ns);
+    requests.destroy();
 
     /*
      * Deregister the memory associated for the receive buffer with the NIC.
@@ -210,7 +724,7 @@ void Node::uGNI_finalize() {
 	    continue;
 	}
 
-	if (endpoint_handles_array[i] == 0) {
+	if (peers[i].ep == 0) {
 
 	    /*
 	     * This endpoint does not exist.
@@ -221,10 +735,10 @@ void Node::uGNI_finalize() {
 
 	/*
 	 * Unbind the remote address from the endpoint handler.
-	 *     endpoint_handles_array is the endpoint handle that is being unbound
+	 *     peers[i].ep is the endpoint handle that is being unbound
 	 */
 
-	status = GNI_EpUnbind(endpoint_handles_array[i]);
+	status = GNI_EpUnbind(peers[i].ep);
 	if (status != GNI_RC_SUCCESS) {
 	    fprintf(stdout,
 		    "[%s] Rank: %4i GNI_EpUnbind      ERROR remote rank: %4i status: %d\n",
@@ -236,18 +750,18 @@ void Node::uGNI_finalize() {
 	    fprintf(stdout,
 		    "[%s] Rank: %4i GNI_EpUnbind      remote rank: %4i EP:  %p\n",
 		    uts_info.nodename, world_rank, i,
-		    endpoint_handles_array[i]);
+		    peers[i].ep);
 	}
 
 	/*
 	 * You must do an EpDestroy for each endpoint pair.
 	 *
 	 * Destroy the logical endpoint for each rank.
-	 *     endpoint_handles_array is the endpoint handle that is being
+	 *     peers[i].ep is the endpoint handle that is being
 	 *         destroyed.
 	 */
 
-	status = GNI_EpDestroy(endpoint_handles_array[i]);
+	status = GNI_EpDestroy(peers[i].ep);
 	if (status != GNI_RC_SUCCESS) {
 	    fprintf(stdout,
 		    "[%s] Rank: %4i GNI_EpDestroy     ERROR remote rank: %4i status: %d\n",
@@ -259,7 +773,7 @@ void Node::uGNI_finalize() {
 	    fprintf(stdout,
 		    "[%s] Rank: %4i GNI_EpDestroy     remote rank: %4i EP:  %p\n",
 		    uts_info.nodename, world_rank, i,
-		    endpoint_handles_array[i]);
+		    peers[i].ep);
 	}
     }
 
@@ -268,7 +782,14 @@ void Node::uGNI_finalize() {
      * Free allocated memory.
      */
 
-    free (endpoint_handles_array);
+    peers.destroy();
+    free(ep_lru_prev);
+    free(ep_event_data);
+    if (boot_shm == NULL)
+	free(all_nic_addresses);
+    uGNI_hierDestroy();
+    uGNI_bootstrapDestroy();
+    free(local_ranks);
 
     if (destination_cq_handle != NULL) {
 	/*
@@ -324,36 +845,41 @@ void Node::uGNI_finalize() {
  * been sent.  The source completion queue needs to be checked and
  * events to be removed so that it does not become full and cause
  * succeeding calls to PostRdma to fail.
+ *
+ * Sends are counted per peer, so completions for other peers that show up
+ * first are kept for their own waits instead of being reported as errors.
+ * Only posts made with uGNI_post are counted; those the node makes for
+ * itself, or with uGNI_postRdma and friends, are followed through their
+ * requests. Both completion queues are drained. A failed post counts as
+ * waited for once a wait has reported it. The sends a wait timed out on
+ * are still owed to the next wait on the peer.
+ *
+ *   Returns: 0 on success, 1 if a post to the peer failed, 3 if no event
+ *            was received in time.
  */
-void Node::uGNI_waitSendDone(int send_to, gni_cq_handle_t cq_handle) {
-    gni_cq_entry_t  current_event;
-    int             event_id;
-    gni_post_descriptor_t *event_post_desc_ptr;
-    int 		rc;
+int Node::uGNI_waitSendDone(int send_to) {
+    return uGNI_waitAllSendDone(send_to, 1);
+}
 
-    rc = uGNI_get_cq_event(cq_handle, 1, 1, &current_event);
+int Node::uGNI_waitAllSendDone(int sent_to, int queue_size) {
+    int wait_count = 0;
 
-    //An event was received. Complete the event, which removes the current event's post descriptor from the event queue.
-    if (rc == 0) {
-	gni_return_t status = GNI_GetCompleted(cq_handle, current_event, &event_post_desc_ptr);
-	if (status != GNI_RC_SUCCESS) {
-	    fprintf(stdout,	"[%s] Rank: %4i GNI_GetCompleted  data ERROR status: %d\n", uts_info.nodename, world_rank, status);
-	} else {
-	    //Validate the current event's instance id with the expected id.
-	    event_id = GNI_CQ_GET_INST_ID(current_event);
-	    if (event_id != send_to) {
-		// The event's inst_id was not the expected inst_id value.
-		fprintf(stdout, "[%s] Rank: %4i CQ Event data ERROR received inst_id: %d, expected inst_id: %d in event_data\n", uts_info.nodename, world_rank, event_id, send_to);
-	    }
-	   // printf("Rank %d done sending\n", world_rank);
+    send_expected[sent_to] += queue_size;
+    while (send_completed[sent_to] + send_failed[sent_to] < send_expected[sent_to]) {
+	if (uGNI_progress() > 0) {
+	    wait_count = 0;
+	} else if (uGNI_backoff(1, &wait_count) != 0) {
+	    fprintf(stderr,"[%s] Rank: %4i CQ Event ERROR source queue did not complete sends to rank %d\n", uts_info.nodename, world_rank, sent_to);
+	    return 3;
 	}
     }
-}
 
-void Node::uGNI_waitAllSendDone(int sent_to, gni_cq_handle_t cq_handle, int queue_size) {
-    int i = 0;
-    for(i = 0; i < queue_size; i++)
-	uGNI_waitSendDone(sent_to, cq_handle);
+    if (send_failed[sent_to] != 0) {
+	send_completed[sent_to] += send_failed[sent_to];
+	send_failed[sent_to] = 0;
+	return 1;
+    }
+    return 0;
 }
 
 /*
@@ -362,31 +888,529 @@ void Node::uGNI_waitAllSendDone(int sent_to, gni_cq_handle_t cq_handle, int queu
  * checked and events to be removed so that it does not become full
  * and cause succeeding events to be lost.
  */
-void Node::uGNI_waitRecvDone(int receive_from, gni_cq_handle_t cq_handle) {
-    gni_cq_entry_t  current_event;
-    int             event_id;
-    int 		rc;
-
-    rc = uGNI_get_cq_event(cq_handle, 0, 1, &current_event);
-
-    //An event was received.Validate the current event's instance id with the expected id.
-    if (rc == 0) {
-	event_id = GNI_CQ_GET_INST_ID(current_event);
-	if (event_id != receive_from) {
-	    // The event's inst_id was not the expected inst_id value.
-	   // fprintf(stdout, "[%s] Rank: %4i CQ Event destination ERROR received inst_id: %d, expected inst_id: %d in event_data\n", uts_info.nodename, world_rank, event_id, receive_from);
-	}
-	//printf("Rank %d done receiving\n", world_rank);
-    } else {		 
+void Node::uGNI_waitRecvDone(int receive_from) {
+    uGNI_waitAllRecvDone(receive_from, 1);
+}
+
+void Node::uGNI_waitAllRecvDone(int recv_from, int queue_size) {
+    uGNI_req_t req = uGNI_irecv(recv_from, queue_size);
+
+    if (uGNI_wait(&req) != 0) {
 	//An error occurred while receiving the event.
 	fprintf(stderr,"[%s] Rank: %4i CQ Event ERROR destination queue did not receieve data event\n", uts_info.nodename, world_rank);
+	recv_expected[recv_from] = recv_arrived[recv_from];
+    }
+}
+
+/*
+ * Complete a source event: hand the descriptor back from the NIC and
+ * complete its post with the status the NIC reports. An error event fails
+ * its post even when GNI_GetCompleted does not say so. Called only by the
+ * owner of the NIC, as it takes the post off send_inflight.
+ */
+void Node::uGNI_handleSendEvent(gni_cq_entry_t event) {
+    gni_post_descriptor_t *event_post_desc_ptr = NULL;
+
+    int peer = GNI_CQ_GET_INST_ID(event);
+
+    gni_return_t status = GNI_GetCompleted(cq_handle, event, &event_post_desc_ptr);
+    if (status == GNI_RC_SUCCESS && !GNI_CQ_STATUS_OK(event))
+	status = GNI_RC_TRANSACTION_ERROR;
+
+    // A flush get of overrun recovery keeps its own books.
+    if (uGNI_flushDone(event_post_desc_ptr, status))
+	return;
+
+    if (peer >= 0 && peer < world_size && send_inflight[peer] > 0)
+	send_inflight[peer]--;
+
+    if (status != GNI_RC_SUCCESS && event_post_desc_ptr == NULL) {
+	fprintf(stdout,	"[%s] Rank: %4i GNI_GetCompleted  data ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	return;
+    }
+
+    uGNI_completeSend(peer, event_post_desc_ptr, status);
+}
+
+void Node::uGNI_handleRecvEvent(gni_cq_entry_t event) {
+    uGNI_completeRecv(GNI_CQ_GET_INST_ID(event));
+}
+
+/*
+ * Complete a post: flag its request, found directly from the post_id. A
+ * post made with uGNI_post is also counted for its peer, in send_failed
+ * if it failed and in send_completed otherwise; the request of any other
+ * post carries the error to the wait that retires it.
+ */
+void Node::uGNI_completeSend(int peer, gni_post_descriptor_t *desc, gni_return_t status) {
+    if (status != GNI_RC_SUCCESS)
+	fprintf(stdout, "[%s] Rank: %4i post to rank %4i ERROR status: %d\n", uts_info.nodename, world_rank, peer, status);
+
+    uGNI_req_entry_t *e = requests.lookup(desc->post_id);
+    if (e != NULL && e->desc == desc) {
+	if (e->counted) {
+	    if (status != GNI_RC_SUCCESS)
+		send_failed[e->peer]++;
+	    else
+		send_completed[e->peer]++;
+	}
+	if (e->post_ns != 0 && status == GNI_RC_SUCCESS)
+	    uGNI_recordLatency(peer, e->post_ns);
+	if (e->internal) {
+	    requests.release(desc->post_id);
+	} else {
+	    e->error = status;
+	    requests.complete(desc->post_id);
+	}
+    }
+}
+
+/*
+ * Count a destination event in the arrival stream and for the peer its
+ * event data names, or queue its tag.
+ */
+void Node::uGNI_completeRecv(uint32_t event_data) {
+    uint32_t peer = event_data & UGNI_STREAM_RANK_MASK;
+    int stream = (event_data >> UGNI_STREAM_SHIFT) & (UGNI_MAX_STREAMS - 1);
+
+    if (event_data & UGNI_EVENT_TAG) {
+	uGNI_pushTag(event_data & ~UGNI_EVENT_TAG);
+    } else if (peer < (uint32_t) world_size && event_data < (UGNI_MAX_STREAMS << UGNI_STREAM_SHIFT)) {
+	uGNI_stream(stream)->arrived[peer]++;
+    } else {
+	fprintf(stdout, "[%s] Rank: %4i CQ Event destination ERROR unexpected inst_id: %u in event_data\n", uts_info.nodename, world_rank, event_data);
+    }
+}
+
+/*
+ * The counters of an arrival stream, allocated on first use: a peer may
+ * put on a stream before this rank has taken it up itself.
+ */
+stream_t *Node::uGNI_stream(int stream) {
+    stream_t *s = &streams[stream];
+
+    if (s->arrived == NULL) {
+	s->arrived = (uint64_t *) calloc(4 * world_size, sizeof(uint64_t));
+	assert(s->arrived != NULL);
+	s->expected = s->arrived + world_size;
+	s->seq_sent = s->expected + world_size;
+	s->seq_snapshot = s->seq_sent + world_size;
+    }
+    return s;
+}
+
+/*
+ * Hold the lowest free stream for a persistent operation. Every rank must
+ * take and free held streams in the same order, so that sender and
+ * receiver agree on the stream of each operation.
+ *
+ *   Returns: the stream.
+ */
+int Node::uGNI_streamAlloc() {
+    int stream;
+
+    for (stream = 1; stream < UGNI_STREAMS_HELD; stream++) {
+	if (!(streams_held & (1ULL << stream))) {
+	    streams_held |= 1ULL << stream;
+	    uGNI_stream(stream);
+	    return stream;
+	}
+    }
+    fprintf(stdout, "[%s] Rank: %4i ERROR all %d arrival streams are held\n", uts_info.nodename, world_rank, UGNI_STREAMS_HELD - 1);
+    abort();
+}
+
+void Node::uGNI_streamFree(int stream) {
+    if (stream > 0 && stream < UGNI_STREAMS_HELD)
+	streams_held &= ~(1ULL << stream);
+}
+
+/*
+ * Drain both completion queues without blocking.
+ *
+ *   Returns: the number of events processed.
+ */
+int Node::uGNI_progress() {
+    gni_cq_entry_t  event;
+    int             processed = 0;
+    int             rc;
+
+    // The progress thread owns the CQs, apply what it reaped.
+    if (progress_running.load(std::memory_order_relaxed)) {
+	progress_completion_t c;
+
+	while (completion_ring->pop(&c))
+	    processed += uGNI_applyCompletion(&c);
+	if (coll_running != NULL)
+	    processed += uGNI_advanceCollectives();
+	return processed;
+    }
+
+    // An error event still names its post; fail it and keep draining.
+    while ((rc = uGNI_get_cq_event(cq_handle, 1, 0, &event)) == 0 || rc == 1) {
+	uGNI_handleSendEvent(event);
+	processed++;
+    }
+
+    if (rc == 2) {
+	cq_wait[1].overruns++;
+	uGNI_recoverSendOverrun();
+    } else if (flush_retry) {
+	uGNI_retryFlushes();
+    }
+
+    if (destination_cq_handle != NULL) {
+	// A destination error event carries no arrival we can trust; drop it.
+	while ((rc = uGNI_get_cq_event(destination_cq_handle, 0, 0, &event)) == 0 || rc == 1) {
+	    if (rc == 0)
+		uGNI_handleRecvEvent(event);
+	    processed++;
+	}
+
+	if (rc == 2) {
+	    cq_wait[0].overruns++;
+	    if (!in_recovery)
+		uGNI_recoverRecvOverrun();
+	}
+    }
+
+    // Completions free NIC resources; retry the posts that waited for them.
+    if (pending_count > 0)
+	processed += uGNI_repostPending(-1);
+
+    if (coll_running != NULL)
+	processed += uGNI_advanceCollectives();
+
+    return processed;
+}
+
+/*
+ * Called by the wait loops after a poll of both queues found nothing.
+ * Waits according to the policy of the queue being waited on; an event
+ * delivered by a blocking wait is processed here.
+ *
+ *   Returns: 1 once the retry budget is exhausted, 0 otherwise.
+ */
+int Node::uGNI_backoff(unsigned int source_cq, int *wait_count) {
+    gni_cq_entry_t  event;
+    int             rc;
+
+    // After a destination overrun, events may be gone for good; keep
+    // folding in the sequence counters while we wait.
+    if (overrun_recovery && cq_wait[0].overruns > 0 && !in_recovery && !recv_resyncing)
+	uGNI_recoverRecvOverrun();
+
+    if (source_cq == UGNI_BOTH_CQ || progress_running.load(std::memory_order_relaxed)) {
+	rc = uGNI_cqIdle(NULL, UGNI_BOTH_CQ, wait_count, &event);
+    } else if (source_cq == 1) {
+	rc = uGNI_cqIdle(cq_handle, 1, wait_count, &event);
+	if (rc == 0)
+	    uGNI_handleSendEvent(event);
+    } else {
+	rc = uGNI_cqIdle(destination_cq_handle, 0, wait_count, &event);
+	if (rc == 0)
+	    uGNI_handleRecvEvent(event);
+    }
+
+    if (rc == 0)
+	*wait_count = 0;
+
+    if (rc == 3) {
+	fprintf(stderr,
+		"[%s] Rank: %4i uGNI_wait         ERROR no event was received retry count: %d\n",
+		uts_info.nodename, world_rank, *wait_count);
+	return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Spend the time between two polls of a completion queue as its wait
+ * policy says. A wait on both queues (UGNI_BOTH_CQ, cq_handle NULL) uses
+ * the source policy but never blocks, since GNI_CqWait covers one queue.
+ *
+ *   Returns: 0 if a blocking wait returned next_event
+ *            1 if the caller should poll again
+ *            3 once the retry budget is exhausted, which prevents an
+ *              indefinite retry that could hang the application
+ */
+int Node::uGNI_cqIdle(gni_cq_handle_t cq_handle, unsigned int source_cq, int *wait_count, gni_cq_entry_t *next_event) {
+    cq_wait_t *w = &cq_wait[source_cq == 0 ? 0 : 1];
+    uGNI_wait_policy_t policy = w->policy;
+
+    if (policy == UGNI_WAIT_SPIN_BLOCK && (source_cq == UGNI_BOTH_CQ || !w->blocking))
+	policy = UGNI_WAIT_SPIN_YIELD;
+
+    (*wait_count)++;
+
+    if (*wait_count <= w->spin_limit || policy == UGNI_WAIT_SPIN) {
+	w->spins++;
+	return (*wait_count >= w->max_polls) ? 3 : 1;
+    }
+
+    if (policy == UGNI_WAIT_SPIN_YIELD) {
+	if (*wait_count >= w->max_polls)
+	    return 3;
+
+	/*
+	 * Release the cpu to allow the event to be received.
+	 * This is basically a sleep, if other processes need to do some work.
+	 */
+
+	if ((*wait_count % (MAXIMUM_CQ_RETRY_COUNT / 10)) == 0) {
+	    w->sleeps++;
+	    usleep(50);
+	} else {
+	    w->yields++;
+	    sched_yield();
+	}
+	return 1;
+    }
+
+    /*
+     * Sleep in the kernel until the NIC raises an interrupt for this
+     * queue. Past the spin limit every call counts as one timeout slot.
+     */
+
+    w->blocks++;
+    gni_return_t status = GNI_CqWait(cq_handle, w->timeout_ms, next_event);
+    if (status == GNI_RC_SUCCESS)
+	return 0;
+
+    if (status == GNI_RC_TIMEOUT) {
+	w->timeouts++;
+    } else if (status != GNI_RC_NOT_DONE) {
+	fprintf(stdout,
+		"[%s] Rank: %4i GNI_CqWait        ERROR status: %d event: 0x%16.16lx\n",
+		uts_info.nodename, world_rank, status, *next_event);
+    }
+
+    return (*wait_count - w->spin_limit >= MAXIMUM_CQ_WAIT_TIMEOUTS) ? 3 : 1;
+}
+
+void Node::uGNI_printWaitStats() {
+    const char *names[] = { "spin", "spin-yield", "spin-block" };
+    const char *queues[] = { "destination", "source" };
+    int i;
+
+    for (i = 1; i >= 0; i--) {
+	printf("rank %d %-11s CQ wait policy %s spins %lu yields %lu sleeps %lu blocks %lu timeouts %lu overruns %lu\n",
+		world_rank, queues[i], names[cq_wait[i].policy],
+		cq_wait[i].spins, cq_wait[i].yields, cq_wait[i].sleeps,
+		cq_wait[i].blocks, cq_wait[i].timeouts, cq_wait[i].overruns);
+    }
+    printf("rank %d posts queued for NIC resources %lu still queued %lu\n",
+	    world_rank, pending_queued, pending_count);
+}
+
+// Queues a pending request waits on; collectives need both.
+#define WAIT_DEST_CQ   (1 << 0)
+#define WAIT_SOURCE_CQ (1 << 1)
+#define WAIT_BOTH_CQ   (1 << 2)
+
+static inline int request_cq(RequestTable &requests, uGNI_req_t req) {
+    uGNI_req_entry_t *e = requests.lookup(req);
+    if (e != NULL && e->type == UGNI_REQ_COLL)
+	return WAIT_BOTH_CQ;
+    return (e != NULL && e->type == UGNI_REQ_SEND) ? WAIT_SOURCE_CQ : WAIT_DEST_CQ;
+}
+
+// Map the set of queues pending requests wait on to a backoff target.
+static inline unsigned int wait_cq(int pending_cqs) {
+    if (pending_cqs == WAIT_SOURCE_CQ)
+	return 1;
+    if (pending_cqs == WAIT_DEST_CQ)
+	return 0;
+    return UGNI_BOTH_CQ;
+}
+
+static inline bool request_done(RequestTable &requests, uint64_t *recv_arrived, uGNI_req_t req) {
+    uGNI_req_entry_t *e = requests.lookup(req);
+
+    if (e == NULL)
+	return true;
+    if (e->type == UGNI_REQ_RECV)
+	return recv_arrived[e->peer] >= e->target;
+    return requests.isComplete(req);
+}
+
+/* Release a done request and return its error, 0 if it succeeded. */
+static inline int request_retire(RequestTable &requests, uGNI_req_t *req) {
+    uGNI_req_entry_t *e = requests.lookup(*req);
+    int error = 0;
+
+    if (e != NULL) {
+	error = e->error;
+	requests.release(*req);
+    }
+    *req = UGNI_REQ_NULL;
+    return error;
+}
+
+/*
+ * Check a request without polling or releasing it.
+ */
+bool Node::uGNI_done(uGNI_req_t req) {
+    return request_done(requests, recv_arrived, req);
+}
+
+/*
+ * Test a request, polling the completion queues once if it is not done
+ * yet. A completed request is released and set to UGNI_REQ_NULL, and its
+ * error, 0 if it succeeded, stored in error when given.
+ */
+bool Node::uGNI_test(uGNI_req_t *req, int *error) {
+    if (*req == UGNI_REQ_NULL)
+	return true;
+
+    if (!request_done(requests, recv_arrived, *req)) {
+	uGNI_progress();
+	if (!request_done(requests, recv_arrived, *req))
+	    return false;
     }
+
+    int rc = request_retire(requests, req);
+    if (error != NULL)
+	*error = rc;
+    return true;
+}
+
+/*
+ * Wait until one request completes.
+ *
+ *   Returns: 0 on success, 1 if the request failed, 3 if no event was
+ *            received in time.
+ */
+int Node::uGNI_wait(uGNI_req_t *req) {
+    int error = 0;
+
+    if (uGNI_waitAny(1, req, &error) == -1 && *req != UGNI_REQ_NULL)
+	return 3;
+    return (error != 0) ? 1 : 0;
 }
 
-void Node::uGNI_waitAllRecvDone(int recv_from, gni_cq_handle_t cq_handle, int queue_size) {
-    int i = 0;
-    for(i = 0; i < queue_size; i++)
-	uGNI_waitRecvDone(recv_from, cq_handle);
+/*
+ * Wait until any of the requests completes, release it and return its
+ * index; its error, 0 if it succeeded, is stored in error when given.
+ * Returns -1 if every request is UGNI_REQ_NULL or on timeout.
+ */
+int Node::uGNI_waitAny(int count, uGNI_req_t *reqs, int *error) {
+    int i;
+    int active;
+    int pending_cqs;
+    int wait_count = 0;
+
+    for (;;) {
+	active = 0;
+	pending_cqs = 0;
+	for (i = 0; i < count; i++) {
+	    if (reqs[i] == UGNI_REQ_NULL)
+		continue;
+	    active++;
+	    if (request_done(requests, recv_arrived, reqs[i])) {
+		int rc = request_retire(requests, &reqs[i]);
+		if (error != NULL)
+		    *error = rc;
+		return i;
+	    }
+	    pending_cqs |= request_cq(requests, reqs[i]);
+	}
+
+	if (active == 0)
+	    return -1;
+
+	if (uGNI_progress() > 0) {
+	    wait_count = 0;
+	} else if (uGNI_backoff(wait_cq(pending_cqs), &wait_count) != 0) {
+	    return -1;
+	}
+    }
+}
+
+/*
+ * Wait until at least one of the requests completes. Every completed
+ * request is released, its index stored in indices and, when errors is
+ * given, its error at the same position of errors.
+ *
+ *   Returns: the number of completed requests, or -1 if every request is
+ *            UGNI_REQ_NULL or on timeout.
+ */
+int Node::uGNI_waitSome(int count, uGNI_req_t *reqs, int *indices, int *errors) {
+    int i;
+    int active;
+    int completed;
+    int pending_cqs;
+    int wait_count = 0;
+
+    for (;;) {
+	active = 0;
+	completed = 0;
+	pending_cqs = 0;
+	for (i = 0; i < count; i++) {
+	    if (reqs[i] == UGNI_REQ_NULL)
+		continue;
+	    active++;
+	    if (request_done(requests, recv_arrived, reqs[i])) {
+		int rc = request_retire(requests, &reqs[i]);
+		if (errors != NULL)
+		    errors[completed] = rc;
+		indices[completed++] = i;
+	    } else {
+		pending_cqs |= request_cq(requests, reqs[i]);
+	    }
+	}
+
+	if (completed > 0)
+	    return completed;
+	if (active == 0)
+	    return -1;
+
+	if (uGNI_progress() > 0) {
+	    wait_count = 0;
+	} else if (uGNI_backoff(wait_cq(pending_cqs), &wait_count) != 0) {
+	    return -1;
+	}
+    }
+}
+
+/*
+ * Wait until every request completes.
+ *
+ *   Returns: 0 on success, 1 if any of the requests failed, 3 if no event
+ *            was received in time.
+ */
+int Node::uGNI_waitAll(int count, uGNI_req_t *reqs) {
+    int i;
+    int failed = 0;
+    int pending;
+    int pending_cqs;
+    int wait_count = 0;
+
+    for (;;) {
+	pending = 0;
+	pending_cqs = 0;
+	for (i = 0; i < count; i++) {
+	    if (reqs[i] == UGNI_REQ_NULL)
+		continue;
+	    if (request_done(requests, recv_arrived, reqs[i])) {
+		if (request_retire(requests, &reqs[i]) != 0)
+		    failed = 1;
+	    } else {
+		pending++;
+		pending_cqs |= request_cq(requests, reqs[i]);
+	    }
+	}
+
+	if (pending == 0)
+	    return failed;
+
+	if (uGNI_progress() > 0) {
+	    wait_count = 0;
+	} else if (uGNI_backoff(wait_cq(pending_cqs), &wait_count) != 0) {
+	    return 3;
+	}
+    }
 }
 
 int Node::uGNI_get_cq_event(gni_cq_handle_t cq_handle, unsigned int source_cq, unsigned int retry, gni_cq_entry_t *next_event){
@@ -486,9 +1510,12 @@ int Node::uGNI_get_cq_event(gni_cq_handle_t cq_handle, unsigned int source_cq, u
 	} else if (status != GNI_RC_NOT_DONE) {
 	    int error_code = 1;
 	    /*
-	     * An error occurred getting the event.
+	     * An error occurred getting the event. It is still handed back:
+	     * a source error event names the post that failed.
 	     */
 
+	    *next_event = event_data;
+
 	    char           *cqErrorStr;
 	    char           *cqOverrunErrorStr = "";
 	    gni_return_t    tmp_status = GNI_RC_SUCCESS;
@@ -566,38 +1593,24 @@ int Node::uGNI_get_cq_event(gni_cq_handle_t cq_handle, unsigned int source_cq, u
 	} else {
 
 	    /*
-	     * An event has not been received yet.
+	     * An event has not been received yet. Wait as the policy of
+	     * this queue says; a blocking wait may hand us the event.
 	     */
 
-	    wait_count++;
-
-	    if (wait_count >= MAXIMUM_CQ_RETRY_COUNT) {
-		/*
-		 * This prevents an indefinite retry, which could hang the
-		 * application.
-		 */
+	    int idle_rc = uGNI_cqIdle(cq_handle, source_cq, &wait_count, &event_data);
+	    if (idle_rc == 0) {
+		*next_event = event_data;
+		return 0;
+	    }
 
+	    if (idle_rc == 3) {
 		fprintf(stderr,
 			"[%s] Rank: %4i GNI_CqGetEvent    ERROR no event was received status: %d retry count: %d\n",
 			uts_info.nodename, world_rank, status, wait_count);
 		return 3;
 	    }
 
-	    /*
-	     * Release the cpu to allow the event to be received.
-	     * This is basically a sleep, if other processes need to do some work.
-	     */
-
-	    if ((wait_count % (MAXIMUM_CQ_RETRY_COUNT / 10)) == 0) {
-		/*
-		 * Sometimes it takes a little longer for
-		 * the datagram to arrive.
-		 */
-
-		usleep(50);
-	    } else {
-		sched_yield();
-	    }
+	    status = GNI_RC_NOT_DONE;
 	}
     }
 
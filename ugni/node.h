@@ -21,14 +21,25 @@
 #include <malloc.h>
 #include <sched.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "gni_pub.h"
 #include "pmi.h"
 
 #include "node_util.h"
+#include "request.h"
+#include "ring.h"
+#include "peer.h"
+#include "post.h"
+#include "reduce_kernels.h"
+
+class ThreadContext;
+class CollPlan;
 
 class Node {
     public:
+	// Set up once, then only read; worker threads with their own
+	// ThreadContext share these without locking.
 	int world_rank;
 	int world_size;
 	int nid;
@@ -37,30 +48,397 @@ class Node {
 	gni_cdm_handle_t cdm_handle;
 	gni_nic_handle_t nic_handle;
 	int modes;
+	int device_id;
+	uint8_t ptag;
+	uint32_t cookie;
 	gni_cq_handle_t cq_handle;
 	gni_cq_handle_t destination_cq_handle;
-	gni_ep_handle_t *endpoint_handles_array;
+	PeerTable peers;	/* endpoint and remote buffer of each peer */
 	mdh_addr_t      my_memory_handle;
 	mdh_addr_t *remote_memory_handle_array;
 	gni_mem_handle_t send_mem_handle;
 	gni_mem_handle_t recv_mem_handle;
 	unsigned int *all_nic_addresses;
+	bootstrap_rec_t *bootstrap_table;	/* one record per rank, in rank order */
+
+	// Ranks sharing this nid, and the node's shared bootstrap segment
+	// when the table was gathered through the node leaders.
+	int bootstrap_mode;
+	int local_size;
+	int local_index;
+	int local_leader;
+	int *local_ranks;
+	void *boot_shm;
+	size_t boot_shm_size;
+	uint64_t endpoints_bound;
+
+	// Bound endpoints kept in LRU order, most recent at the head, so that
+	// ep_cache_limit can cap how many may be bound at once (0: no cap).
+	// ep_evicting guards eviction against misses from within uGNI_progress.
+	// The cache belongs to the owner of the NIC, see uGNI_submit.
+	int ep_cache_limit;
+	int ep_cache_size;
+	bool ep_evicting;
+	int ep_lru_head;
+	int ep_lru_tail;
+	int *ep_lru_prev;
+	int *ep_lru_next;
+	uint32_t *ep_event_data;	/* remote event data each endpoint is set to */
+	uint64_t ep_hits;
+	uint64_t ep_misses;
+	uint64_t ep_evictions;
+	uint64_t ep_overflows;
 	struct utsname uts_info;
+	uint64_t send_buffer_addr;
+	uint64_t send_buffer_length;
+	uint64_t recv_buffer_length;
+	bool isSource;
+	bool isProxy;
+	bool isDest;
+
+	// Completion tracking. Posts made through the node are matched through
+	// the request table by post_id; every event is also counted per peer so
+	// that waits on a given peer are not confused by events from another.
+	// send_inflight counts the posts on the NIC whose source event has not
+	// been reaped; like the endpoints, it belongs to the owner of the NIC,
+	// which is the progress thread while it runs.
+	alignas(CACHELINE_SIZE) RequestTable requests;
+	uint64_t *send_completed;
+	uint64_t *send_expected;
+	uint64_t *recv_arrived;
+	uint64_t *recv_expected;
+
+	uint64_t *send_inflight;
+	uint64_t *send_failed;		/* failed posts no send wait has reported yet */
+
+	// Destination events are counted per arrival stream as well as per
+	// peer, so operations in flight between the same ranks at the same
+	// time never take each other's arrivals. Stream 0 is recv_arrived and
+	// recv_expected; the others are allocated on first use, see
+	// uGNI_stream. streams_held has a bit set for every held stream.
+	stream_t streams[UGNI_MAX_STREAMS];
+	uint64_t streams_held;
+	uint64_t *send_submitted;	/* posts submitted to the peer, numbers request.seq */
+	uint64_t *send_taken;		/* of those, posts the owner of the NIC took */
+
+	// Posts rejected with GNI_RC_ERROR_RESOURCE, queued per endpoint in
+	// submission order and reposted as completions free NIC resources.
+	// Only the owner of the NIC touches them.
+	pending_post_t **pending_head;
+	pending_post_t **pending_tail;
+	pending_post_t *pending_free;
+	uint64_t pending_count;
+	uint64_t pending_queued;
+	int pending_next_peer;
+
+	// CQ overrun recovery. Each put with a remote event is followed by a
+	// fenced put of a per-peer sequence number into the receiver's sync
+	// region, from which lost destination events are rebuilt.
+	bool overrun_recovery;
+	bool in_recovery;
+	int number_of_cq_entries;
+	int number_of_dest_cq_entries;
+	uint64_t *sync_region;
+	gni_mem_handle_t sync_mem_handle;
+	mdh_addr_t *remote_sync_array;
+	uGNI_req_t seq_slot_reqs[UGNI_SEQ_SLOTS];
+	uint32_t seq_slot_next;
+	uint64_t *seq_sent;
+	uint64_t *seq_snapshot;
+
+	// Source overrun flushes, owned by the owner of the NIC; posts to a
+	// peer with a flush wanted queue behind it. flush_retry is set when
+	// the NIC had no resources for a flush.
+	flush_state_t *flushes;
+	bool flush_retry;
+
+	// Destination overrun under the progress thread: the application
+	// takes a snapshot and sets recv_resync_request, the thread answers
+	// with UGNI_DONE_RESYNC once it has drained the CQ.
+	std::atomic<bool> recv_resync_request;
+	bool recv_resyncing;
+	bool recv_resync_again;
+
+	// Number of barriers run so far, of each kind; see barrier.cc.
+	uint64_t barrier_epoch;
+	uint64_t barrier_amo_epoch;
+
+	// Wait policy of the destination (0) and source (1) completion queues.
+	cq_wait_t cq_wait[2];
+
+	// Optional background progress. While the thread runs it owns the NIC
+	// and both CQs: posts reach it through submit_ring and the events it
+	// reaps come back through completion_ring.
+	pthread_t progress_thread;
+	std::atomic<bool> progress_running;
+	MpscRing<progress_post_t> *submit_ring;
+	SpscRing<progress_completion_t> *completion_ring;
+
+	// Delivery mode policy of each peer: a GNI_DLVMODE_* value or
+	// UGNI_DLVR_AUTO, which keeps small posts on a fixed in-order route
+	// while the peer's completion latency average stays under
+	// dlvr_latency_ns and lets everything else route adaptively.
+	uint16_t *peer_dlvr;
+	uint64_t *lat_ewma_ns;
+	uint64_t dlvr_small_bytes;
+	uint64_t dlvr_latency_ns;
+	std::atomic<uint64_t> dlvr_in_order;	/* also counted by thread contexts */
+	std::atomic<uint64_t> dlvr_adaptive;
+
+	// Tags of tagged destination events not taken yet, oldest at
+	// recv_tags_head.
+	uint32_t *recv_tags;
+	uint32_t recv_tags_cap;
+	uint32_t recv_tags_head;
+	uint32_t recv_tags_count;
+
+	// Tuning of uGNI_broadcast, see uGNI_setBroadcast.
+	uint64_t bcast_chunk_bytes;
+	int bcast_fanout;
+
+	// Tuning of uGNI_allreduce, see uGNI_setAllreduce, and the count of
+	// collectives started so far, which numbers them for uGNI_collSignal.
+	uint64_t allreduce_chunk_bytes;
+	uint64_t allreduce_rd_bytes;
+	uint64_t coll_epoch;
+
+	// Tuning of uGNI_alltoall, see uGNI_setAlltoall, and the order the
+	// peers are visited in, see uGNI_topoOrder.
+	uint64_t a2a_chunk_bytes;
+	int a2a_window;
+	int a2a_per_peer;
+	int *a2a_order;
+
+	// Hierarchical collectives, see hier.cc: the node's shared segment,
+	// the size of its data slots, the count of hierarchical collectives
+	// run so far, and the node leaders in rank order with the leader of
+	// every rank.
+	void *hier_shm;
+	size_t hier_shm_size;
+	uint64_t hier_slot_bytes;
+	uint64_t hier_epoch;
+	int num_leaders;
+	int *leaders;
+	int *leader_of;
+
+	// Non-blocking collectives in progress, advanced by uGNI_progress.
+	// A plan holds an arrival stream from its first start until it is
+	// freed; blocking and one-shot collectives take uGNI_collStream's.
+	CollPlan *coll_running;
+	bool coll_advancing;
+
+	// Per-thread contexts, indexed by thread id.
+	ThreadContext *thread_contexts[UGNI_MAX_THREAD_CONTEXTS];
+
+	// Extra CDM instances that large puts are striped across. Channel c
+	// is the context with thread id UGNI_MAX_THREAD_CONTEXTS - 1 - c,
+	// so worker threads use ids below UGNI_MAX_THREAD_CONTEXTS - num_channels.
+	int num_channels;
+	ThreadContext *channels[UGNI_MAX_CHANNELS];
 
     public:
+	Node();
 	void uGNI_getTopoInfo();
+	void uGNI_setCdmModes(int cdm_modes, int device);
 	void uGNI_init();
+	void uGNI_setWaitPolicy(unsigned int source_cq, uGNI_wait_policy_t policy, int spin_limit, uint64_t timeout_ms);
 	void uGNI_createBasicCQ(int, int);
+	unsigned int uGNI_nicAddress(int rank);
+	void uGNI_bindEndpoint(int rank);
+
+	void uGNI_setEndpointCacheLimit(int limit);
+	gni_ep_handle_t uGNI_missEndpoint(int rank);
+	void uGNI_touchEndpoint(int rank);
+	bool uGNI_evictEndpoint();
+	void uGNI_printEndpointStats();
+
+	// Endpoint to a peer, created and bound on first use.
+	inline gni_ep_handle_t uGNI_getEndpoint(int rank) {
+	    gni_ep_handle_t ep = peers[rank].ep;
+	    if (ep == NULL)
+		return uGNI_missEndpoint(rank);
+	    ep_hits++;
+	    if (ep_lru_head != rank)
+		uGNI_touchEndpoint(rank);
+	    return ep;
+	}
+	void uGNI_setDeliveryMode(int peer, uint16_t mode);
+	void uGNI_setDeliveryAuto(uint64_t small_bytes, uint64_t latency_usec);
+	void uGNI_initDelivery();
+	void uGNI_recordLatency(int peer, uint64_t post_ns);
+	void uGNI_printDeliveryStats();
+
+	// Delivery mode of a post of length bytes to a peer, per its policy.
+	// Worker threads call it for their contexts' posts too, so the
+	// latency average is read whole and the counters are atomic.
+	inline uint16_t uGNI_dlvrMode(int peer, uint64_t length) {
+	    uint16_t mode = peer_dlvr[peer];
+	    if (mode != UGNI_DLVR_AUTO)
+		return mode;
+	    if (length <= dlvr_small_bytes && __atomic_load_n(&lat_ewma_ns[peer], __ATOMIC_RELAXED) <= dlvr_latency_ns) {
+		dlvr_in_order.fetch_add(1, std::memory_order_relaxed);
+		return GNI_DLVMODE_IN_ORDER;
+	    }
+	    dlvr_adaptive.fetch_add(1, std::memory_order_relaxed);
+	    return GNI_DLVMODE_PERFORMANCE;
+	}
+
+	// Apply the peer's policy to a post and, under the automatic policy,
+	// remember when it left so its completion updates the latency average.
+	inline void uGNI_applyDelivery(int peer, uGNI_req_entry_t *e, gni_post_descriptor_t *desc) {
+	    desc->dlvr_mode = uGNI_dlvrMode(peer, desc->length);
+	    if (peer_dlvr[peer] == UGNI_DLVR_AUTO)
+		e->post_ns = uGNI_now_ns();
+	}
+	void uGNI_setOverrunRecovery(bool enable);
+	void uGNI_regSyncRegion();
+	void uGNI_setBootstrapMode(int mode);
+	void uGNI_getLocalRanks();
+	void uGNI_bootstrapNode(bootstrap_rec_t *my_record);
+	void uGNI_bootstrapDestroy();
+	void uGNI_postSeq(int dest_rankId, int stream);
+	void uGNI_recoverSendOverrun();
+	void uGNI_retryFlushes();
+	void uGNI_postFlush(int peer);
+	bool uGNI_flushDone(gni_post_descriptor_t *desc, gni_return_t status);
+	void uGNI_flushResolved(int peer, gni_return_t status);
+	void uGNI_completeFlushed(int peer, uint64_t upto, gni_return_t status);
+	void uGNI_recoverRecvOverrun();
+	void uGNI_snapshotRecvSeq();
+	void uGNI_applyRecvSeq();
 	void uGNI_regAndExchangeMem(void *, int, void *, int);
-        void uGNI_put();
+	// Overwrites desc->post_id with the request that tracks the post.
+	gni_return_t uGNI_post(int dest_rankId, gni_post_descriptor_t *desc);
+	uGNI_req_t uGNI_postRdma(int dest_rankId, gni_post_descriptor_t *desc, int stream = 0);
+	template <class Builder>
+	uGNI_req_t uGNI_postT(int peer, uint64_t local_addr, gni_mem_handle_t local_mdh, uint64_t remote_offset, uint64_t length,
+		int stream = 0);
+	uGNI_req_t uGNI_put(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length);
+	uGNI_req_t uGNI_get(int src_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length);
+	uGNI_req_t uGNI_irecv(int source_rankId, int num_events);
+	uGNI_req_t uGNI_postTagged(int peer, uint64_t local_addr, gni_mem_handle_t local_mdh,
+		uint64_t remote_offset, uint64_t length, uint32_t tag, gni_return_t *status);
+	void uGNI_pushTag(uint32_t tag);
+	bool uGNI_pollTag(uint32_t *tag);
+	int uGNI_waitTag(uint32_t *tag);
+	int uGNI_progress();
+	void uGNI_setBroadcast(uint64_t chunk_bytes, int fanout);
+	int uGNI_broadcast(int root, void *buf, uint64_t length);
+	void uGNI_setAllreduce(uint64_t chunk_bytes, uint64_t rd_bytes);
+	uint64_t uGNI_allreduceScratch(uint64_t count, uGNI_dtype_t type);
+	int uGNI_allreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	uint64_t uGNI_reduceScratch(uint64_t count, uGNI_dtype_t type);
+	int uGNI_reduce(int root, void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	void uGNI_hierInit(uint64_t slot_bytes);
+	void uGNI_hierDestroy();
+	uint64_t uGNI_hierScratch(uint64_t count, uGNI_dtype_t type);
+	int uGNI_hierBroadcast(int root, void *buf, uint64_t length);
+	int uGNI_hierReduce(int root, void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	int uGNI_hierAllreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	void uGNI_topoOrder();
+	CollPlan *uGNI_broadcastInit(int root, void *buf, uint64_t length);
+	CollPlan *uGNI_allreduceInit(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	CollPlan *uGNI_alltoallvInit(void *sendbuf, const uint64_t *sendcounts, const uint64_t *sdispls,
+		void *recvbuf, const uint64_t *recvcounts, const uint64_t *remote_displs);
+	CollPlan *uGNI_alltoallInit(void *sendbuf, void *recvbuf, uint64_t bytes);
+	int uGNI_collQuiesce(int stream, CollPlan *plan);
+	uGNI_req_t uGNI_start(CollPlan *plan);
+	void uGNI_planFree(CollPlan *plan);
+	int uGNI_advanceCollectives();
+	uGNI_req_t uGNI_ibroadcast(int root, void *buf, uint64_t length);
+	uGNI_req_t uGNI_iallreduce(void *buf, void *scratch, uint64_t count, uGNI_dtype_t type, uGNI_op_t op);
+	uGNI_req_t uGNI_ialltoall(void *sendbuf, void *recvbuf, uint64_t bytes);
+	void uGNI_setAlltoall(uint64_t chunk_bytes, int window, int per_peer);
+	int uGNI_alltoall(void *sendbuf, void *recvbuf, uint64_t bytes);
+	int uGNI_alltoallv(void *sendbuf, const uint64_t *sendcounts, const uint64_t *sdispls,
+		void *recvbuf, const uint64_t *recvcounts, const uint64_t *remote_displs);
+	uGNI_req_t uGNI_syncWrite(int peer, uint32_t dst, uint32_t src, bool amo, bool track = false);
+	uGNI_req_t uGNI_collSignal(int peer, uint64_t epoch, bool track = false);
+	bool uGNI_collReady(int peer, uint64_t epoch);
+	int uGNI_syncWait(uint32_t word, uint64_t target);
+	int uGNI_barrier();
+	int uGNI_barrierAmo();
+	void uGNI_startProgressThread(int ring_entries, int cpu);
+	void uGNI_stopProgressThread();
+	void uGNI_progressLoop();
+	void uGNI_pushCompletion(progress_completion_t *c);
+	int uGNI_applyCompletion(progress_completion_t *c);
+	gni_return_t uGNI_postEndpoint(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data);
+	gni_return_t uGNI_postOrQueue(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data);
+	int uGNI_repostPending(int max_posts);
+	gni_return_t uGNI_submit(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data);
+
+	// Submit a post whose remote event carries our rank.
+	inline gni_return_t uGNI_submit(int dest_rankId, gni_post_descriptor_t *desc) {
+	    return uGNI_submit(dest_rankId, desc, (uint32_t) world_rank);
+	}
+	ThreadContext *uGNI_createThreadContext(int thread_id, int number_of_cq_entries, int number_of_dest_cq_entries);
+	void uGNI_createChannels(int count, int number_of_cq_entries, int number_of_dest_cq_entries,
+		void *send_buf, int send_length, void *recv_buf, int recv_length);
+	int uGNI_stripedPut(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length);
+	int uGNI_stripedWaitRecv(int source_rankId, uint64_t length);
+	void uGNI_printChannelStats();
+	bool uGNI_done(uGNI_req_t req);
+	bool uGNI_test(uGNI_req_t *req, int *error = NULL);
+	int uGNI_wait(uGNI_req_t *req);
+	int uGNI_waitAny(int count, uGNI_req_t *reqs, int *error = NULL);
+	int uGNI_waitSome(int count, uGNI_req_t *reqs, int *indices, int *errors = NULL);
+	int uGNI_waitAll(int count, uGNI_req_t *reqs);
+	int uGNI_backoff(unsigned int source_cq, int *wait_count);
+	int uGNI_cqIdle(gni_cq_handle_t cq_handle, unsigned int source_cq, int *wait_count, gni_cq_entry_t *next_event);
+	void uGNI_printWaitStats();
 	void uGNI_createAndBindEndpoints();
-	void uGNI_waitSendDone(int dest_rankId, gni_cq_handle_t cq_handle);
-	void uGNI_waitAllSendDone(int dest_rankID, gni_cq_handle_t cq_handle, int num_req);
-	void uGNI_waitRecvDone(int source_rankId, gni_cq_handle_t cq_handle);
-	void uGNI_waitAllRecvDone(int source_rankId, gni_cq_handle_t cq_handle, int num_req);
+	int uGNI_waitSendDone(int dest_rankId);
+	int uGNI_waitAllSendDone(int dest_rankID, int num_req);
+	void uGNI_waitRecvDone(int source_rankId);
+	void uGNI_waitAllRecvDone(int source_rankId, int num_req);
 	int uGNI_get_cq_event(gni_cq_handle_t cq_handle, unsigned int source_cq, unsigned int retry, gni_cq_entry_t *next_event);
+	void uGNI_handleSendEvent(gni_cq_entry_t event);
+	void uGNI_handleRecvEvent(gni_cq_entry_t event);
+	void uGNI_completeSend(int peer, gni_post_descriptor_t *desc, gni_return_t status);
+	void uGNI_completeRecv(uint32_t event_data);
+	stream_t *uGNI_stream(int stream);
+	int uGNI_streamAlloc();
+	void uGNI_streamFree(int stream);
+	int uGNI_collStream(uint64_t epoch);
 	void uGNI_printInfo();
 	void uGNI_finalize();
 };
 
+/*
+ * Post length bytes between local_addr and the peer's receive buffer at
+ * remote_offset, with the descriptor filled by Builder (see post.h), and
+ * track it in the request table. A remote event is counted in the given
+ * arrival stream at the peer.
+ */
+template <class Builder>
+inline uGNI_req_t Node::uGNI_postT(int peer, uint64_t local_addr, gni_mem_handle_t local_mdh, uint64_t remote_offset, uint64_t length, int stream) {
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, peer);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    gni_post_descriptor_t *desc = &e->local_desc;
+    peer_hot_t &p = peers.target(peer);
+
+    Builder::fill(desc, cq_handle, local_addr, local_mdh, p.remote_addr + remote_offset, p.remote_mdh, length);
+    if constexpr (Builder::dlvr_mode == UGNI_DLVR_PEER)
+	uGNI_applyDelivery(peer, e, desc);
+    desc->post_id = req;
+    e->desc = desc;
+
+    gni_return_t status = uGNI_submit(peer, desc, UGNI_EVENT_DATA(stream, world_rank));
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma %s ERROR status: %d\n", uts_info.nodename, world_rank,
+		Builder::type == GNI_POST_RDMA_GET ? "get" : "data", status);
+	postRdmaStatus(status);
+	requests.release(req);
+	return UGNI_REQ_NULL;
+    }
+
+    if constexpr (Builder::remote_event) {
+	if (overrun_recovery)
+	    uGNI_postSeq(peer, stream);
+    }
+
+    return req;
+}
+
 #endif
@@ -24,16 +24,188 @@
 
 #include "gni_pub.h"
 #include "pmi.h"
+#include "ring.h"
 
 #include <rca_lib.h>
 
 #define MAXIMUM_CQ_RETRY_COUNT 1000000
+#define MAXIMUM_CQ_WAIT_TIMEOUTS 100
+#define UGNI_MAX_THREAD_CONTEXTS 64
+#define UGNI_MAX_CHANNELS 8
+#define UGNI_STRIPE_ALIGN 64
+#define UGNI_SEQ_SLOTS 256
+#define UGNI_NIC_ADDR_UNKNOWN 0xffffffffU
+#define UGNI_EVENT_TAG 0x80000000U	/* remote event data of a tagged put, see uGNI_postTagged */
+
+/*
+ * Arrival streams, see Node::uGNI_stream. The remote event data of an
+ * untagged put carries the stream in bits 24 to 29 and the sender's rank
+ * below, so stream 0 is the plain rank. Streams 1 to UGNI_STREAMS_HELD - 1
+ * are held by persistent operations, the rest rotate by collective number.
+ */
+#define UGNI_MAX_STREAMS 64
+#define UGNI_STREAMS_HELD 32
+#define UGNI_STREAM_SHIFT 24
+#define UGNI_STREAM_RANK_MASK ((1U << UGNI_STREAM_SHIFT) - 1)
+#define UGNI_EVENT_DATA(stream, rank) (((uint32_t) (stream) << UGNI_STREAM_SHIFT) | (uint32_t) (rank))
+
+/* Defaults of the automatic delivery mode, see Node::uGNI_setDeliveryAuto. */
+#define UGNI_DLVR_SMALL_BYTES 4096
+#define UGNI_DLVR_LATENCY_NS 20000
+
+/* Defaults of uGNI_broadcast, see Node::uGNI_setBroadcast. */
+#define UGNI_BCAST_CHUNK_BYTES (64 * 1024)
+#define UGNI_BCAST_FANOUT 1	/* a chain */
+
+/* Defaults of uGNI_allreduce, see Node::uGNI_setAllreduce. */
+#define UGNI_ALLREDUCE_CHUNK_BYTES (64 * 1024)
+#define UGNI_ALLREDUCE_RD_BYTES (16 * 1024)
+
+/* Defaults of uGNI_alltoall, see Node::uGNI_setAlltoall. */
+#define UGNI_A2A_CHUNK_BYTES (64 * 1024)
+#define UGNI_A2A_WINDOW 8
+#define UGNI_A2A_PER_PEER 2
+
+/*
+ * Sync region layout, in 8 byte words. The region is registered without a
+ * CQ: puts into it raise no events and are noticed by polling. Only used
+ * inside Node, where world_size is in scope.
+ *
+ *   [0, world_size)                   recv_seq, written by the peers
+ *   [world_size, + UGNI_SEQ_SLOTS)    source words of sequence puts in flight
+ *   [world_size + UGNI_SEQ_SLOTS]     landing word of flush gets
+ *   then UGNI_BARRIER_ROUNDS          dissemination flags, written by the peers
+ *   then UGNI_BARRIER_ROUNDS          source words of the flag puts
+ *   then 3                            AMO barrier counter, release flag and
+ *                                     source word of the release puts
+ *   then 1                            source word of the ready puts
+ *   then world_size                   collective ready words, one per peer
+ *   then (UGNI_MAX_STREAMS - 1) *     recv_seq of streams 1 and up, only
+ *        world_size                   with overrun recovery
+ */
+#define UGNI_BARRIER_ROUNDS 32
+#define SYNC_SEQ_SLOT(n)     (world_size + (n))
+#define SYNC_FLUSH_WORD      (world_size + UGNI_SEQ_SLOTS)
+#define SYNC_BARRIER_FLAG(k) (SYNC_FLUSH_WORD + 1 + (k))
+#define SYNC_BARRIER_SRC(k)  (SYNC_BARRIER_FLAG(UGNI_BARRIER_ROUNDS) + (k))
+#define SYNC_AMO_COUNTER     (SYNC_BARRIER_SRC(UGNI_BARRIER_ROUNDS))
+#define SYNC_AMO_RELEASE     (SYNC_AMO_COUNTER + 1)
+#define SYNC_AMO_SRC         (SYNC_AMO_COUNTER + 2)
+#define SYNC_COLL_SRC        (SYNC_AMO_COUNTER + 3)
+#define SYNC_COLL_READY(p)   (SYNC_COLL_SRC + 1 + (p))
+#define SYNC_SEQ(s, p)       ((s) == 0 ? (p) : SYNC_COLL_READY(world_size) + ((s) - 1) * world_size + (p))
+#define SYNC_REGION_WORDS    (SYNC_COLL_READY(world_size) + (overrun_recovery ? (UGNI_MAX_STREAMS - 1) * world_size : 0))
+
+/* How uGNI_regAndExchangeMem gathers the bootstrap records. */
+#define UGNI_BOOTSTRAP_FLAT 0	/* one PMI_Allgather over all ranks */
+#define UGNI_BOOTSTRAP_NODE 1	/* node leaders only, through shared memory */
+
+/*
+ * How a rank waits for completion queue events.
+ *     UGNI_WAIT_SPIN       polls without ever giving up the cpu.
+ *     UGNI_WAIT_SPIN_YIELD polls spin_limit times, then yields between polls.
+ *     UGNI_WAIT_SPIN_BLOCK polls spin_limit times, then sleeps in GNI_CqWait
+ *                          for up to timeout_ms. The CQ must be created
+ *                          blocking, see Node::uGNI_createBasicCQ.
+ */
+typedef enum {
+        UGNI_WAIT_SPIN = 0,
+        UGNI_WAIT_SPIN_YIELD,
+        UGNI_WAIT_SPIN_BLOCK
+} uGNI_wait_policy_t;
+
+/* Used as the source_cq argument of a wait that covers both queues. */
+#define UGNI_BOTH_CQ 2
+
+typedef struct {
+        uGNI_wait_policy_t policy;
+        int             spin_limit;
+        uint64_t        timeout_ms;
+        int             max_polls;
+        int             blocking;   /* the CQ was created with GNI_CQ_BLOCKING */
+        uint64_t        spins;
+        uint64_t        yields;
+        uint64_t        sleeps;
+        uint64_t        blocks;
+        uint64_t        timeouts;
+        uint64_t        overruns;
+} cq_wait_t;
+
+/* A post handed to the progress thread, with the remote event data it raises. */
+typedef struct {
+        int             peer;
+        uint32_t        event_data;
+        gni_post_descriptor_t *desc;
+} progress_post_t;
+
+/* A post the NIC had no resources for, queued on its endpoint. */
+typedef struct pending_post {
+        gni_post_descriptor_t *desc;
+        uint32_t        event_data;
+        struct pending_post *next;
+} pending_post_t;
+
+/*
+ * Counters of one arrival stream, per peer: remote events that arrived
+ * and those claimed by receivers, and for overrun recovery the sequence
+ * numbers sent and the last snapshot of those received.
+ */
+typedef struct {
+        uint64_t        *arrived;
+        uint64_t        *expected;
+        uint64_t        *seq_sent;
+        uint64_t        *seq_snapshot;
+} stream_t;
+
+/*
+ * What the progress thread hands back to the application: an event it
+ * took off a CQ, or news of overrun recovery (see overrun.cc).
+ */
+enum {
+        UGNI_DONE_RECV = 0,	/* destination event, peer holds its event data */
+        UGNI_DONE_SEND,		/* source event or failed post of desc */
+        UGNI_DONE_FLUSHED,	/* posts to peer up to number count are done */
+        UGNI_DONE_OVERRUN,	/* a CQ overran, peer is 1 for source, 0 for destination */
+        UGNI_DONE_RESYNC	/* destination CQ drained since the resync request */
+};
+
+typedef struct {
+        int             kind;
+        int             peer;
+        gni_return_t    status;
+        gni_post_descriptor_t *desc;
+        uint64_t        count;
+} progress_completion_t;
+
+/*
+ * Flush gets of a peer after a source CQ overrun, two so that a flush
+ * whose own event was lost can be followed by another.
+ */
+typedef struct {
+        gni_post_descriptor_t desc[2];
+        int             busy[2];
+        uint64_t        covers[2];	/* upto when each was posted */
+        uint64_t        upto;	/* posts the flush covers, 0 when none is wanted */
+} flush_state_t;
 
 typedef struct {
         gni_mem_handle_t mdh;
         uint64_t        addr;
 } mdh_addr_t;
 
+/*
+ * Everything a rank needs to know about a peer at startup, gathered in a
+ * single exchange by uGNI_regAndExchangeMem.
+ */
+typedef struct {
+        int             rank;   /* must come first, see allgather() */
+        unsigned int    nic_addr;
+        int             nid;
+        pmi_mesh_coord_t coord;
+        mdh_addr_t      mem;    /* receive buffer */
+        mdh_addr_t      sync;   /* sync region, see overrun.cc */
+} bootstrap_rec_t;
+
 /*
  * get_ptag will get the ptag value associated with this process.
  *
@@ -75,50 +247,38 @@ static uint32_t get_cookie(void)
 }
 
 /*
- * allgather gather the requested information from all of the ranks.
+ * allgather gather one record of len bytes from every rank.  Each record
+ * must begin with the int rank of the rank that contributed it; PMI does
+ * not promise rank order, so the records are cycle sorted into rank order
+ * in place, without any scratch buffer.
  */
 
 static void allgather(void *in, void *out, int len)
 {
-    static int      already_called = 0;
-    int             i;
-    static int     *ivec_ptr = NULL;
-    static int      job_size = 0;
-    int             my_rank;
-    char           *out_ptr;
+    int             job_size;
+    int             i, j, target;
+    char           *out_ptr = (char *) out;
+    char           *a, *b, t;
     int             rc;
-    char           *tmp_buf;
-
-    if (!already_called) {
-	rc = PMI_Get_size(&job_size);
-	assert(rc == PMI_SUCCESS);
-
-	rc = PMI_Get_rank(&my_rank);
-	assert(rc == PMI_SUCCESS);
-
-	ivec_ptr = (int *) malloc(sizeof(int) * job_size);
-	assert(ivec_ptr != NULL);
-
-
-	rc = PMI_Allgather(&my_rank, ivec_ptr, sizeof(int));
-	assert(rc == PMI_SUCCESS);
-
-	already_called = 1;
-    }
-
-    tmp_buf = (char *) malloc(job_size * len);
-    assert(tmp_buf);
 
-    rc = PMI_Allgather(in, tmp_buf, len);
+    rc = PMI_Get_size(&job_size);
     assert(rc == PMI_SUCCESS);
 
-    out_ptr = (char *)out;
+    rc = PMI_Allgather(in, out, len);
+    assert(rc == PMI_SUCCESS);
 
     for (i = 0; i < job_size; i++) {
-	memcpy(&out_ptr[len * ivec_ptr[i]], &tmp_buf[i * len], len);
+	while ((target = *(int *) &out_ptr[len * i]) != i) {
+	    assert(target >= 0 && target < job_size);
+	    a = &out_ptr[len * i];
+	    b = &out_ptr[len * target];
+	    for (j = 0; j < len; j++) {
+		t = a[j];
+		a[j] = b[j];
+		b[j] = t;
+	    }
+	}
     }
-
-    free(tmp_buf);
 }
 
 /*
@@ -194,53 +354,6 @@ static unsigned int get_gni_nic_address(int device_id)
     return address;
 }
 
-/*
- * gather_nic_addresses gather all of the nic addresses for all of the
- *                      other ranks.
- *
- *   Returns: an array of addresses for all of the nics from all of the
- *            other ranks.
- */
-static void    *gather_nic_addresses(void)
-{
-    size_t          addr_len;
-    unsigned int   *all_addrs;
-    unsigned int    local_addr;
-    int             rc;
-    int             size;
-
-    /*
-     * Get the size of the process group.
-     */
-
-    rc = PMI_Get_size(&size);
-    assert(rc == PMI_SUCCESS);
-
-    /*
-     * Assuming a single gemini device.
-     */
-
-    local_addr = get_gni_nic_address(0);
-
-    addr_len = sizeof(unsigned int);
-
-    /*
-     * Allocate a buffer to hold the nic address from all of the other
-     * ranks.
-     */
-
-    all_addrs = (unsigned int *) malloc(addr_len * size);
-    assert(all_addrs != NULL);
-
-    /*
-     * Get the nic addresses from all of the other ranks.
-     */
-
-    allgather(&local_addr, all_addrs, sizeof(int));
-
-    return (void *) all_addrs;
-}
-
 static void postRdmaStatus(gni_return_t ret) 
 {
     if(ret == GNI_RC_SUCCESS)
@@ -270,4 +383,15 @@ static char *time_stamp(){
     return timestamp;
 }
 
+static inline uint64_t uGNI_now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+/* Bytes rounded up to whole cache lines, for slots that must not share one. */
+static inline uint64_t round_cacheline(uint64_t bytes) {
+    return (bytes + CACHELINE_SIZE - 1) & ~((uint64_t) CACHELINE_SIZE - 1);
+}
+
 #endif
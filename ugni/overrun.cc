@@ -0,0 +1,366 @@
+// CQ overrun recovery for the node class. When a completion queue
+// overflows, the events it dropped are rebuilt from state the NIC keeps
+// in memory, so the per-peer counters and the request table stay exact.
+//
+// Every put that raises a remote event is followed by a fenced 8 byte put
+// of the sender's running count for that peer into the receiver's sync
+// region. The fence orders it behind the data, so a receiver that lost
+// destination events can read how many puts of each peer have landed.
+// A sender that lost source events flushes each peer with a fenced get;
+// once the get completes every earlier post to that peer is done.
+//
+// Recovery works whichever thread owns the NIC. The owner posts the flush
+// gets and drains the CQs; the application thread, which owns the request
+// table and the counters, completes what a flush covers and folds in the
+// sequence words. While the progress thread runs the two talk through the
+// completion ring (UGNI_DONE_FLUSHED, UGNI_DONE_OVERRUN, UGNI_DONE_RESYNC)
+// and recv_resync_request.
+
+#include "node.h"
+
+/*
+ * Enable sequence puts and overrun recovery. Must be set identically on
+ * all ranks before uGNI_regAndExchangeMem, which sizes the sync region by
+ * it.
+ */
+void Node::uGNI_setOverrunRecovery(bool enable) {
+    overrun_recovery = enable;
+}
+
+/*
+ * Register the sync region. Called from uGNI_regAndExchangeMem, which
+ * exchanges its handle along with the rest of the bootstrap record. The
+ * region is needed even without overrun recovery: the barriers and the
+ * collective handshakes (barrier.cc) work on its words too.
+ */
+void Node::uGNI_regSyncRegion() {
+    gni_return_t status;
+    void *region;
+
+    int rc = posix_memalign(&region, CACHELINE_SIZE, SYNC_REGION_WORDS * sizeof(uint64_t));
+    assert(rc == 0);
+    sync_region = (uint64_t *) region;
+    memset(sync_region, 0, SYNC_REGION_WORDS * sizeof(uint64_t));
+
+    remote_sync_array = (mdh_addr_t *) calloc(world_size, sizeof(mdh_addr_t));
+    assert(remote_sync_array);
+
+    // No destination CQ: sequence puts must not consume destination events.
+    status = GNI_MemRegister(nic_handle, (uint64_t) sync_region,
+	    SYNC_REGION_WORDS * sizeof(uint64_t), NULL,
+	    GNI_MEM_READWRITE, -1, &sync_mem_handle);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout,
+		"[%s] Rank: %4i GNI_MemRegister  sync_region ERROR status: %d\n",
+		uts_info.nodename, world_rank, status);
+    }
+}
+
+/*
+ * Publish the number of remote-event puts posted to dest_rankId on the
+ * arrival stream so far. The source word of each sequence put is a slot
+ * of a small ring; a slot is reused only after the put that last read
+ * from it completed.
+ */
+void Node::uGNI_postSeq(int dest_rankId, int stream) {
+    uint64_t *sent = uGNI_stream(stream)->seq_sent;
+    uint32_t slot = seq_slot_next;
+    int wait_count = 0;
+
+    seq_slot_next = (slot + 1) % UGNI_SEQ_SLOTS;
+
+    while (requests.lookup(seq_slot_reqs[slot]) != NULL) {
+	if (uGNI_progress() == 0 && uGNI_backoff(1, &wait_count) != 0) {
+	    fprintf(stdout, "[%s] Rank: %4i sequence slot %u still busy, dropping sequence put\n",
+		    uts_info.nodename, world_rank, slot);
+	    sent[dest_rankId]++;
+	    return;
+	}
+    }
+
+    uint64_t *word = &sync_region[SYNC_SEQ_SLOT(slot)];
+    *word = ++sent[dest_rankId];
+
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, dest_rankId);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    gni_post_descriptor_t *desc = &e->local_desc;
+
+    memset(desc, 0, sizeof(gni_post_descriptor_t));
+    desc->type = GNI_POST_RDMA_PUT;
+    desc->cq_mode = GNI_CQMODE_GLOBAL_EVENT;
+    desc->dlvr_mode = GNI_DLVMODE_PERFORMANCE;
+    desc->local_addr = (uint64_t) word;
+    desc->local_mem_hndl = sync_mem_handle;
+    desc->remote_addr = remote_sync_array[dest_rankId].addr + SYNC_SEQ(stream, world_rank) * sizeof(uint64_t);
+    desc->remote_mem_hndl = remote_sync_array[dest_rankId].mdh;
+    desc->length = sizeof(uint64_t);
+    desc->rdma_mode = GNI_RDMAMODE_FENCE;
+    desc->src_cq_hndl = cq_handle;
+    desc->post_id = req;
+    e->desc = desc;
+    e->internal = 1;
+
+    gni_return_t status = uGNI_submit(dest_rankId, desc);
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma sequence ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	postRdmaStatus(status);
+	requests.release(req);
+	req = UGNI_REQ_NULL;
+    }
+
+    seq_slot_reqs[slot] = req;
+}
+
+/*
+ * Source CQ overrun: flush every peer that still has posts on the NIC.
+ * The posts taken so far are numbered send_taken[p], in the order they
+ * were submitted, and the flush covers exactly those: further posts to
+ * the peer queue behind it until it completes, see uGNI_flushResolved.
+ * A peer whose flush is already out gets a second one, in case the first
+ * lost its event too. Called only by the owner of the NIC; a flush the
+ * NIC has no resources for is retried from the next poll.
+ */
+void Node::uGNI_recoverSendOverrun() {
+    int p;
+
+    if (flushes == NULL) {
+	flushes = (flush_state_t *) calloc(world_size, sizeof(flush_state_t));
+	assert(flushes != NULL);
+    }
+
+    flush_retry = false;
+    for (p = 0; p < world_size; p++) {
+	flush_state_t *f = &flushes[p];
+
+	if (f->upto == 0) {
+	    if (send_inflight[p] == 0 || send_taken[p] == 0)
+		continue;
+	    f->upto = send_taken[p];
+	}
+	uGNI_postFlush(p);
+    }
+}
+
+/* Post the flushes the NIC had no resources for earlier. */
+void Node::uGNI_retryFlushes() {
+    int p;
+
+    flush_retry = false;
+    for (p = 0; p < world_size; p++) {
+	flush_state_t *f = &flushes[p];
+	if (f->upto != 0 && !f->busy[0] && !f->busy[1])
+	    uGNI_postFlush(p);
+    }
+}
+
+/*
+ * Post a fenced get to the peer on a free flush descriptor. Both busy
+ * means two flushes are out already; the first to complete settles the
+ * peer.
+ */
+void Node::uGNI_postFlush(int peer) {
+    flush_state_t *f = &flushes[peer];
+    int slot = f->busy[0] ? 1 : 0;
+
+    if (f->busy[slot])
+	return;
+
+    gni_post_descriptor_t *desc = &f->desc[slot];
+    memset(desc, 0, sizeof(gni_post_descriptor_t));
+    desc->type = GNI_POST_RDMA_GET;
+    desc->cq_mode = GNI_CQMODE_GLOBAL_EVENT;
+    desc->dlvr_mode = GNI_DLVMODE_PERFORMANCE;
+    desc->local_addr = (uint64_t) &sync_region[SYNC_FLUSH_WORD];
+    desc->local_mem_hndl = sync_mem_handle;
+    desc->remote_addr = remote_sync_array[peer].addr;
+    desc->remote_mem_hndl = remote_sync_array[peer].mdh;
+    desc->length = sizeof(uint64_t);
+    desc->rdma_mode = GNI_RDMAMODE_FENCE;
+    desc->src_cq_hndl = cq_handle;
+
+    gni_return_t status = uGNI_postEndpoint(peer, desc, (uint32_t) world_rank);
+    if (status == GNI_RC_ERROR_RESOURCE) {
+	flush_retry = true;
+	return;
+    }
+    if (status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma flush ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	postRdmaStatus(status);
+	uGNI_flushResolved(peer, status);
+	return;
+    }
+
+    f->busy[slot] = 1;
+    f->covers[slot] = f->upto;
+    send_inflight[peer]++;
+}
+
+/*
+ * Take a reaped source event that belongs to a flush get.
+ *
+ *   Returns: true if desc was a flush descriptor.
+ */
+bool Node::uGNI_flushDone(gni_post_descriptor_t *desc, gni_return_t status) {
+    if (flushes == NULL || desc == NULL)
+	return false;
+
+    char *first = (char *) flushes;
+    char *d = (char *) desc;
+    if (d < first || d >= first + world_size * sizeof(flush_state_t))
+	return false;
+
+    int p = (d - first) / sizeof(flush_state_t);
+    flush_state_t *f = &flushes[p];
+    int slot = (desc == &f->desc[0]) ? 0 : 1;
+
+    f->busy[slot] = 0;
+    if (send_inflight[p] > 0)
+	send_inflight[p]--;
+
+    // A flush that covers what the peer waits for settles it; an older
+    // one that turns up late only frees its descriptor.
+    if (f->upto != 0 && f->covers[slot] == f->upto) {
+	if (status != GNI_RC_SUCCESS)
+	    fprintf(stdout, "[%s] Rank: %4i flush of rank %d ERROR status: %d\n", uts_info.nodename, world_rank, p, status);
+	uGNI_flushResolved(p, status);
+    }
+    return true;
+}
+
+/*
+ * Every post to the peer up to flushes[peer].upto is done, and those
+ * whose events were not reaped lost them: hand that to the application
+ * thread and let the posts queued behind the flush go. A failed flush
+ * proves nothing, so the posts it covers are reported failed with its
+ * status. Called only by the owner of the NIC.
+ */
+void Node::uGNI_flushResolved(int peer, gni_return_t status) {
+    flush_state_t *f = &flushes[peer];
+    uint64_t upto = f->upto;
+
+    f->upto = 0;
+    send_inflight[peer] = f->busy[0] + f->busy[1];
+
+    if (completion_ring != NULL) {
+	progress_completion_t c;
+	c.kind = UGNI_DONE_FLUSHED;
+	c.peer = peer;
+	c.status = status;
+	c.desc = NULL;
+	c.count = upto;
+	uGNI_pushCompletion(&c);
+    } else {
+	uGNI_completeFlushed(peer, upto, status);
+    }
+}
+
+/*
+ * Complete the send requests to the peer up to submission number upto
+ * that are still open: their events were lost. Those that turned up
+ * before the flush are complete already.
+ */
+void Node::uGNI_completeFlushed(int peer, uint64_t upto, gni_return_t status) {
+    uint32_t slot;
+
+    for (slot = 0; slot < requests.capacity; slot++) {
+	uGNI_req_entry_t *e = requests.entry(slot);
+	if (e->type != UGNI_REQ_SEND || e->peer != peer || e->seq == 0 || e->seq > upto || e->desc == NULL)
+	    continue;
+	if (requests.isComplete(UGNI_REQ_MAKE(e->generation, slot)))
+	    continue;
+	e->post_ns = 0;
+	uGNI_completeSend(peer, e->desc, status);
+    }
+}
+
+/*
+ * Destination CQ overrun: the sequence words are read before the CQ is
+ * drained, so every put they account for has either left its event in
+ * the CQ or lost it. Taking the maximum never counts an arrival twice,
+ * and the reconciliation may be repeated as often as needed. While the
+ * progress thread owns the CQ it drains it and answers with
+ * UGNI_DONE_RESYNC, upon which the snapshot is applied; an overrun in
+ * the meantime starts another round once that one is done.
+ */
+void Node::uGNI_recoverRecvOverrun() {
+    gni_cq_entry_t event;
+    bool again;
+    int rc;
+
+    if (destination_cq_handle == NULL)
+	return;
+
+    // The progress thread owns the CQ for as long as its ring exists.
+    if (completion_ring != NULL) {
+	if (recv_resyncing) {
+	    recv_resync_again = true;
+	    return;
+	}
+	uGNI_snapshotRecvSeq();
+	recv_resyncing = true;
+	recv_resync_request.store(true, std::memory_order_release);
+	return;
+    }
+
+    in_recovery = true;
+
+    do {
+	again = false;
+	uGNI_snapshotRecvSeq();
+	while ((rc = uGNI_get_cq_event(destination_cq_handle, 0, 0, &event)) == 0 || rc == 1) {
+	    if (rc == 0)
+		uGNI_handleRecvEvent(event);
+	}
+	if (rc == 2) {
+	    cq_wait[0].overruns++;
+	    again = true;
+	}
+	uGNI_applyRecvSeq();
+    } while (again);
+
+    in_recovery = false;
+}
+
+/*
+ * Read what every peer says it has put to us so far, on every stream. A
+ * stream only peers have used yet is taken up here.
+ */
+void Node::uGNI_snapshotRecvSeq() {
+    volatile uint64_t *recv_seq = sync_region;
+    int num_streams = overrun_recovery ? UGNI_MAX_STREAMS : 1;
+    int s, p;
+
+    for (s = 0; s < num_streams; s++) {
+	for (p = 0; p < world_size; p++) {
+	    uint64_t seq = recv_seq[SYNC_SEQ(s, p)];
+	    if (seq != 0 || streams[s].arrived != NULL)
+		uGNI_stream(s)->seq_snapshot[p] = seq;
+	}
+    }
+}
+
+/*
+ * Fold the snapshot into the arrival counters, once every event it
+ * accounts for has been taken off the CQ.
+ */
+void Node::uGNI_applyRecvSeq() {
+    int s, p;
+
+    for (s = 0; s < UGNI_MAX_STREAMS; s++) {
+	stream_t *st = &streams[s];
+	if (st->arrived == NULL)
+	    continue;
+	for (p = 0; p < world_size; p++) {
+	    if (st->arrived[p] < st->seq_snapshot[p])
+		st->arrived[p] = st->seq_snapshot[p];
+	}
+    }
+
+    if (recv_resyncing) {
+	recv_resyncing = false;
+	if (recv_resync_again) {
+	    recv_resync_again = false;
+	    uGNI_recoverRecvOverrun();
+	}
+    }
+}
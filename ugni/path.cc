@@ -0,0 +1,201 @@
+// Completion driven path scheduler and the tagged remote events it
+// relies on. A tagged put raises a destination event whose data carries
+// UGNI_EVENT_TAG and a 31 bit tag, here the chunk index, instead of the
+// sender's rank; the receiver collects the tags in arrival order.
+
+#include "path.h"
+
+/*
+ * Put length bytes from local_addr into the peer's receive buffer at
+ * remote_offset, raising a remote event tagged with tag. The tag goes
+ * with the post through uGNI_submit, so tagged puts are queued for NIC
+ * resources and handed to the progress thread like any other post. On
+ * failure UGNI_REQ_NULL is returned with *status set. Tagged events are
+ * not counted per peer, and overrun recovery does not cover them.
+ */
+uGNI_req_t Node::uGNI_postTagged(int peer, uint64_t local_addr, gni_mem_handle_t local_mdh,
+	uint64_t remote_offset, uint64_t length, uint32_t tag, gni_return_t *status) {
+    assert(tag < UGNI_EVENT_TAG);
+
+    uGNI_req_t req = requests.alloc(UGNI_REQ_SEND, peer);
+    uGNI_req_entry_t *e = requests.lookup(req);
+    gni_post_descriptor_t *desc = &e->local_desc;
+    peer_hot_t &p = peers.target(peer);
+
+    PutSignalPost::fill(desc, cq_handle, local_addr, local_mdh, p.remote_addr + remote_offset, p.remote_mdh, length);
+    uGNI_applyDelivery(peer, e, desc);
+    desc->post_id = req;
+    e->desc = desc;
+
+    *status = uGNI_submit(peer, desc, UGNI_EVENT_TAG | tag);
+    if (*status != GNI_RC_SUCCESS) {
+	fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma tagged ERROR status: %d\n", uts_info.nodename, world_rank, *status);
+	postRdmaStatus(*status);
+	requests.release(req);
+	return UGNI_REQ_NULL;
+    }
+
+    return req;
+}
+
+/* Queue the tag of a tagged destination event. */
+void Node::uGNI_pushTag(uint32_t tag) {
+    if (recv_tags_count == recv_tags_cap) {
+	recv_tags_cap = (recv_tags_cap > 0) ? 2 * recv_tags_cap : 256;
+	recv_tags = (uint32_t *) realloc(recv_tags, recv_tags_cap * sizeof(uint32_t));
+	assert(recv_tags != NULL);
+    }
+    recv_tags[recv_tags_count++] = tag;
+}
+
+/*
+ * Take the oldest tag that arrived, polling the CQs once if none has.
+ *
+ *   Returns: true if *tag was set.
+ */
+bool Node::uGNI_pollTag(uint32_t *tag) {
+    if (recv_tags_head == recv_tags_count)
+	uGNI_progress();
+    if (recv_tags_head == recv_tags_count)
+	return false;
+
+    *tag = recv_tags[recv_tags_head++];
+    if (recv_tags_head == recv_tags_count)
+	recv_tags_head = recv_tags_count = 0;
+    return true;
+}
+
+/*
+ * Wait for the next tag.
+ *
+ *   Returns: 0 on success, 3 if no event was received in time.
+ */
+int Node::uGNI_waitTag(uint32_t *tag) {
+    int wait_count = 0;
+
+    while (!uGNI_pollTag(tag)) {
+	if (uGNI_backoff(0, &wait_count) != 0)
+	    return 3;
+    }
+    return 0;
+}
+
+void PathScheduler::init(Node *n, int count, const int *peers, int inflight) {
+    int i;
+
+    assert(count > 0 && count <= UGNI_MAX_PATHS);
+    assert(inflight > 0 && inflight <= UGNI_PATH_MAX_INFLIGHT);
+
+    node = n;
+    num_paths = count;
+    max_inflight = inflight;
+    memset(paths, 0, sizeof(paths));
+    for (i = 0; i < num_paths; i++)
+	paths[i].peer = peers[i];
+}
+
+void PathScheduler::resetStats() {
+    int i;
+
+    for (i = 0; i < num_paths; i++) {
+	paths[i].chunks = 0;
+	paths[i].bytes = 0;
+	paths[i].busy_ns = 0;
+    }
+}
+
+/*
+ * Put length bytes of the send buffer at local_offset to remote_offset on
+ * the paths, chunk_bytes at a time. Chunk k covers bytes
+ * [k * chunk_bytes, (k + 1) * chunk_bytes) of the transfer and its put is
+ * tagged k; it lands at the same offset whichever path carries it. Paths
+ * are refilled as their chunks complete, lowest path first, until every
+ * chunk was put.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int PathScheduler::run(uint64_t local_offset, uint64_t remote_offset, uint64_t length, uint64_t chunk_bytes) {
+    uint64_t num_chunks = (length + chunk_bytes - 1) / chunk_bytes;
+    uint64_t next_chunk = 0;
+    int outstanding = 0;
+    int wait_count = 0;
+    int rc = 0;
+    int i, k;
+
+    assert(num_chunks < UGNI_EVENT_TAG);
+
+    while (next_chunk < num_chunks || outstanding > 0) {
+	int work = node->uGNI_progress();
+
+	for (i = 0; i < num_paths; i++) {
+	    path_state_t *p = &paths[i];
+
+	    // Reap completed chunks, keeping the in-flight slots packed.
+	    for (k = 0; k < p->inflight; ) {
+		if (!node->uGNI_done(p->reqs[k])) {
+		    k++;
+		    continue;
+		}
+		int error = 0;
+		node->uGNI_test(&p->reqs[k], &error);
+		if (error)
+		    rc = 1;
+		p->reqs[k] = p->reqs[--p->inflight];
+		outstanding--;
+		p->chunks++;
+		work++;
+		if (p->inflight == 0)
+		    p->busy_ns += uGNI_now_ns() - p->busy_since;
+	    }
+
+	    while (p->inflight < max_inflight && next_chunk < num_chunks && rc == 0) {
+		uint64_t offset = next_chunk * chunk_bytes;
+		uint64_t size = (offset + chunk_bytes > length) ? length - offset : chunk_bytes;
+		gni_return_t status;
+
+		uGNI_req_t req = node->uGNI_postTagged(p->peer, node->send_buffer_addr + local_offset + offset,
+			node->send_mem_handle, remote_offset + offset, size, (uint32_t) next_chunk, &status);
+		if (req == UGNI_REQ_NULL) {
+		    rc = 1;
+		    break;
+		}
+
+		if (p->inflight == 0)
+		    p->busy_since = uGNI_now_ns();
+		p->reqs[p->inflight++] = req;
+		p->bytes += size;
+		outstanding++;
+		next_chunk++;
+		work++;
+	    }
+	}
+
+	if (rc != 0 && outstanding == 0)
+	    break;
+
+	if (work > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+
+	if (node->uGNI_backoff(1, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i PathScheduler    ERROR %d chunks never completed\n",
+		    node->uts_info.nodename, node->world_rank, outstanding);
+	    return 3;
+	}
+    }
+
+    return rc;
+}
+
+void PathScheduler::printStats() {
+    int i;
+
+    for (i = 0; i < num_paths; i++) {
+	path_state_t *p = &paths[i];
+	double mbps = (p->busy_ns > 0) ? p->bytes * 1000.0 / p->busy_ns : 0.0;
+
+	printf("rank %d path %d via rank %4d: %lu chunks %lu bytes %.2f MB/s\n",
+		node->world_rank, i, p->peer, p->chunks, p->bytes, mbps);
+    }
+}
@@ -0,0 +1,40 @@
+// Completion driven path scheduler for the node class. A transfer is cut
+// into fixed size chunks and every path (a peer the chunks are put to,
+// the destination itself or a proxy relaying to it) keeps at most
+// max_inflight of them in flight. Whichever path completes a chunk first
+// takes the next one, so fast paths carry most of the data and a slow
+// path no longer sets the total time.
+
+#ifndef PATH_H
+#define PATH_H
+
+#include "node.h"
+
+#define UGNI_MAX_PATHS 16
+#define UGNI_PATH_MAX_INFLIGHT 64
+
+typedef struct {
+    int             peer;
+    int             inflight;
+    uGNI_req_t      reqs[UGNI_PATH_MAX_INFLIGHT];
+    uint64_t        chunks;
+    uint64_t        bytes;
+    uint64_t        busy_ns;	/* time with at least one chunk in flight */
+    uint64_t        busy_since;
+} path_state_t;
+
+class PathScheduler {
+    public:
+	Node *node;
+	int num_paths;
+	int max_inflight;
+	path_state_t paths[UGNI_MAX_PATHS];
+
+    public:
+	void init(Node *node, int num_paths, const int *peers, int max_inflight);
+	int run(uint64_t local_offset, uint64_t remote_offset, uint64_t length, uint64_t chunk_bytes);
+	void resetStats();
+	void printStats();
+};
+
+#endif
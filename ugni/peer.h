@@ -0,0 +1,81 @@
+/*
+** Per-peer table of the node class. The fields every post reads are packed
+** into one record that never straddles a cache line, so a put to a peer
+** touches a single line however many peers are in use. Colder per-peer data
+** (NIC address, topology) stays in the bootstrap tables.
+**
+** The remote buffer of a peer is copied in from the exchanged table the
+** first time a post targets it, and the records live in anonymous pages
+** that are zero-filled on first touch, so a rank only pays for the peers it
+** talks to and the node-shared bootstrap tables stay the only full copy.
+*/
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "gni_pub.h"
+#include "node_util.h"
+#include "ring.h"
+
+#define PEER_HOT_BYTES (sizeof(gni_ep_handle_t) + sizeof(uint64_t) + sizeof(gni_mem_handle_t))
+
+typedef struct alignas(PEER_HOT_BYTES <= CACHELINE_SIZE / 2 ? CACHELINE_SIZE / 2 : CACHELINE_SIZE) {
+    gni_ep_handle_t ep;			/* NULL until bound */
+    uint64_t        remote_addr;	/* base of the peer's receive buffer, 0 until first post */
+    gni_mem_handle_t remote_mdh;
+} peer_hot_t;
+
+static_assert(sizeof(peer_hot_t) <= CACHELINE_SIZE && CACHELINE_SIZE % sizeof(peer_hot_t) == 0,
+	"a peer_hot_t must not straddle a cache line");
+
+class PeerTable {
+    public:
+	peer_hot_t     *hot;
+	int             size;
+	const mdh_addr_t *remote;	/* exchanged receive buffers, possibly node-shared */
+
+    public:
+	void init(int num_peers) {
+	    hot = (peer_hot_t *) mmap(NULL, num_peers * sizeof(peer_hot_t), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    assert(hot != MAP_FAILED);
+	    size = num_peers;
+	    remote = NULL;
+	}
+
+	/* Points the table at the receive buffers once they are exchanged. */
+	void attach(const mdh_addr_t *table) {
+	    remote = table;
+	}
+
+	inline peer_hot_t &operator[](int rank) {
+	    return hot[rank];
+	}
+
+	/* The record of a peer about to be posted to, its remote buffer filled in. */
+	inline peer_hot_t &target(int rank) {
+	    peer_hot_t &p = hot[rank];
+
+	    if (__builtin_expect(p.remote_addr == 0, 0)) {
+		assert(remote != NULL);
+		p.remote_addr = remote[rank].addr;
+		p.remote_mdh = remote[rank].mdh;
+	    }
+	    return p;
+	}
+
+	void destroy() {
+	    munmap(hot, size * sizeof(peer_hot_t));
+	    hot = NULL;
+	    size = 0;
+	    remote = NULL;
+	}
+};
+
+#endif
@@ -58,8 +58,8 @@ int main(int argc, char **argv)
 
     int             create_destination_cq = 1;
     uint64_t        data = SEND_DATA;
-    register int    i;
-    register int    j;
+    int             i;
+    int             j;
     int             rc;
     gni_post_descriptor_t *rdma_data_desc;
     int             receive_from;
@@ -186,7 +186,7 @@ int main(int argc, char **argv)
 	rdma_data_desc[i].src_cq_hndl = node.cq_handle;
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     int num_transfers = 0;
 
@@ -206,7 +206,7 @@ int main(int argc, char **argv)
 		rdma_data_desc[i].remote_addr += i * win_size;
 		rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
 		rdma_data_desc[i].length = win_size;// - sizeof(uint64_t);
-		status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+		status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 		if (status != GNI_RC_SUCCESS) {
 		    fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, node.world_rank, status);
 		    postRdmaStatus(status);
@@ -216,14 +216,14 @@ int main(int argc, char **argv)
 	    }   /* end of for loop for transfers */
 
 	    //Check to make sure that all sends are done.
-	    node.uGNI_waitAllSendDone(send_to, node.cq_handle, num_loops);
+	    node.uGNI_waitAllSendDone(send_to, num_loops);
 	    //printf("Rank 0 done all\n");
 	}
 
 	/*Act as a proxy*/
 	if(node.isProxy) {
 	    for(i = 0; i < num_loops; i++) {
-		node.uGNI_waitRecvDone(receive_from, node.destination_cq_handle);
+		node.uGNI_waitRecvDone(receive_from);
 		//printf("done waiting at rank 2\n");
 		rdma_data_desc[i].local_addr = (uint64_t) send_buffer;
 		rdma_data_desc[i].local_addr += i * win_size;
@@ -232,7 +232,7 @@ int main(int argc, char **argv)
 		rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
 		rdma_data_desc[i].length = win_size;// - sizeof(uint64_t);
 
-		status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+		status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 		if (status != GNI_RC_SUCCESS) {
 		    fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, node.world_rank, status);
 		    postRdmaStatus(status);
@@ -241,14 +241,14 @@ int main(int argc, char **argv)
 		//printf("Rank 2 posted a message\n");
 	    }
 	    //Check to make sure that all sends are done.
-	    node.uGNI_waitAllSendDone(send_to, node.cq_handle, num_loops);
+	    node.uGNI_waitAllSendDone(send_to, num_loops);
 	    //printf("Rank 2 done all\n");
 	}
 
 	/*Destination to receive data*/
 	if(node.isDest) {
 	    //Check to get all data received
-	    node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, num_loops);
+	    node.uGNI_waitAllRecvDone(receive_from, num_loops);
 	    //printf("Rank 3 done waiting all\n");
 	}
 
@@ -269,7 +269,7 @@ int main(int argc, char **argv)
 	    memset(receive_buffer, 0, nbytes*iters);
 	}
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	node.uGNI_barrier();
     }
 
     /*Direct transfer*/
@@ -282,7 +282,7 @@ int main(int argc, char **argv)
     if(node.isDest)
 	receive_from = source;
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
 
@@ -294,23 +294,23 @@ int main(int argc, char **argv)
 	    rdma_data_desc[i].remote_addr += i * nbytes;
 	    rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
 	    rdma_data_desc[i].length = nbytes;// - sizeof(uint64_t);
-	    status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+	    status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 	    if (status != GNI_RC_SUCCESS) {
 		fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d, iter %dth\n", uts_info.nodename, node.world_rank, status, i+1);
 		postRdmaStatus(status);
 		continue;
 	    }
 	}
-	node.uGNI_waitAllSendDone(send_to, node.cq_handle, iters);
+	node.uGNI_waitAllSendDone(send_to, iters);
     }
 
     if(node.isDest) {
-	node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, iters);
+	node.uGNI_waitAllRecvDone(receive_from, iters);
     }
 
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     double latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     double max_latency = 0;
@@ -327,7 +327,7 @@ int main(int argc, char **argv)
 	memset(receive_buffer, 0, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     if(node.world_rank == 0)
 	printf("\nDirect transfer using MPI_Put\n");
@@ -348,7 +348,7 @@ int main(int argc, char **argv)
     MPI_Win_create((void *)win_buf, nbytes*iters, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &win);
 
     /*Direct transfer using MPI_Put*/
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
     MPI_Win_fence(0, win);
@@ -364,7 +364,7 @@ int main(int argc, char **argv)
     MPI_Win_fence(0, win);
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     max_latency = 0;
@@ -381,7 +381,7 @@ int main(int argc, char **argv)
 	memset(win_buf, 7, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     if(node.world_rank == 0)
         printf("\nDirect transfer using MPI_Isend/MPI_Irecv\n");
@@ -414,7 +414,7 @@ int main(int argc, char **argv)
 
     gettimeofday(&t2, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0/iters;
     max_latency = 0;
@@ -431,7 +431,7 @@ int main(int argc, char **argv)
         memset(win_buf, 0, nbytes*iters);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     node.uGNI_finalize();
 
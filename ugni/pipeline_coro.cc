@@ -0,0 +1,126 @@
+/*
+ ** Pipelined transfer through one proxy, written with coroutines.
+ ** Source, proxy and destination are straight-line code; the scheduler
+ ** keeps every chunk in flight and resumes each stage as its events arrive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "mpi.h"
+
+#include "coro.h"
+
+#define CHUNK_SIZE      (128*1024)
+#define MESSAGE_SIZE    (4*1024*1024)
+
+Task source(Scheduler &s, int to, int num_chunks, int chunk) {
+    std::vector<Op> puts;
+    puts.reserve(num_chunks);
+
+    for (int i = 0; i < num_chunks; i++)
+	puts.push_back(s.put(to, (uint64_t) i * chunk, (uint64_t) i * chunk, chunk));
+
+    for (int i = 0; i < num_chunks; i++)
+	co_await puts[i];
+}
+
+Task proxy(Scheduler &s, int from, int to, int num_chunks, int chunk) {
+    std::vector<Op> puts;
+    puts.reserve(num_chunks);
+
+    // Forward each chunk as soon as it lands, without waiting for earlier forwards.
+    for (int i = 0; i < num_chunks; i++) {
+	co_await s.recv_signal(from);
+	puts.push_back(s.put(to, (uint64_t) i * chunk, (uint64_t) i * chunk, chunk));
+    }
+
+    for (int i = 0; i < num_chunks; i++)
+	co_await puts[i];
+}
+
+Task destination(Scheduler &s, int from, int num_chunks) {
+    co_await s.recv_signal(from, num_chunks);
+}
+
+int main(int argc, char **argv)
+{
+    int chunk = CHUNK_SIZE;
+    int nbytes = MESSAGE_SIZE;
+
+    if(argc == 3) {
+	chunk = atoi(argv[1])*1024;
+	nbytes = atoi(argv[2])*1024;
+    }
+
+    MPI_Init(&argc, &argv);
+
+    int num_chunks = nbytes/chunk;
+
+    Node node;
+    node.uGNI_init();
+    node.uGNI_createBasicCQ(num_chunks, num_chunks);
+    node.uGNI_createAndBindEndpoints();
+
+    /* The same buffer is registered for sending and receiving, so the proxy forwards what it received. */
+    char *buf;
+    int rc = posix_memalign((void **) &buf, 64, nbytes);
+    assert(rc == 0);
+    memset(buf, 0, nbytes);
+
+    node.uGNI_regAndExchangeMem(buf, nbytes, buf, nbytes);
+
+    int source_rank = 0;
+    int dest_rank = node.world_size - 1;
+    int proxy_rank = node.world_size/2;
+
+    if(node.world_rank == source_rank)
+	memset(buf, 7, nbytes);
+
+    Scheduler sched(&node);
+    if(node.world_rank == source_rank)
+	sched.spawn(source(sched, proxy_rank, num_chunks, chunk));
+    if(node.world_rank == proxy_rank)
+	sched.spawn(proxy(sched, source_rank, dest_rank, num_chunks, chunk));
+    if(node.world_rank == dest_rank)
+	sched.spawn(destination(sched, proxy_rank, num_chunks));
+
+    struct timeval t1, t2;
+
+    node.uGNI_barrier();
+    gettimeofday(&t1, NULL);
+
+    if (sched.run() != 0)
+	printf("Rank %d timed out waiting for data\n", node.world_rank);
+
+    gettimeofday(&t2, NULL);
+
+    double latency = ((t2.tv_sec * 1000000 + t2.tv_usec) - (t1.tv_sec * 1000000 + t1.tv_usec))*1.0;
+    double max_latency = 0;
+    MPI_Reduce(&latency, &max_latency, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if(node.world_rank == 0) {
+	double bandwidth = nbytes*1000000.0/(max_latency*1024*1024);
+	printf("%d \t %8.6f \t %8.4f\n", chunk, bandwidth, max_latency);
+    }
+
+    if(node.world_rank == dest_rank) {
+	for(int i = 0; i < nbytes; i++) {
+	    if(buf[i] != 7) {
+		printf("Error:  Invalid received data!\n");
+		break;
+	    }
+	}
+    }
+
+    node.uGNI_barrier();
+
+    node.uGNI_finalize();
+    free(buf);
+
+    PMI_Finalize();
+    MPI_Finalize();
+
+    return 0;
+}
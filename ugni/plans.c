@@ -0,0 +1,237 @@
+/*
+ ** Persistent and non-blocking collectives overlapped with computation
+ **
+ ** usage: plans.x [runs kbytes compute_usec]
+ **
+ ** A broadcast, an allreduce and an all-to-all are planned once over
+ ** disjoint parts of the receive buffer and restarted together for every
+ ** run, then the same is done with uGNI_ibroadcast, uGNI_iallreduce and
+ ** uGNI_ialltoall. Each run computes for compute_usec while the
+ ** collectives progress from uGNI_test, and every run's results are
+ ** checked.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+#include "collectives.h"
+
+#define NUMBER_OF_RUNS           100
+#define TRANSFER_KBYTES          64
+#define COMPUTE_USEC             200
+#define ROOT                     0
+
+enum { COLL_BCAST = 0, COLL_ALLREDUCE, COLL_ALLTOALL, COLLS };
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+/*
+ * Stand-in for application work, polling the requests now and then. A
+ * request that completes with an error sets *failed.
+ */
+static double compute(Node *node, int usec, uGNI_req_t *reqs, int count, int *failed) {
+    struct timeval t1, t2;
+    double x = 1.0;
+
+    gettimeofday(&t1, NULL);
+    do {
+	for(int j = 0; j < 1000; j++)
+	    x = x * 1.0000001 + 1e-9;
+	for(int c = 0; c < count; c++) {
+	    int error = 0;
+	    if(node->uGNI_test(&reqs[c], &error) && error != 0)
+		*failed = 1;
+	}
+	gettimeofday(&t2, NULL);
+    } while(elapsed_usec(&t1, &t2) < usec);
+
+    return x;
+}
+
+static void fill_inputs(Node *node, char *bcast_buf, uint64_t bcast_bytes, int64_t *vec, uint64_t count,
+	char *a2a_send, uint64_t block, int run) {
+    uint64_t j;
+    int p;
+
+    if(node->world_rank == ROOT) {
+	for(j = 0; j < bcast_bytes; j++)
+	    bcast_buf[j] = (char) (j * 7 + 3 + run);
+    }
+    for(j = 0; j < count; j++)
+	vec[j] = node->world_rank + run + (int64_t) j;
+    for(p = 0; p < node->world_size; p++) {
+	for(j = 0; j < block; j++)
+	    a2a_send[p * block + j] = (char) (node->world_rank * 31 + p * 17 + j + run);
+    }
+}
+
+/* One flag per collective whose result differs from what the run must give. */
+static int check_outputs(Node *node, const char *bcast_buf, uint64_t bcast_bytes, const int64_t *vec, uint64_t count,
+	const char *a2a_recv, uint64_t block, int run) {
+    int64_t n = node->world_size;
+    int errors = 0;
+    uint64_t j;
+    int p;
+
+    for(j = 0; j < bcast_bytes; j++) {
+	if(bcast_buf[j] != (char) (j * 7 + 3 + run)) {
+	    errors |= 1 << COLL_BCAST;
+	    break;
+	}
+    }
+    for(j = 0; j < count; j++) {
+	if(vec[j] != n * (n - 1) / 2 + n * (run + (int64_t) j)) {
+	    errors |= 1 << COLL_ALLREDUCE;
+	    break;
+	}
+    }
+    for(p = 0; p < n; p++) {
+	for(j = 0; j < block; j++) {
+	    if(a2a_recv[p * block + j] != (char) (p * 31 + node->world_rank * 17 + j + run)) {
+		errors |= 1 << COLL_ALLTOALL;
+		break;
+	    }
+	}
+    }
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = NUMBER_OF_RUNS;
+    uint64_t nbytes = TRANSFER_KBYTES*1024;
+    int compute_usec = COMPUTE_USEC;
+    int run, c, rc;
+
+    if(argc == 4) {
+	runs = atoi(argv[1]);
+	nbytes = atoi(argv[2])*1024;
+	compute_usec = atoi(argv[3]);
+    }
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+    int n = node.world_size;
+
+    // Three collectives in flight at once, each putting to several peers.
+    int number_of_cq_entries = 256;
+    int number_of_dest_cq_entries = 4 * n + 1024;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    // Receive buffer: broadcast data, allreduce vector and scratch, all-to-all blocks.
+    uint64_t count = nbytes / sizeof(int64_t);
+    uint64_t block = (nbytes / n + 3) & ~3ULL;
+    uint64_t vec_off = nbytes;
+    uint64_t scratch_off = vec_off + count * sizeof(int64_t);
+    uint64_t a2a_off = (scratch_off + node.uGNI_allreduceScratch(count, UGNI_INT64) + 63) & ~63ULL;
+    uint64_t recv_bytes = a2a_off + n * block;
+    uint64_t send_bytes = n * block;
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, send_bytes);
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, recv_bytes);
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, send_bytes, receive_buffer, recv_bytes);
+
+    char *bcast_buf = receive_buffer;
+    int64_t *vec = (int64_t *) (receive_buffer + vec_off);
+    char *scratch = receive_buffer + scratch_off;
+    char *a2a_recv = receive_buffer + a2a_off;
+
+    CollPlan *plans[COLLS];
+    plans[COLL_BCAST] = node.uGNI_broadcastInit(ROOT, bcast_buf, nbytes);
+    plans[COLL_ALLREDUCE] = node.uGNI_allreduceInit(vec, scratch, count, UGNI_INT64, UGNI_SUM);
+    plans[COLL_ALLTOALL] = node.uGNI_alltoallInit(send_buffer, a2a_recv, block);
+
+    if(node.world_rank == ROOT) {
+	printf("\nranks = %d, bytes = %lu, runs = %d, compute = %d usec\n", n, nbytes, runs, compute_usec);
+	printf("\nMode  \t\t run lat \t compute lat\n");
+    }
+
+    struct timeval t1, t2;
+    uGNI_req_t reqs[COLLS];
+    double sink = 0;
+
+    // Computation alone, for comparison.
+    node.uGNI_barrier();
+    gettimeofday(&t1, NULL);
+    for(run = 0; run < runs; run++)
+	sink += compute(&node, compute_usec, NULL, 0, NULL);
+    gettimeofday(&t2, NULL);
+    double compute_latency = elapsed_usec(&t1, &t2)/runs;
+
+    for(int oneshot = 0; oneshot < 2; oneshot++) {
+	int errors = 0;
+
+	node.uGNI_barrier();
+	gettimeofday(&t1, NULL);
+	for(run = 0; run < runs; run++) {
+	    fill_inputs(&node, bcast_buf, nbytes, vec, count, send_buffer, block, run);
+	    if(oneshot) {
+		reqs[COLL_BCAST] = node.uGNI_ibroadcast(ROOT, bcast_buf, nbytes);
+		reqs[COLL_ALLREDUCE] = node.uGNI_iallreduce(vec, scratch, count, UGNI_INT64, UGNI_SUM);
+		reqs[COLL_ALLTOALL] = node.uGNI_ialltoall(send_buffer, a2a_recv, block);
+	    } else {
+		for(c = 0; c < COLLS; c++)
+		    reqs[c] = node.uGNI_start(plans[c]);
+	    }
+
+	    int failed = 0;
+	    sink += compute(&node, compute_usec, reqs, COLLS, &failed);
+
+	    if(node.uGNI_waitAll(COLLS, reqs) != 0 || failed)
+		fprintf(stderr, "Rank %d run %d of the %s collectives failed\n", node.world_rank, run,
+			oneshot ? "non-blocking" : "persistent");
+	    errors |= check_outputs(&node, bcast_buf, nbytes, vec, count, a2a_recv, block, run);
+	}
+	gettimeofday(&t2, NULL);
+
+	double latency = elapsed_usec(&t1, &t2)/runs;
+	double max_latency = 0;
+	MPI_Reduce(&latency, &max_latency, 1, MPI_DOUBLE, MPI_MAX, ROOT, MPI_COMM_WORLD);
+
+	int all_errors = 0;
+	MPI_Reduce(&errors, &all_errors, 1, MPI_INT, MPI_BOR, ROOT, MPI_COMM_WORLD);
+
+	if(node.world_rank == ROOT) {
+	    printf("%s \t %8.2f \t %8.2f\n", oneshot ? "non-blocking" : "persistent", max_latency, compute_latency);
+	    if(all_errors != 0)
+		printf("Error: wrong results from%s%s%s\n", (all_errors & (1 << COLL_BCAST)) ? " broadcast" : "",
+			(all_errors & (1 << COLL_ALLREDUCE)) ? " allreduce" : "",
+			(all_errors & (1 << COLL_ALLTOALL)) ? " alltoall" : "");
+	}
+    }
+
+    for(c = 0; c < COLLS; c++)
+	node.uGNI_planFree(plans[c]);
+
+    if(sink == 0)
+	printf("Rank %d computed nothing\n", node.world_rank);
+
+    node.uGNI_barrier();
+    node.uGNI_finalize();
+
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+** Compile-time specialized post descriptors for the node class. The
+** operation, completion mode, fence and delivery mode are template
+** parameters, so filling a descriptor stores constants and only the
+** per-call fields vary. Hot loops pick a variant at compile time and get
+** an inlined fill with no runtime branches.
+*/
+
+#ifndef POST_H
+#define POST_H
+
+#include <stdint.h>
+
+#include "gni_pub.h"
+
+/*
+ * Delivery modes that are not GNI_DLVMODE_* values. UGNI_DLVR_PEER as the
+ * Dlvr of a builder defers to the destination's policy at post time (see
+ * Node::uGNI_dlvrMode); UGNI_DLVR_AUTO as a peer policy chooses by size
+ * and observed latency.
+ */
+#define UGNI_DLVR_PEER 0xffff
+#define UGNI_DLVR_AUTO 0xfffe
+
+template <gni_post_type_t Op, uint16_t CqMode, bool Fence, uint16_t Dlvr>
+struct PostBuilder {
+    static constexpr gni_post_type_t type = Op;
+    static constexpr uint16_t cq_mode = CqMode;
+    static constexpr uint16_t rdma_mode = Fence ? GNI_RDMAMODE_FENCE : 0;
+    static constexpr uint16_t dlvr_mode = Dlvr;
+    static constexpr bool remote_event = (CqMode & GNI_CQMODE_REMOTE_EVENT) != 0;
+
+    /* Fields that never change for a descriptor; set once when it is reused. */
+    static inline void init(gni_post_descriptor_t *desc, gni_cq_handle_t src_cq) {
+	desc->type = type;
+	desc->cq_mode = cq_mode;
+	if constexpr (dlvr_mode != UGNI_DLVR_PEER)
+	    desc->dlvr_mode = dlvr_mode;
+	desc->rdma_mode = rdma_mode;
+	desc->src_cq_hndl = src_cq;
+    }
+
+    /* Fields that change with every post. */
+    static inline void set(gni_post_descriptor_t *desc,
+	    uint64_t local_addr, gni_mem_handle_t local_mdh,
+	    uint64_t remote_addr, gni_mem_handle_t remote_mdh, uint64_t length) {
+	desc->local_addr = local_addr;
+	desc->local_mem_hndl = local_mdh;
+	desc->remote_addr = remote_addr;
+	desc->remote_mem_hndl = remote_mdh;
+	desc->length = length;
+    }
+
+    static inline void fill(gni_post_descriptor_t *desc, gni_cq_handle_t src_cq,
+	    uint64_t local_addr, gni_mem_handle_t local_mdh,
+	    uint64_t remote_addr, gni_mem_handle_t remote_mdh, uint64_t length) {
+	init(desc, src_cq);
+	set(desc, local_addr, local_mdh, remote_addr, remote_mdh, length);
+    }
+};
+
+/* Fenced put raising events on both sides: the default data transfer. */
+typedef PostBuilder<GNI_POST_RDMA_PUT, GNI_CQMODE_GLOBAL_EVENT | GNI_CQMODE_REMOTE_EVENT, true, UGNI_DLVR_PEER> PutSignalPost;
+
+/* The same, always routed in order whatever the peer's policy. */
+typedef PostBuilder<GNI_POST_RDMA_PUT, GNI_CQMODE_GLOBAL_EVENT | GNI_CQMODE_REMOTE_EVENT, true, GNI_DLVMODE_IN_ORDER> PutSignalInOrderPost;
+
+/* Put with a local event only; the receiver is told some other way. */
+typedef PostBuilder<GNI_POST_RDMA_PUT, GNI_CQMODE_GLOBAL_EVENT, false, UGNI_DLVR_PEER> PutPost;
+
+/* Get with a local event. */
+typedef PostBuilder<GNI_POST_RDMA_GET, GNI_CQMODE_GLOBAL_EVENT, false, UGNI_DLVR_PEER> GetPost;
+
+#endif
@@ -0,0 +1,396 @@
+// Background progress thread for the node class. While it runs, the thread
+// is the only one touching the NIC and the completion queues, so transfers,
+// proxies and rendezvous keep moving while the application computes.
+//
+// The NIC comes with state only its owner may touch: the endpoint cache,
+// the queues of posts waiting for resources, send_inflight, send_taken and
+// the overrun flushes. The request table and every other counter stay
+// with the application thread, which the progress thread only talks to
+// through the rings and recv_resync_request.
+
+#include "node.h"
+
+/* FMA posts (AMOs, short puts and gets) and RDMA posts take different calls. */
+static inline gni_return_t post_desc(gni_ep_handle_t ep, gni_post_descriptor_t *desc) {
+    if (desc->type == GNI_POST_RDMA_PUT || desc->type == GNI_POST_RDMA_GET)
+	return GNI_PostRdma(ep, desc);
+    return GNI_PostFma(ep, desc);
+}
+
+static void *progress_thread_main(void *arg) {
+    Node *node = (Node *) arg;
+    node->uGNI_progressLoop();
+    return NULL;
+}
+
+/*
+ * Start the progress thread. ring_entries sizes the submission and
+ * completion rings and is rounded up to a power of two; cpu pins the
+ * thread to a core, or leaves it unpinned when negative.
+ */
+void Node::uGNI_startProgressThread(int ring_entries, int cpu) {
+    uint64_t capacity = 1;
+
+    if (progress_running.load())
+	return;
+
+    while (capacity < (uint64_t) ring_entries)
+	capacity <<= 1;
+
+    // Drain what is already queued so the thread starts from empty CQs.
+    uGNI_progress();
+
+    submit_ring = new MpscRing<progress_post_t>(capacity);
+    completion_ring = new SpscRing<progress_completion_t>(capacity);
+
+    progress_running.store(true, std::memory_order_release);
+    int rc = pthread_create(&progress_thread, NULL, progress_thread_main, this);
+    if (rc != 0) {
+	fprintf(stdout, "[%s] Rank: %4i pthread_create progress thread ERROR rc: %d\n", uts_info.nodename, world_rank, rc);
+	progress_running.store(false);
+	delete submit_ring;
+	delete completion_ring;
+	submit_ring = NULL;
+	completion_ring = NULL;
+	return;
+    }
+
+    if (cpu >= 0) {
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	rc = pthread_setaffinity_np(progress_thread, sizeof(cpu_set_t), &cpuset);
+	if (rc != 0) {
+	    fprintf(stdout, "[%s] Rank: %4i pthread_setaffinity_np cpu %d ERROR rc: %d\n", uts_info.nodename, world_rank, cpu, rc);
+	}
+    }
+}
+
+/*
+ * Stop the progress thread once it has posted everything submitted so far,
+ * and apply the completions it left behind. The thread may wait for room
+ * in the completion ring on its way out, so the ring is drained until it
+ * has exited. Afterwards the application polls the CQs itself again.
+ */
+void Node::uGNI_stopProgressThread() {
+    progress_completion_t c;
+
+    if (!progress_running.load())
+	return;
+
+    progress_running.store(false, std::memory_order_release);
+    while (pthread_tryjoin_np(progress_thread, NULL) == EBUSY) {
+	while (completion_ring->pop(&c))
+	    uGNI_applyCompletion(&c);
+	sched_yield();
+    }
+
+    while (completion_ring->pop(&c))
+	uGNI_applyCompletion(&c);
+
+    delete submit_ring;
+    delete completion_ring;
+    submit_ring = NULL;
+    completion_ring = NULL;
+
+    // A resync the thread did not answer is done here, on our own CQ.
+    if (recv_resyncing) {
+	recv_resyncing = false;
+	recv_resync_again = false;
+	recv_resync_request.store(false, std::memory_order_relaxed);
+	uGNI_recoverRecvOverrun();
+    }
+}
+
+/*
+ * Hand a completion to the application thread, waiting for room in the
+ * ring. Called only by the progress thread.
+ */
+void Node::uGNI_pushCompletion(progress_completion_t *c) {
+    while (!completion_ring->push(*c))
+	sched_yield();
+}
+
+/*
+ * Apply a completion the progress thread handed back.
+ *
+ *   Returns: 1 if it completed a post or an arrival, 0 otherwise.
+ */
+int Node::uGNI_applyCompletion(progress_completion_t *c) {
+    switch (c->kind) {
+	case UGNI_DONE_RECV: uGNI_completeRecv(c->peer); return 1;
+	case UGNI_DONE_SEND: uGNI_completeSend(c->peer, c->desc, c->status); return 1;
+	case UGNI_DONE_FLUSHED: uGNI_completeFlushed(c->peer, c->count, c->status); return 1;
+	case UGNI_DONE_OVERRUN:
+	    cq_wait[c->peer ? 1 : 0].overruns++;
+	    if (c->peer == 0 && !recv_resyncing)
+		uGNI_recoverRecvOverrun();
+	    return 0;
+	case UGNI_DONE_RESYNC: uGNI_applyRecvSeq(); return 1;
+    }
+    return 0;
+}
+
+/*
+ * Post a descriptor, either directly or through the progress thread when
+ * it owns the NIC. A full submission ring is waited out, never dropped.
+ * Only the thread that owns the node submits: the request table and the
+ * per-peer counters are not synchronized. Worker threads post through a
+ * ThreadContext of their own. Never bind or look up a node endpoint
+ * anywhere else; while the progress thread runs, the endpoint cache is
+ * its own. A post with a remote event raises it with event_data, which
+ * travels with the post so the owner sets it on the endpoint.
+ */
+gni_return_t Node::uGNI_submit(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data) {
+    // Number the post, so that an overrun flush can tell what it covers.
+    uint64_t seq = ++send_submitted[dest_rankId];
+    uGNI_req_entry_t *e = requests.lookup(desc->post_id);
+    if (e != NULL && e->desc == desc)
+	e->seq = seq;
+
+    if (!progress_running.load(std::memory_order_acquire))
+	return uGNI_postOrQueue(dest_rankId, desc, event_data);
+
+    progress_post_t p;
+    p.peer = dest_rankId;
+    p.event_data = event_data;
+    p.desc = desc;
+    while (!submit_ring->push(p))
+	sched_yield();
+
+    return GNI_RC_SUCCESS;
+}
+
+/*
+ * Post on the peer's endpoint, first pointing its remote event data at
+ * event_data if the last post on it raised something else. Called only
+ * by the owner of the NIC.
+ */
+gni_return_t Node::uGNI_postEndpoint(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data) {
+    gni_ep_handle_t ep = uGNI_getEndpoint(dest_rankId);
+
+    if (ep != NULL && ep_event_data[dest_rankId] != event_data) {
+	gni_return_t status = GNI_EpSetEventData(ep, dest_rankId, event_data);
+	if (status != GNI_RC_SUCCESS) {
+	    fprintf(stdout, "[%s] Rank: %4i GNI_EpSetEventData ERROR status: %d\n", uts_info.nodename, world_rank, status);
+	    return status;
+	}
+	ep_event_data[dest_rankId] = event_data;
+    }
+
+    return post_desc(ep, desc);
+}
+
+/*
+ * Post on the endpoint unless earlier posts to the same peer are still
+ * waiting for NIC resources, or for an overrun flush, in which case this
+ * one queues behind them so fenced posts keep their order. A post
+ * rejected with GNI_RC_ERROR_RESOURCE is queued as well and counts as
+ * accepted. Called only by the owner of the NIC.
+ */
+gni_return_t Node::uGNI_postOrQueue(int dest_rankId, gni_post_descriptor_t *desc, uint32_t event_data) {
+    gni_return_t status;
+    pending_post_t *q;
+
+    if (pending_head[dest_rankId] == NULL && (flushes == NULL || flushes[dest_rankId].upto == 0)) {
+	status = uGNI_postEndpoint(dest_rankId, desc, event_data);
+	if (status == GNI_RC_SUCCESS)
+	    send_inflight[dest_rankId]++;
+	if (status != GNI_RC_ERROR_RESOURCE) {
+	    send_taken[dest_rankId]++;
+	    return status;
+	}
+    }
+
+    if (pending_free != NULL) {
+	q = pending_free;
+	pending_free = q->next;
+    } else {
+	q = (pending_post_t *) malloc(sizeof(pending_post_t));
+	assert(q != NULL);
+    }
+    q->desc = desc;
+    q->event_data = event_data;
+    q->next = NULL;
+
+    if (pending_tail[dest_rankId] != NULL)
+	pending_tail[dest_rankId]->next = q;
+    else
+	pending_head[dest_rankId] = q;
+    pending_tail[dest_rankId] = q;
+    pending_count++;
+    pending_queued++;
+
+    return GNI_RC_SUCCESS;
+}
+
+/*
+ * Repost queued descriptors, oldest first on each endpoint, visiting the
+ * endpoints round robin. An endpoint stops at its first post that is
+ * rejected for resources again, and one waiting for an overrun flush is
+ * skipped. A post that fails for any other reason is
+ * completed with its error: its request reports it, and a post made with
+ * uGNI_post is counted in send_failed for uGNI_waitAllSendDone. At most
+ * max_posts descriptors are taken off the queues, or all when negative.
+ *
+ *   Returns: the number of descriptors taken off the queues.
+ */
+int Node::uGNI_repostPending(int max_posts) {
+    gni_return_t status;
+    int taken = 0;
+    int i, p;
+
+    for (i = 0; i < world_size && pending_count > 0; i++) {
+	p = (pending_next_peer + i) % world_size;
+	if (flushes != NULL && flushes[p].upto != 0)
+	    continue;
+
+	while (pending_head[p] != NULL && taken != max_posts) {
+	    pending_post_t *q = pending_head[p];
+
+	    status = uGNI_postEndpoint(p, q->desc, q->event_data);
+	    if (status == GNI_RC_ERROR_RESOURCE)
+		break;
+
+	    pending_head[p] = q->next;
+	    if (pending_head[p] == NULL)
+		pending_tail[p] = NULL;
+	    pending_count--;
+	    send_taken[p]++;
+	    taken++;
+
+	    if (status == GNI_RC_SUCCESS) {
+		send_inflight[p]++;
+	    } else {
+		fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma queued ERROR status: %d\n", uts_info.nodename, world_rank, status);
+		postRdmaStatus(status);
+		// The progress thread, which owns the completion ring while it
+		// exists, hands the failure back; the application thread
+		// completes it directly.
+		if (completion_ring != NULL) {
+		    progress_completion_t c;
+		    c.kind = UGNI_DONE_SEND;
+		    c.peer = p;
+		    c.status = status;
+		    c.desc = q->desc;
+		    uGNI_pushCompletion(&c);
+		} else {
+		    uGNI_completeSend(p, q->desc, status);
+		}
+	    }
+
+	    q->next = pending_free;
+	    pending_free = q;
+	}
+    }
+
+    pending_next_peer = (pending_next_peer + 1) % world_size;
+
+    return taken;
+}
+
+/*
+ * Body of the progress thread: post what was submitted, then reap both
+ * CQs for as long as there is room to hand the events back. Events are
+ * left in the CQ rather than dropped when the application falls behind.
+ * An error event fails its post. An overrun is reported to the
+ * application; the thread flushes the peers itself after a source
+ * overrun, and answers the resync the application asks for after a
+ * destination overrun once it has drained the CQ.
+ */
+void Node::uGNI_progressLoop() {
+    progress_post_t p;
+    progress_completion_t c;
+    gni_cq_entry_t event;
+    gni_return_t status;
+    int rc, work;
+
+    for (;;) {
+	bool running = progress_running.load(std::memory_order_acquire);
+	bool resync = recv_resync_request.load(std::memory_order_acquire);
+	work = 0;
+
+	while (completion_ring->space() > 0 && submit_ring->pop(&p)) {
+	    status = uGNI_postOrQueue(p.peer, p.desc, p.event_data);
+	    if (status != GNI_RC_SUCCESS) {
+		// Report the failed post so its request does not hang.
+		c.kind = UGNI_DONE_SEND;
+		c.peer = p.peer;
+		c.status = status;
+		c.desc = p.desc;
+		completion_ring->push(c);
+	    }
+	    work++;
+	}
+
+	while (completion_ring->space() > 0) {
+	    rc = uGNI_get_cq_event(cq_handle, 1, 0, &event);
+	    if (rc == 2) {
+		c.kind = UGNI_DONE_OVERRUN;
+		c.peer = 1;
+		uGNI_pushCompletion(&c);
+		uGNI_recoverSendOverrun();
+		work++;
+		break;
+	    }
+	    if (rc != 0 && rc != 1)
+		break;
+	    c.kind = UGNI_DONE_SEND;
+	    c.peer = GNI_CQ_GET_INST_ID(event);
+	    c.desc = NULL;
+	    c.status = GNI_GetCompleted(cq_handle, event, &c.desc);
+	    if (c.status == GNI_RC_SUCCESS && !GNI_CQ_STATUS_OK(event))
+		c.status = GNI_RC_TRANSACTION_ERROR;
+	    work++;
+	    if (uGNI_flushDone(c.desc, c.status))
+		continue;
+	    if (c.peer >= 0 && c.peer < world_size && send_inflight[c.peer] > 0)
+		send_inflight[c.peer]--;
+	    if (c.desc != NULL)
+		completion_ring->push(c);
+	}
+
+	if (flush_retry)
+	    uGNI_retryFlushes();
+
+	rc = 3;
+	while (destination_cq_handle != NULL && completion_ring->space() > 0) {
+	    rc = uGNI_get_cq_event(destination_cq_handle, 0, 0, &event);
+	    if (rc == 2) {
+		c.kind = UGNI_DONE_OVERRUN;
+		c.peer = 0;
+		uGNI_pushCompletion(&c);
+		work++;
+		break;
+	    }
+	    if (rc != 0 && rc != 1)
+		break;
+	    // A destination error event carries no arrival we can trust.
+	    if (rc == 0) {
+		c.kind = UGNI_DONE_RECV;
+		c.peer = GNI_CQ_GET_INST_ID(event);
+		completion_ring->push(c);
+	    }
+	    work++;
+	}
+
+	// Drained since the request was read: every event of the snapshot
+	// is in the ring ahead of the answer, or lost.
+	if (resync && rc == 3 && completion_ring->space() > 0) {
+	    recv_resync_request.store(false, std::memory_order_relaxed);
+	    c.kind = UGNI_DONE_RESYNC;
+	    completion_ring->push(c);
+	    work++;
+	}
+
+	if (pending_count > 0 && completion_ring->space() > 0)
+	    work += uGNI_repostPending((int) completion_ring->space());
+
+	// Queued posts are still owed to the application; keep going.
+	if (!running && work == 0 && pending_count == 0)
+	    break;
+
+	if (work == 0 && cq_wait[1].policy != UGNI_WAIT_SPIN)
+	    sched_yield();
+    }
+}
@@ -52,8 +52,8 @@ int main(int argc, char **argv)
     MPI_Init(&argc, &argv);
 
     int             create_destination_cq = 1;
-    register int    i;
-    register int    j;
+    int             i;
+    int             j;
     int             rc;
     gni_post_descriptor_t *rdma_data_desc;
     int             receive_from;
@@ -148,7 +148,7 @@ int main(int argc, char **argv)
     }
 
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     gettimeofday(&t1, NULL);
 
@@ -161,7 +161,7 @@ int main(int argc, char **argv)
 	rdma_data_desc[i].remote_addr += i * nbytes;
 	rdma_data_desc[i].remote_mem_hndl = node.remote_memory_handle_array[send_to].mdh;
 	rdma_data_desc[i].length = nbytes;// - sizeof(uint64_t);
-	status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+	status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 	if (status != GNI_RC_SUCCESS) {
 	    fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", uts_info.nodename, node.world_rank, status);
 	    postRdmaStatus(status);
@@ -169,10 +169,10 @@ int main(int argc, char **argv)
 	}
     }
 
-    node.uGNI_waitAllSendDone(send_to, node.cq_handle, iters);
+    node.uGNI_waitAllSendDone(send_to, iters);
 
     //Check to get all data received
-    node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, iters);
+    node.uGNI_waitAllRecvDone(receive_from, iters);
 
     gettimeofday(&t2, NULL);
 
@@ -196,7 +196,7 @@ int main(int argc, char **argv)
 	printf("%d \t %8.6f \t %8.4f\n", nbytes, bandwidth, max_latency);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    node.uGNI_barrier();
 
     node.uGNI_finalize();
 
@@ -0,0 +1,161 @@
+/*
+** Local reduction kernels of the collectives: inout[i] = inout[i] op in[i]
+** for float, double and int64 vectors. The AVX-512 or AVX2 body is chosen
+** at compile time from the target flags (e.g. -march=native, or the
+** craype-haswell / craype-mic-knl modules); other targets get the scalar
+** loop, which compilers vectorize as far as they can.
+*/
+
+#ifndef REDUCE_KERNELS_H
+#define REDUCE_KERNELS_H
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+typedef enum {
+        UGNI_FLOAT = 0,
+        UGNI_DOUBLE,
+        UGNI_INT64
+} uGNI_dtype_t;
+
+typedef enum {
+        UGNI_SUM = 0,
+        UGNI_MIN,
+        UGNI_MAX
+} uGNI_op_t;
+
+static inline uint64_t dtype_size(uGNI_dtype_t type) {
+    return (type == UGNI_FLOAT) ? sizeof(float) : 8;
+}
+
+template <class T, uGNI_op_t Op>
+static inline T reduce_one(T a, T b) {
+    if constexpr (Op == UGNI_SUM)
+	return a + b;
+    else if constexpr (Op == UGNI_MIN)
+	return (b < a) ? b : a;
+    else
+	return (b > a) ? b : a;
+}
+
+template <class T, uGNI_op_t Op>
+static inline void reduce_scalar(T *inout, const T *in, uint64_t i, uint64_t n) {
+    for (; i < n; i++)
+	inout[i] = reduce_one<T, Op>(inout[i], in[i]);
+}
+
+#if defined(__AVX512F__)
+
+template <uGNI_op_t Op>
+static inline void reduce_vec(float *inout, const float *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+	__m512 a = _mm512_loadu_ps(inout + i), b = _mm512_loadu_ps(in + i);
+	if constexpr (Op == UGNI_SUM) a = _mm512_add_ps(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm512_min_ps(a, b);
+	else a = _mm512_max_ps(a, b);
+	_mm512_storeu_ps(inout + i, a);
+    }
+    reduce_scalar<float, Op>(inout, in, i, n);
+}
+
+template <uGNI_op_t Op>
+static inline void reduce_vec(double *inout, const double *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m512d a = _mm512_loadu_pd(inout + i), b = _mm512_loadu_pd(in + i);
+	if constexpr (Op == UGNI_SUM) a = _mm512_add_pd(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm512_min_pd(a, b);
+	else a = _mm512_max_pd(a, b);
+	_mm512_storeu_pd(inout + i, a);
+    }
+    reduce_scalar<double, Op>(inout, in, i, n);
+}
+
+template <uGNI_op_t Op>
+static inline void reduce_vec(int64_t *inout, const int64_t *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m512i a = _mm512_loadu_si512(inout + i), b = _mm512_loadu_si512(in + i);
+	if constexpr (Op == UGNI_SUM) a = _mm512_add_epi64(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm512_min_epi64(a, b);
+	else a = _mm512_max_epi64(a, b);
+	_mm512_storeu_si512(inout + i, a);
+    }
+    reduce_scalar<int64_t, Op>(inout, in, i, n);
+}
+
+#elif defined(__AVX2__)
+
+template <uGNI_op_t Op>
+static inline void reduce_vec(float *inout, const float *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m256 a = _mm256_loadu_ps(inout + i), b = _mm256_loadu_ps(in + i);
+	if constexpr (Op == UGNI_SUM) a = _mm256_add_ps(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm256_min_ps(a, b);
+	else a = _mm256_max_ps(a, b);
+	_mm256_storeu_ps(inout + i, a);
+    }
+    reduce_scalar<float, Op>(inout, in, i, n);
+}
+
+template <uGNI_op_t Op>
+static inline void reduce_vec(double *inout, const double *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+	__m256d a = _mm256_loadu_pd(inout + i), b = _mm256_loadu_pd(in + i);
+	if constexpr (Op == UGNI_SUM) a = _mm256_add_pd(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm256_min_pd(a, b);
+	else a = _mm256_max_pd(a, b);
+	_mm256_storeu_pd(inout + i, a);
+    }
+    reduce_scalar<double, Op>(inout, in, i, n);
+}
+
+// AVX2 has no 64 bit min/max; compare and blend instead.
+template <uGNI_op_t Op>
+static inline void reduce_vec(int64_t *inout, const int64_t *in, uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) (inout + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *) (in + i));
+	if constexpr (Op == UGNI_SUM) a = _mm256_add_epi64(a, b);
+	else if constexpr (Op == UGNI_MIN) a = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+	else a = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(b, a));
+	_mm256_storeu_si256((__m256i *) (inout + i), a);
+    }
+    reduce_scalar<int64_t, Op>(inout, in, i, n);
+}
+
+#else
+
+template <uGNI_op_t Op, class T>
+static inline void reduce_vec(T *inout, const T *in, uint64_t n) {
+    reduce_scalar<T, Op>(inout, in, 0, n);
+}
+
+#endif
+
+template <class T>
+static inline void reduce_typed(T *inout, const T *in, uint64_t n, uGNI_op_t op) {
+    switch (op) {
+	case UGNI_SUM: reduce_vec<UGNI_SUM>(inout, in, n); break;
+	case UGNI_MIN: reduce_vec<UGNI_MIN>(inout, in, n); break;
+	case UGNI_MAX: reduce_vec<UGNI_MAX>(inout, in, n); break;
+    }
+}
+
+/* inout[0 .. count) = inout op in, elementwise. */
+static inline void reduce_local(void *inout, const void *in, uint64_t count, uGNI_dtype_t type, uGNI_op_t op) {
+    switch (type) {
+	case UGNI_FLOAT:  reduce_typed((float *) inout, (const float *) in, count, op); break;
+	case UGNI_DOUBLE: reduce_typed((double *) inout, (const double *) in, count, op); break;
+	case UGNI_INT64:  reduce_typed((int64_t *) inout, (const int64_t *) in, count, op); break;
+    }
+}
+
+#endif
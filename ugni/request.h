@@ -0,0 +1,183 @@
+/*
+** Request table used by the node class to match completions to posts
+** regardless of the order in which they arrive.
+*/
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "gni_pub.h"
+
+/*
+ * A request handle carries the slot index in its low 32 bits and the
+ * generation of that slot in its high 32 bits.  The handle is stored in
+ * the post_id of the descriptor, so a source event finds its slot in O(1)
+ * and a stale handle never matches a slot that has since been reused.
+ */
+typedef uint64_t uGNI_req_t;
+
+#define UGNI_REQ_NULL             ((uGNI_req_t) 0)
+#define UGNI_REQ_SLOT(req)        ((uint32_t) ((req) & 0xffffffffUL))
+#define UGNI_REQ_GEN(req)         ((uint32_t) ((req) >> 32))
+#define UGNI_REQ_MAKE(gen, slot)  ((((uint64_t) (gen)) << 32) | (uint32_t) (slot))
+
+#define UGNI_REQ_BLOCK_SHIFT      10
+#define UGNI_REQ_BLOCK_SIZE       (1 << UGNI_REQ_BLOCK_SHIFT)
+#define UGNI_REQ_BLOCK_MASK       (UGNI_REQ_BLOCK_SIZE - 1)
+
+enum {
+    UGNI_REQ_FREE = 0,
+    UGNI_REQ_SEND,
+    UGNI_REQ_RECV,
+    UGNI_REQ_COLL		/* completed by a running CollPlan */
+};
+
+typedef struct {
+    uint32_t        generation;
+    uint32_t        next_free;
+    int             type;
+    int             peer;
+    int             internal;	/* nobody waits on it: released on completion */
+    int             counted;	/* posted with uGNI_post, counted for uGNI_waitAllSendDone */
+    uint64_t        seq;	/* send requests: number of the submission to the peer */
+    uint64_t        target;	/* receive requests: arrival count that completes it */
+    uint64_t        post_ns;	/* send requests: post time when the peer's latency is tracked */
+    int             error;	/* 0, or the gni_return_t a send failed with, or a collective's status */
+    gni_post_descriptor_t *desc;
+    gni_post_descriptor_t local_desc;	/* used by posts the node builds itself */
+} uGNI_req_entry_t;
+
+/*
+ * Entries are allocated in fixed blocks so that descriptors embedded in
+ * them keep their address while the table grows; the NIC holds on to
+ * them until GNI_GetCompleted hands them back.
+ *
+ * The table is not synchronized: only the thread that owns the node
+ * allocates, completes and releases requests. The progress thread hands
+ * its completions to that thread instead of touching the table.
+ */
+class RequestTable {
+    public:
+	uGNI_req_entry_t **blocks;
+	uint64_t       *done_bitmap;
+	uint32_t        num_blocks;
+	uint32_t        capacity;
+	uint32_t        free_head;
+	uint32_t        num_active;
+
+    public:
+	void init(uint32_t initial_capacity) {
+	    blocks = NULL;
+	    done_bitmap = NULL;
+	    num_blocks = 0;
+	    capacity = 0;
+	    free_head = UINT32_MAX;
+	    num_active = 0;
+	    while (capacity < initial_capacity)
+		grow();
+	}
+
+	void grow() {
+	    uint32_t i;
+	    uint32_t first = capacity;
+
+	    blocks = (uGNI_req_entry_t **) realloc(blocks, sizeof(uGNI_req_entry_t *) * (num_blocks + 1));
+	    assert(blocks != NULL);
+	    blocks[num_blocks] = (uGNI_req_entry_t *) calloc(UGNI_REQ_BLOCK_SIZE, sizeof(uGNI_req_entry_t));
+	    assert(blocks[num_blocks] != NULL);
+	    num_blocks++;
+	    capacity += UGNI_REQ_BLOCK_SIZE;
+
+	    done_bitmap = (uint64_t *) realloc(done_bitmap, sizeof(uint64_t) * (capacity / 64));
+	    assert(done_bitmap != NULL);
+	    memset(&done_bitmap[first / 64], 0, sizeof(uint64_t) * (UGNI_REQ_BLOCK_SIZE / 64));
+
+	    /* Chain the new slots in front of the free list, lowest slot first. */
+	    for (i = capacity; i > first; i--) {
+		uGNI_req_entry_t *e = entry(i - 1);
+		e->generation = 1;
+		e->next_free = free_head;
+		free_head = i - 1;
+	    }
+	}
+
+	inline uGNI_req_entry_t *entry(uint32_t slot) {
+	    return &blocks[slot >> UGNI_REQ_BLOCK_SHIFT][slot & UGNI_REQ_BLOCK_MASK];
+	}
+
+	uGNI_req_t alloc(int type, int peer) {
+	    if (free_head == UINT32_MAX)
+		grow();
+
+	    uint32_t slot = free_head;
+	    uGNI_req_entry_t *e = entry(slot);
+	    free_head = e->next_free;
+	    e->type = type;
+	    e->peer = peer;
+	    e->internal = 0;
+	    e->counted = 0;
+	    e->seq = 0;
+	    e->target = 0;
+	    e->post_ns = 0;
+	    e->error = 0;
+	    e->desc = NULL;
+	    done_bitmap[slot / 64] &= ~(1UL << (slot % 64));
+	    num_active++;
+
+	    return UGNI_REQ_MAKE(e->generation, slot);
+	}
+
+	/* Returns NULL for handles that are stale, freed or never issued. */
+	inline uGNI_req_entry_t *lookup(uGNI_req_t req) {
+	    uint32_t slot = UGNI_REQ_SLOT(req);
+	    if (req == UGNI_REQ_NULL || slot >= capacity)
+		return NULL;
+
+	    uGNI_req_entry_t *e = entry(slot);
+	    if (e->type == UGNI_REQ_FREE || e->generation != UGNI_REQ_GEN(req))
+		return NULL;
+	    return e;
+	}
+
+	inline void complete(uGNI_req_t req) {
+	    done_bitmap[UGNI_REQ_SLOT(req) / 64] |= 1UL << (UGNI_REQ_SLOT(req) % 64);
+	}
+
+	inline bool isComplete(uGNI_req_t req) {
+	    return (done_bitmap[UGNI_REQ_SLOT(req) / 64] >> (UGNI_REQ_SLOT(req) % 64)) & 1;
+	}
+
+	void release(uGNI_req_t req) {
+	    uint32_t slot = UGNI_REQ_SLOT(req);
+	    uGNI_req_entry_t *e = entry(slot);
+
+	    e->type = UGNI_REQ_FREE;
+	    e->desc = NULL;
+	    /* Skip generation 0 so that no live handle ever equals UGNI_REQ_NULL. */
+	    if (++e->generation == 0)
+		e->generation = 1;
+	    e->next_free = free_head;
+	    free_head = slot;
+	    num_active--;
+	}
+
+	void destroy() {
+	    uint32_t i;
+	    for (i = 0; i < num_blocks; i++)
+		free(blocks[i]);
+	    free(blocks);
+	    free(done_bitmap);
+	    blocks = NULL;
+	    done_bitmap = NULL;
+	    num_blocks = 0;
+	    capacity = 0;
+	}
+};
+
+#endif
@@ -0,0 +1,125 @@
+/*
+** Bounded lock-free rings used to talk to the progress thread
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+
+#define CACHELINE_SIZE 64
+
+/*
+ * Single producer, single consumer ring. The producer only writes tail and
+ * the consumer only writes head, so each index lives on its own cache line.
+ * capacity must be a power of two.
+ */
+template <typename T>
+class SpscRing {
+    public:
+	alignas(CACHELINE_SIZE) std::atomic<uint64_t> head;
+	alignas(CACHELINE_SIZE) std::atomic<uint64_t> tail;
+	alignas(CACHELINE_SIZE) uint64_t mask;
+	T              *slots;
+
+    public:
+	SpscRing(uint64_t capacity) : head(0), tail(0), mask(capacity - 1) {
+	    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+	    slots = (T *) calloc(capacity, sizeof(T));
+	    assert(slots != NULL);
+	}
+
+	~SpscRing() {
+	    free(slots);
+	}
+
+	bool push(const T &item) {
+	    uint64_t t = tail.load(std::memory_order_relaxed);
+	    if (t - head.load(std::memory_order_acquire) > mask)
+		return false;
+	    slots[t & mask] = item;
+	    tail.store(t + 1, std::memory_order_release);
+	    return true;
+	}
+
+	bool pop(T *item) {
+	    uint64_t h = head.load(std::memory_order_relaxed);
+	    if (h == tail.load(std::memory_order_acquire))
+		return false;
+	    *item = slots[h & mask];
+	    head.store(h + 1, std::memory_order_release);
+	    return true;
+	}
+
+	/* Free slots as seen by the producer. */
+	uint64_t space() {
+	    return mask + 1 - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+	}
+};
+
+/*
+ * Multiple producer, single consumer ring. Every cell carries a sequence
+ * number telling producers and the consumer whose turn it is, so producers
+ * only contend on the tail counter and never on the cells themselves.
+ */
+template <typename T>
+class MpscRing {
+    public:
+	typedef struct {
+	    std::atomic<uint64_t> sequence;
+	    T               item;
+	} cell_t;
+
+	alignas(CACHELINE_SIZE) std::atomic<uint64_t> tail;
+	alignas(CACHELINE_SIZE) uint64_t head;
+	alignas(CACHELINE_SIZE) uint64_t mask;
+	cell_t         *cells;
+
+    public:
+	MpscRing(uint64_t capacity) : tail(0), head(0), mask(capacity - 1) {
+	    uint64_t i;
+
+	    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+	    cells = new cell_t[capacity];
+	    for (i = 0; i < capacity; i++)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	~MpscRing() {
+	    delete [] cells;
+	}
+
+	bool push(const T &item) {
+	    uint64_t t = tail.load(std::memory_order_relaxed);
+	    for (;;) {
+		cell_t *c = &cells[t & mask];
+		int64_t diff = (int64_t) c->sequence.load(std::memory_order_acquire) - (int64_t) t;
+		if (diff == 0) {
+		    if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+			c->item = item;
+			c->sequence.store(t + 1, std::memory_order_release);
+			return true;
+		    }
+		} else if (diff < 0) {
+		    return false;
+		} else {
+		    t = tail.load(std::memory_order_relaxed);
+		}
+	    }
+	}
+
+	bool pop(T *item) {
+	    cell_t *c = &cells[head & mask];
+	    if ((int64_t) c->sequence.load(std::memory_order_acquire) - (int64_t) (head + 1) < 0)
+		return false;
+	    *item = c->item;
+	    c->sequence.store(head + mask + 1, std::memory_order_release);
+	    head++;
+	    return true;
+	}
+};
+
+#endif
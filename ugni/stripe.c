@@ -0,0 +1,146 @@
+/*
+ ** Single pair bandwidth of puts striped over 1 .. max_channels channels
+ **
+ ** usage: stripe.x [max_channels kbytes iters]
+ **
+ ** Rank 0 puts to rank 1, the other ranks only join the barriers. For
+ ** every channel count the transfer is timed as a whole and per channel,
+ ** and the received data is checked after the last put.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "gni_pub.h"
+#include "pmi.h"
+#include "mpi.h"
+
+#include "node.h"
+#include "context.h"
+
+#define MAX_CHANNELS             4
+#define TRANSFER_KBYTES          4096
+#define NUMBER_OF_ITERS          20
+#define SENDER                   0
+#define RECEIVER                 1
+
+static double elapsed_usec(struct timeval *t1, struct timeval *t2) {
+    return ((t2->tv_sec * 1000000 + t2->tv_usec) - (t1->tv_sec * 1000000 + t1->tv_usec))*1.0;
+}
+
+/* Different data for every channel count, so a stale piece shows up. */
+static void fill_payload(char *buf, int nbytes, int count) {
+    for(int j = 0; j < nbytes; j++)
+	buf[j] = (char) (j * 13 + 5 + count);
+}
+
+static int check_payload(const char *buf, int nbytes, int count) {
+    for(int j = 0; j < nbytes; j++) {
+	if(buf[j] != (char) (j * 13 + 5 + count))
+	    return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int max_channels = MAX_CHANNELS;
+    int nbytes = TRANSFER_KBYTES*1024;
+    int iters = NUMBER_OF_ITERS;
+    int count, c, i, rc;
+
+    if(argc == 4) {
+	max_channels = atoi(argv[1]);
+	nbytes = atoi(argv[2])*1024;
+	iters = atoi(argv[3]);
+    }
+    assert(max_channels > 0 && max_channels <= UGNI_MAX_CHANNELS);
+
+    MPI_Init(&argc, &argv);
+
+    Node node;
+    node.uGNI_init();
+    if(node.world_size < 2) {
+	fprintf(stderr, "stripe.x needs at least 2 ranks\n");
+	node.uGNI_finalize();
+	MPI_Finalize();
+	return 1;
+    }
+
+    int number_of_cq_entries = 64;
+    int number_of_dest_cq_entries = 64;
+    node.uGNI_createBasicCQ(number_of_cq_entries, number_of_dest_cq_entries);
+    node.uGNI_createAndBindEndpoints();
+
+    char *send_buffer;
+    char *receive_buffer;
+    rc = posix_memalign((void **) &send_buffer, 64, nbytes);
+    assert(rc == 0);
+    rc = posix_memalign((void **) &receive_buffer, 64, nbytes);
+    assert(rc == 0);
+    node.uGNI_regAndExchangeMem(send_buffer, nbytes, receive_buffer, nbytes);
+
+    // One piece per channel and put in flight, iters of them landing.
+    node.uGNI_createChannels(max_channels, number_of_cq_entries, iters + 1,
+	    send_buffer, nbytes, receive_buffer, nbytes);
+
+    if(node.world_rank == SENDER) {
+	printf("\nbytes = %d, iters = %d\n", nbytes, iters);
+	printf("\nChannels \t bw MB/s \t lat usec\n");
+    }
+
+    struct timeval t1, t2;
+
+    for(count = 1; count <= max_channels; count++) {
+	int errors = 0;
+
+	// Stripe over the first count channels only, with fresh statistics.
+	node.num_channels = count;
+	for(c = 0; c < count; c++) {
+	    node.channels[c]->bytes_put = 0;
+	    node.channels[c]->put_usec = 0;
+	    node.channels[c]->stripes = 0;
+	}
+	if(node.world_rank == SENDER)
+	    fill_payload(send_buffer, nbytes, count);
+	memset(receive_buffer, 0, nbytes);
+
+	node.uGNI_barrier();
+	gettimeofday(&t1, NULL);
+	for(i = 0; i < iters; i++) {
+	    if(node.world_rank == SENDER && node.uGNI_stripedPut(RECEIVER, 0, 0, nbytes) != 0)
+		fprintf(stderr, "Rank %d uGNI_stripedPut failed\n", node.world_rank);
+	    if(node.world_rank == RECEIVER && node.uGNI_stripedWaitRecv(SENDER, nbytes) != 0)
+		fprintf(stderr, "Rank %d uGNI_stripedWaitRecv failed\n", node.world_rank);
+	}
+	gettimeofday(&t2, NULL);
+
+	if(node.world_rank == RECEIVER)
+	    errors = check_payload(receive_buffer, nbytes, count);
+
+	int total_errors = 0;
+	MPI_Reduce(&errors, &total_errors, 1, MPI_INT, MPI_SUM, SENDER, MPI_COMM_WORLD);
+
+	if(node.world_rank == SENDER) {
+	    double latency = elapsed_usec(&t1, &t2)/iters;
+	    printf("%d \t\t %8.2f \t %8.2f\n", count, nbytes/latency, latency);
+	    node.uGNI_printChannelStats();
+	    if(total_errors > 0)
+		printf("Error: rank %d received invalid data over %d channels\n", RECEIVER, count);
+	}
+    }
+
+    node.uGNI_barrier();
+    node.uGNI_finalize();
+
+    free(receive_buffer);
+    free(send_buffer);
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Striped large transfers for the node class. A put is cut into one piece
+// per channel, each channel being a CDM instance of its own with its own
+// CQs, so the pieces travel on separate BTE channels in parallel.
+
+#include "context.h"
+
+static inline uint64_t now_usec() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (uint64_t) t.tv_sec * 1000000 + t.tv_usec;
+}
+
+/*
+ * Piece c of a length byte transfer over count channels. Pieces are
+ * UGNI_STRIPE_ALIGN aligned, so trailing channels get nothing for short
+ * transfers. Sender and receiver must agree on the split.
+ */
+static inline void stripe_piece(uint64_t length, int count, int c, uint64_t *offset, uint64_t *size) {
+    uint64_t chunk = (length + count - 1) / count;
+
+    chunk = (chunk + UGNI_STRIPE_ALIGN - 1) & ~((uint64_t) UGNI_STRIPE_ALIGN - 1);
+    *offset = (uint64_t) c * chunk;
+    if (*offset >= length) {
+	*offset = length;
+	*size = 0;
+    } else {
+	*size = (*offset + chunk > length) ? length - *offset : chunk;
+    }
+}
+
+/*
+ * Create count channels and register the transfer buffers with each of
+ * them. Channels take the highest count context thread ids, which worker
+ * threads must leave free; a channel whose id is already taken aborts the
+ * job, since the peers would wait for it in the exchange. A PMI
+ * collective, like uGNI_regAndExchangeMem: all ranks call it with the
+ * same count.
+ */
+void Node::uGNI_createChannels(int count, int number_of_cq_entries, int number_of_dest_cq_entries,
+	void *send_buf, int send_length, void *recv_buf, int recv_length) {
+    int c;
+
+    assert(count > 0 && count <= UGNI_MAX_CHANNELS);
+
+    for (c = 0; c < count; c++) {
+	ThreadContext *ctx = uGNI_createThreadContext(UGNI_MAX_THREAD_CONTEXTS - 1 - c,
+		number_of_cq_entries, number_of_dest_cq_entries);
+	if (ctx == NULL)
+	    PMI_Abort(-1, "uGNI_createChannels: channel thread id taken by a worker context");
+	ctx->uGNI_regAndExchangeMem(send_buf, send_length, recv_buf, recv_length);
+	channels[c] = ctx;
+    }
+    num_channels = count;
+}
+
+/*
+ * Put length bytes from the send buffer at local_offset into the receive
+ * buffer of dest_rankId at remote_offset, one piece per channel, and wait
+ * until every piece completed. Each channel is timed from the common start
+ * to the completion of its own piece. Pieces are followed through their
+ * descriptors, so a piece that completes after a timeout is still counted
+ * in its channel's event counters and never taken for a later one.
+ *
+ *   Returns: 0 on success, 1 if a post failed, 3 on timeout.
+ */
+int Node::uGNI_stripedPut(int dest_rankId, uint64_t local_offset, uint64_t remote_offset, uint64_t length) {
+    gni_post_descriptor_t *piece[UGNI_MAX_CHANNELS];
+    uint64_t offset[UGNI_MAX_CHANNELS];
+    uint64_t size[UGNI_MAX_CHANNELS];
+    int wait_count = 0;
+    int busy = 0;
+    int rc = 0;
+    int c;
+
+    assert(num_channels > 0);
+
+    uint64_t start = now_usec();
+
+    for (c = 0; c < num_channels; c++) {
+	ThreadContext *ctx = channels[c];
+
+	stripe_piece(length, num_channels, c, &offset[c], &size[c]);
+	if (size[c] == 0)
+	    continue;
+
+	if (ctx->uGNI_put(dest_rankId, local_offset + offset[c], remote_offset + offset[c], size[c], &piece[c]) != 0) {
+	    size[c] = 0;
+	    rc = 1;
+	    continue;
+	}
+	ctx->send_expected[dest_rankId]++;
+	busy++;
+    }
+
+    while (busy > 0) {
+	int progressed = 0;
+
+	for (c = 0; c < num_channels; c++) {
+	    ThreadContext *ctx = channels[c];
+
+	    if (size[c] == 0)
+		continue;
+	    progressed += ctx->uGNI_progress();
+	    if (piece[c]->post_id != 0)
+		continue;
+
+	    if (piece[c]->status != GNI_RC_SUCCESS) {
+		rc = 1;
+	    } else {
+		ctx->put_usec += now_usec() - start;
+		ctx->bytes_put += size[c];
+		ctx->stripes++;
+	    }
+	    size[c] = 0;
+	    busy--;
+	}
+
+	if (progressed > 0) {
+	    wait_count = 0;
+	    continue;
+	}
+
+	if (uGNI_backoff(UGNI_BOTH_CQ, &wait_count) != 0) {
+	    fprintf(stderr, "[%s] Rank: %4i uGNI_stripedPut   ERROR %d pieces to rank %d never completed\n",
+		    uts_info.nodename, world_rank, busy, dest_rankId);
+	    return 3;
+	}
+    }
+
+    return rc;
+}
+
+/*
+ * Wait for every piece of a length byte striped put from source_rankId.
+ *
+ *   Returns: 0 on success, 3 on timeout.
+ */
+int Node::uGNI_stripedWaitRecv(int source_rankId, uint64_t length) {
+    uint64_t offset, size;
+    int rc = 0;
+    int c;
+
+    for (c = 0; c < num_channels; c++) {
+	stripe_piece(length, num_channels, c, &offset, &size);
+	if (size == 0)
+	    continue;
+	if (channels[c]->uGNI_waitAllRecvDone(source_rankId, 1) != 0)
+	    rc = 3;
+    }
+
+    return rc;
+}
+
+void Node::uGNI_printChannelStats() {
+    int c;
+
+    for (c = 0; c < num_channels; c++) {
+	ThreadContext *ctx = channels[c];
+	double mbps = (ctx->put_usec > 0) ? (double) ctx->bytes_put / ctx->put_usec : 0.0;
+
+	fprintf(stdout, "[%s] Rank: %4i channel %d inst %u: %lu pieces %lu bytes %lu usec %.2f MB/s\n",
+		uts_info.nodename, world_rank, c, ctx->inst_id, ctx->stripes, ctx->bytes_put, ctx->put_usec, mbps);
+    }
+}
@@ -116,7 +116,7 @@ int main(int argc, char **argv)
 
 	    /* Send the data. */
 
-	    status = GNI_PostRdma(node.endpoint_handles_array[send_to], &rdma_data_desc[i]);
+	    status = node.uGNI_post(send_to, &rdma_data_desc[i]);
 	    if (status != GNI_RC_SUCCESS) {
 		fprintf(stdout, "[%s] Rank: %4i GNI_PostRdma data ERROR status: %d\n", node.uts_info.nodename, node.world_rank, status);
 		postRdmaStatus(status);
@@ -125,7 +125,7 @@ int main(int argc, char **argv)
 	}   /* end of for loop for transfers */
 
 	//Check to make sure that all sends are done.
-	node.uGNI_waitAllSendDone(send_to, node.cq_handle, iters);
+	node.uGNI_waitAllSendDone(send_to, iters);
 
 	if(node.world_rank == 0) {
 	    gettimeofday(&t2, NULL);
@@ -137,7 +137,7 @@ int main(int argc, char **argv)
 
     if(node.world_rank == 1) {
 	//Check to get all data received
-	node.uGNI_waitAllRecvDone(receive_from, node.destination_cq_handle, iters);
+	node.uGNI_waitAllRecvDone(receive_from, iters);
     }
 
 EXIT_WAIT_BARRIER: